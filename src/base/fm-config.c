@@ -178,6 +178,11 @@ static void fm_config_init(FmConfig *self)
     self->places_network = FM_CONFIG_DEFAULT_PLACES_NETWORK;
     self->places_unmounted = FM_CONFIG_DEFAULT_PLACES_UNMOUNTED;
     self->smart_desktop_autodrop = FM_CONFIG_DEFAULT_SMART_DESKTOP_AUTODROP;
+    self->folder_update_delay = FM_CONFIG_DEFAULT_FOLDER_UPDATE_DELAY;
+    self->folder_update_batch = FM_CONFIG_DEFAULT_FOLDER_UPDATE_BATCH;
+    self->thumbnail_workers = FM_CONFIG_DEFAULT_THUMBNAIL_WORKERS;
+    self->thumbnail_cache_size = FM_CONFIG_DEFAULT_THUMBNAIL_CACHE_SIZE;
+    self->thumbnail_pack = FM_CONFIG_DEFAULT_THUMBNAIL_PACK;
 }
 
 /**
@@ -292,6 +297,19 @@ void fm_config_load_from_key_file(FmConfig* cfg, GKeyFile* kf)
     fm_key_file_get_bool(kf, "config", "defer_content_test", &cfg->defer_content_test);
     fm_key_file_get_bool(kf, "config", "quick_exec", &cfg->quick_exec);
     fm_key_file_get_bool(kf, "config", "smart_desktop_autodrop", &cfg->smart_desktop_autodrop);
+    fm_key_file_get_int(kf, "config", "folder_update_delay", &cfg->folder_update_delay);
+    if(cfg->folder_update_delay < 0)
+        cfg->folder_update_delay = 0;
+    fm_key_file_get_int(kf, "config", "folder_update_batch", &cfg->folder_update_batch);
+    if(cfg->folder_update_batch <= 0)
+        cfg->folder_update_batch = FM_CONFIG_DEFAULT_FOLDER_UPDATE_BATCH;
+    fm_key_file_get_int(kf, "config", "thumbnail_workers", &cfg->thumbnail_workers);
+    if(cfg->thumbnail_workers < 0)
+        cfg->thumbnail_workers = FM_CONFIG_DEFAULT_THUMBNAIL_WORKERS;
+    fm_key_file_get_int(kf, "config", "thumbnail_cache_size", &cfg->thumbnail_cache_size);
+    if(cfg->thumbnail_cache_size < 0)
+        cfg->thumbnail_cache_size = 0;
+    fm_key_file_get_bool(kf, "config", "thumbnail_pack", &cfg->thumbnail_pack);
     g_free(cfg->format_cmd);
     cfg->format_cmd = g_key_file_get_string(kf, "config", "format_cmd", NULL);
     /* append blacklist */
@@ -516,6 +534,11 @@ void fm_config_save(FmConfig* cfg, const char* name)
                 _save_config_strv(str, cfg, modules_blacklist);
                 _save_config_strv(str, cfg, modules_whitelist);
                 _save_config_bool(str, cfg, smart_desktop_autodrop);
+                _save_config_int(str, cfg, folder_update_delay);
+                _save_config_int(str, cfg, folder_update_batch);
+                _save_config_int(str, cfg, thumbnail_workers);
+                _save_config_int(str, cfg, thumbnail_cache_size);
+                _save_config_bool(str, cfg, thumbnail_pack);
             g_string_append(str, "\n[ui]\n");
                 _save_config_int(str, cfg, big_icon_size);
                 _save_config_int(str, cfg, small_icon_size);
@@ -60,6 +60,9 @@ typedef struct _FmConfigClass       FmConfigClass;
 #define     FM_CONFIG_DEFAULT_SHOW_THUMBNAIL    TRUE
 #define     FM_CONFIG_DEFAULT_THUMBNAIL_LOCAL   TRUE
 #define     FM_CONFIG_DEFAULT_THUMBNAIL_MAX     2048
+#define     FM_CONFIG_DEFAULT_THUMBNAIL_WORKERS 0
+#define     FM_CONFIG_DEFAULT_THUMBNAIL_CACHE_SIZE 65536
+#define     FM_CONFIG_DEFAULT_THUMBNAIL_PACK FALSE
 
 #define     FM_CONFIG_DEFAULT_FORCE_S_NOTIFY    TRUE
 #define     FM_CONFIG_DEFAULT_DATE_ISO_8601     FALSE
@@ -85,6 +88,9 @@ typedef struct _FmConfigClass       FmConfigClass;
 
 #define     FM_CONFIG_DEFAULT_AUTO_SELECTION_DELAY 600
 
+#define     FM_CONFIG_DEFAULT_FOLDER_UPDATE_DELAY 100
+#define     FM_CONFIG_DEFAULT_FOLDER_UPDATE_BATCH 1000
+
 /* this enum is used by FmDndDest but we save it nicely in config so have it here */
 
 /**
@@ -127,6 +133,11 @@ typedef enum
  * @advanced_mode: enable advanced features for experienced user
  * @force_startup_notify: (since 1.0.1) use startup notify by default
  * @date_iso_8601: (since 1.4.0) show date in ISO 8601 format instead of current locale format
+ * @folder_update_delay: (since 1.4.1) delay to collect changes in folder before update, in ms
+ * @folder_update_batch: (since 1.4.1) max number of queued changes in folder handled at once
+ * @thumbnail_workers: (since 1.4.1) max number of threads generating thumbnails, 0 means number of processors
+ * @thumbnail_cache_size: (since 1.4.1) memory used to keep loaded thumbnails, in KB
+ * @thumbnail_pack: (since 1.4.1) keep thumbnails of each folder also in a single pack file
  * @backup_as_hidden: (since 1.0.1) treat backup files as hidden
  * @no_usb_trash: (since 1.0.1) don't create trash folder on removable media
  * @no_child_non_expandable: (since 1.0.1) hide expanders on empty folder
@@ -222,12 +233,32 @@ struct _FmConfig
         gboolean middle_click;
         gpointer _reserved2;    /*< private >*/
     };
+    union
+    {
+        gint folder_update_delay;
+        gpointer _reserved3;    /*< private >*/
+    };
+    union
+    {
+        gint folder_update_batch;
+        gpointer _reserved4;    /*< private >*/
+    };
+    union
+    {
+        gint thumbnail_workers;
+        gpointer _reserved5;    /*< private >*/
+    };
+    union
+    {
+        gint thumbnail_cache_size;
+        gpointer _reserved6;    /*< private >*/
+    };
+    union
+    {
+        gboolean thumbnail_pack;
+        gpointer _reserved7;    /*< private >*/
+    };
     /*< private >*/
-    gpointer _reserved3; /* reserved space for updates until next ABI */
-    gpointer _reserved4;
-    gpointer _reserved5;
-    gpointer _reserved6;
-    gpointer _reserved7;
     GFileMonitor *_cfg_mon;
 };
 
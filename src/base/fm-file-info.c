@@ -40,6 +40,7 @@
 
 #include <menu-cache.h>
 #include "fm-file-info.h"
+#include "fm-file-info-private.h"
 #include <glib.h>
 #include <glib/gi18n-lib.h>
 #include <grp.h> /* Query group name */
@@ -68,6 +69,12 @@
 
 static FmIcon* icon_locked_folder = NULL;
 
+/* owner and group names are the same for most of files so these are
+   looked up once and kept as interned strings */
+static GHashTable *owner_names = NULL;
+static GHashTable *group_names = NULL;
+G_LOCK_DEFINE_STATIC(id_names);
+
 /* all of the user special dirs are direct child of home directory */
 static gboolean special_dirs_all_in_home = TRUE;
 
@@ -90,24 +97,32 @@ static SpecialDirInfo special_dir_info[G_USER_N_DIRECTORIES] = {
     {NULL, NULL, "folder-videos"}
 };
 
+/* rarely used data, allocated only when requested */
+typedef struct _FmFileInfoExt
+{
+    time_t atime;
+    time_t ctime;
+    goffset blocks;
+} FmFileInfoExt;
+
+/* fields used by views for sorting and filtering go first */
 struct _FmFileInfo
 {
     FmPath* path; /* path of the file */
-
-    mode_t mode;
-    union {
-        const char* fs_id;
-        dev_t dev;
-    };
-    uid_t uid;
-    gid_t gid;
+    FmMimeType* mime_type;
     goffset size;
     time_t mtime;
-    time_t atime;
-    time_t ctime;
+    mode_t mode;
 
-    gulong blksize;
-    goffset blocks;
+    gboolean shortcut : 1; /* TRUE if file is shortcut type */
+    gboolean accessible : 1; /* TRUE if can be read by user */
+    gboolean hidden : 1; /* TRUE if file is hidden */
+    gboolean backup : 1; /* TRUE if file is backup */
+    gboolean name_is_changeable : 1; /* TRUE if name can be changed */
+    gboolean icon_is_changeable : 1; /* TRUE if icon can be changed */
+    gboolean hidden_is_changeable : 1; /* TRUE if hidden can be changed */
+    gboolean fs_is_ro : 1; /* TRUE if host FS is R/O */
+    gboolean disp_size_interned : 1; /* TRUE if disp_size is not allocated */
 
     /* FIXME: caching the collate key can greatly speed up sorting.
      *        However, memory usage is greatly increased!.
@@ -115,23 +130,19 @@ struct _FmFileInfo
      */
     char* collate_key; /* used to sort files by name */
     char* collate_key_case; /* the same but case-sensitive */
+    FmIcon* icon;
     char* disp_size;  /* displayed human-readable file size */
     char* disp_mtime; /* displayed last modification time */
-    char* disp_owner;
-    char* disp_group;
-    FmMimeType* mime_type;
-    FmIcon* icon;
 
+    uid_t uid;
+    gid_t gid;
+    union {
+        const char* fs_id;
+        dev_t dev;
+    };
     char* target; /* target of shortcut or mountable. */
-
-    gboolean shortcut : 1; /* TRUE if file is shortcut type */
-    gboolean accessible : 1; /* TRUE if can be read by user */
-    gboolean hidden : 1; /* TRUE if file is hidden */
-    gboolean backup : 1; /* TRUE if file is backup */
-    gboolean name_is_changeable : 1; /* TRUE if name can be changed */
-    gboolean icon_is_changeable : 1; /* TRUE if icon can be changed */
-    gboolean hidden_is_changeable : 1; /* TRUE if hidden can be changed */
-    gboolean fs_is_ro : 1; /* TRUE if host FS is R/O */
+    /* atime, ctime, blocks; for native files it is filled on demand */
+    FmFileInfoExt* ext;
 
     /*<private>*/
     int n_ref;
@@ -176,6 +187,14 @@ void _fm_file_info_init(void)
 void _fm_file_info_finalize()
 {
     g_object_unref(icon_locked_folder);
+    /* names may be changed until next start */
+    G_LOCK(id_names);
+    if (owner_names)
+        g_hash_table_destroy(owner_names);
+    if (group_names)
+        g_hash_table_destroy(group_names);
+    owner_names = group_names = NULL;
+    G_UNLOCK(id_names);
 }
 
 /**
@@ -241,247 +260,280 @@ static void _fm_file_info_set_emblems(FmFileInfo* fi, GFileInfo* inf)
 gboolean _fm_file_info_set_from_native_file(FmFileInfo* fi, const char* path,
                                             GError** err, gboolean get_fast)
 {
-    struct stat st;
-    char *dname;
+    struct stat lst, st;
 
     g_return_val_if_fail(fi && fi->path, FALSE);
-    if(lstat(path, &st) == 0)
+    if(lstat(path, &lst) == 0)
     {
-        GFile* gfile;
-        GFileInfo* inf;
-
-        fi->mode = st.st_mode;
-        fi->mtime = st.st_mtime;
-        fi->atime = st.st_atime;
-        fi->ctime = st.st_ctime;
-        fi->size = st.st_size;
-        fi->dev = st.st_dev;
-        fi->uid = st.st_uid;
-        fi->gid = st.st_gid;
-
         /* handle symlinks: use target to retrieve its info */
-        if(S_ISLNK(st.st_mode))
-        {
-            if (stat(path, &st) < 0)
-            {
-                /* g_debug("invalid symlink: %s", strerror(errno)); */
-                fi->icon = fm_icon_from_name("dialog-warning");
-                /* we cannot test broken symlink so skip all tests */
-                get_fast = TRUE;
-            }
-            fi->target = g_file_read_link(path, NULL);
-        }
+        if(!S_ISLNK(lst.st_mode))
+            _fm_file_info_set_from_native_stat(fi, path, &lst, &lst, get_fast);
+        else if(stat(path, &st) == 0)
+            _fm_file_info_set_from_native_stat(fi, path, &lst, &st, get_fast);
+        else
+            _fm_file_info_set_from_native_stat(fi, path, &lst, NULL, get_fast);
+    }
+    else
+    {
+        g_set_error(err, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "%s: %s", path, g_strerror(errno));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * _fm_file_info_set_from_native_stat:
+ * @fi:  A FmFileInfo struct
+ * @path:  full path of the file
+ * @lst: result of lstat() on the file
+ * @tst: (allow-none): result of stat() on the file, %NULL for broken symlink
+ * @get_fast: %TRUE to skip content tests
+ *
+ * Fills the FmFileInfo struct the same way _fm_file_info_set_from_native_file()
+ * does but uses provided stat data instead of querying it. This is used
+ * by listing jobs which do fstatat() relative to the open directory.
+ * For anything but symlink @lst and @tst should point to the same data.
+ *
+ * Note that this call still may do I/O and therefore can block.
+ */
+void _fm_file_info_set_from_native_stat(FmFileInfo *fi, const char *path,
+                                        const struct stat *lst,
+                                        const struct stat *tst, gboolean get_fast)
+{
+    struct stat st;
+    char *dname;
+    GFile* gfile;
+    GFileInfo* inf;
 
-        /* files with . prefix or ~ suffix are regarded as hidden files.
-         * dirs with . prefix are regarded as hidden dirs. */
-        dname = (char*)fm_path_get_basename(fi->path);
-        fi->hidden = (dname[0] == '.');
-        fi->backup = (!S_ISDIR(st.st_mode) && g_str_has_suffix(dname, "~"));
-        dname = NULL;
+    g_return_if_fail(fi && fi->path);
 
-        if (get_fast && S_ISREG(st.st_mode)) /* do rough estimation */
-        {
-            /* for non-regular files fm_mime_type_from_native_file() is fast */
-            if ((st.st_mode & S_IXUSR) == S_IXUSR) /* executable */
-                fi->mime_type = fm_mime_type_from_name("application/x-executable");
-            else
-                fi->mime_type = fm_mime_type_from_file_name(fm_path_get_basename(fi->path));
-        }
-        else
+    fi->mode = lst->st_mode;
+    fi->mtime = lst->st_mtime;
+    /* atime, ctime, and blocks are rarely used, see _fm_file_info_get_ext() */
+    fi->size = lst->st_size;
+    fi->dev = lst->st_dev;
+    fi->uid = lst->st_uid;
+    fi->gid = lst->st_gid;
+
+    /* handle symlinks: use target to retrieve its info */
+    if(S_ISLNK(lst->st_mode))
+    {
+        if (tst == NULL)
         {
-            fi->mime_type = fm_mime_type_from_native_file(path, fm_path_get_basename(fi->path), &st);
-            if (G_UNLIKELY(fi->mime_type == NULL))
-                /* file might be deleted while we test it but we assume mime_type is not NULL */
-                fi->mime_type = fm_mime_type_from_name("application/octet-stream");
+            /* g_debug("invalid symlink: %s", fm_path_get_basename(fi->path)); */
+            fi->icon = fm_icon_from_name("dialog-warning");
+            /* we cannot test broken symlink so skip all tests */
+            get_fast = TRUE;
+            tst = lst;
         }
+        fi->target = g_file_read_link(path, NULL);
+    }
+    st = *tst;
 
-        if (get_fast) /* do rough estimation */
-            fi->accessible = ((st.st_mode & S_IRUSR) == S_IRUSR);
+    /* files with . prefix or ~ suffix are regarded as hidden files.
+     * dirs with . prefix are regarded as hidden dirs. */
+    dname = (char*)fm_path_get_basename(fi->path);
+    fi->hidden = (dname[0] == '.');
+    fi->backup = (!S_ISDIR(st.st_mode) && g_str_has_suffix(dname, "~"));
+    dname = NULL;
+
+    if (get_fast && S_ISREG(st.st_mode)) /* do rough estimation */
+    {
+        /* for non-regular files fm_mime_type_from_native_file() is fast */
+        if ((st.st_mode & S_IXUSR) == S_IXUSR) /* executable */
+            fi->mime_type = fm_mime_type_from_name("application/x-executable");
         else
-            fi->accessible = (g_access(path, R_OK) == 0);
+            fi->mime_type = fm_mime_type_from_file_name(fm_path_get_basename(fi->path));
+    }
+    else
+    {
+        fi->mime_type = fm_mime_type_from_native_file(path, fm_path_get_basename(fi->path), &st);
+        if (G_UNLIKELY(fi->mime_type == NULL))
+            /* file might be deleted while we test it but we assume mime_type is not NULL */
+            fi->mime_type = fm_mime_type_from_name("application/octet-stream");
+    }
 
-        /* special handling for desktop entry files */
-        if(G_UNLIKELY(!get_fast && fm_file_info_is_desktop_entry(fi)))
-        {
-            GKeyFile* kf = g_key_file_new();
-            FmIcon* icon = NULL;
-            char* icon_name;
-            char* type;
+    if (get_fast) /* do rough estimation */
+        fi->accessible = ((st.st_mode & S_IRUSR) == S_IRUSR);
+    else
+        fi->accessible = (g_access(path, R_OK) == 0);
+
+    /* special handling for desktop entry files */
+    if(G_UNLIKELY(!get_fast && fm_file_info_is_desktop_entry(fi)))
+    {
+        GKeyFile* kf = g_key_file_new();
+        FmIcon* icon = NULL;
+        char* icon_name;
+        char* type;
 
-            if(g_key_file_load_from_file(kf, path, 0, NULL))
+        if(g_key_file_load_from_file(kf, path, 0, NULL))
+        {
+            /* check if type is correct and supported */
+            type = g_key_file_get_string(kf, "Desktop Entry", "Type", NULL);
+            if(type)
             {
-                /* check if type is correct and supported */
-                type = g_key_file_get_string(kf, "Desktop Entry", "Type", NULL);
-                if(type)
+                /* g_debug("got desktop entry with type %s", type); */
+                if(strcmp(type, G_KEY_FILE_DESKTOP_TYPE_LINK) == 0)
                 {
-                    /* g_debug("got desktop entry with type %s", type); */
-                    if(strcmp(type, G_KEY_FILE_DESKTOP_TYPE_LINK) == 0)
+                    char *uri = g_key_file_get_string(kf, G_KEY_FILE_DESKTOP_GROUP,
+                                                      G_KEY_FILE_DESKTOP_KEY_URL, NULL);
+                    /* handle Type=Link, those are shortcuts
+                       therefore set ->shortcut, ->target, ->mime_type */
+                    if (uri)
                     {
-                        char *uri = g_key_file_get_string(kf, G_KEY_FILE_DESKTOP_GROUP,
-                                                          G_KEY_FILE_DESKTOP_KEY_URL, NULL);
-                        /* handle Type=Link, those are shortcuts
-                           therefore set ->shortcut, ->target, ->mime_type */
-                        if (uri)
-                        {
-                            FmMimeType *new_mime_type = fm_mime_type_from_file_name(uri);
-
-                            /* g_debug("got type %s for URL %s", fm_mime_type_get_type(new_mime_type), uri); */
-                            if (strcmp(fm_mime_type_get_type(new_mime_type),
-                                       "application/octet-stream") == 0 ||
-                                /* actually remote links should never be
-                                   directories so let treat them as unknown */
-                                (new_mime_type == _fm_mime_type_get_inode_directory()
-                                 && !g_str_has_prefix(uri, "file:/")))
-                            {
-                                /* NOTE: earlier we classified all links to
-                                   desktop entry as inode/x-shortcut too but
-                                   that would require a lot of special support
-                                   therefore we set to inode/x-shortcut only
-                                   those shortcuts that we fail to determine */
-                                fm_mime_type_unref(new_mime_type);
-                                new_mime_type = fm_mime_type_ref(_fm_mime_type_get_inode_x_shortcut());
-                            }
-                            fm_mime_type_unref(fi->mime_type);
-                            fi->mime_type = new_mime_type;
-                            fi->shortcut = TRUE;
-                            fi->target = uri;
-                        }
-                        else
+                        FmMimeType *new_mime_type = fm_mime_type_from_file_name(uri);
+
+                        /* g_debug("got type %s for URL %s", fm_mime_type_get_type(new_mime_type), uri); */
+                        if (strcmp(fm_mime_type_get_type(new_mime_type),
+                                   "application/octet-stream") == 0 ||
+                            /* actually remote links should never be
+                               directories so let treat them as unknown */
+                            (new_mime_type == _fm_mime_type_get_inode_directory()
+                             && !g_str_has_prefix(uri, "file:/")))
                         {
-                            /* otherwise it's error, Link should have URL */
-                            g_free(type);
-                            goto _not_desktop_entry;
+                            /* NOTE: earlier we classified all links to
+                               desktop entry as inode/x-shortcut too but
+                               that would require a lot of special support
+                               therefore we set to inode/x-shortcut only
+                               those shortcuts that we fail to determine */
+                            fm_mime_type_unref(new_mime_type);
+                            new_mime_type = fm_mime_type_ref(_fm_mime_type_get_inode_x_shortcut());
                         }
+                        fm_mime_type_unref(fi->mime_type);
+                        fi->mime_type = new_mime_type;
+                        fi->shortcut = TRUE;
+                        fi->target = uri;
+                    }
+                    else
+                    {
+                        /* otherwise it's error, Link should have URL */
+                        g_free(type);
+                        goto _not_desktop_entry;
                     }
-                    /* FIXME: fail if Type isn't Application or Directory */
-                    g_free(type);
-                }
-                else
-                    goto _not_desktop_entry;
-                icon_name = g_key_file_get_string(kf, "Desktop Entry", "Icon", NULL);
-                if(icon_name)
-                {
-                    icon = fm_icon_from_name(icon_name);
-                    g_free(icon_name);
                 }
-                /* Use title of the desktop entry for display */
-                dname = g_key_file_get_locale_string(kf, "Desktop Entry", "Name", NULL, NULL);
-                /* handle 'Hidden' key to set hidden attribute */
-                if (!fi->hidden)
-                    fi->hidden = g_key_file_get_boolean(kf, "Desktop Entry", "Hidden", NULL);
+                /* FIXME: fail if Type isn't Application or Directory */
+                g_free(type);
             }
             else
+                goto _not_desktop_entry;
+            icon_name = g_key_file_get_string(kf, "Desktop Entry", "Icon", NULL);
+            if(icon_name)
             {
-                /* otherwise it's error so treat the file as simple text */
-_not_desktop_entry:
-                fm_mime_type_unref(fi->mime_type);
-                fi->mime_type = fm_mime_type_from_name("text/plain");
+                icon = fm_icon_from_name(icon_name);
+                g_free(icon_name);
             }
-            if(icon)
-                fi->icon = icon;
-            else
-                fi->icon = g_object_ref(fm_mime_type_get_icon(fi->mime_type));
-            g_key_file_free(kf);
+            /* Use title of the desktop entry for display */
+            dname = g_key_file_get_locale_string(kf, "Desktop Entry", "Name", NULL, NULL);
+            /* handle 'Hidden' key to set hidden attribute */
+            if (!fi->hidden)
+                fi->hidden = g_key_file_get_boolean(kf, "Desktop Entry", "Hidden", NULL);
         }
-        else if(!S_ISDIR(st.st_mode))
-            ;
-        /* set "locked" icon on unaccesible folder */
-        else if(!fi->accessible)
-            fi->icon = g_object_ref(icon_locked_folder);
-        else if(!get_fast && S_ISDIR(st.st_mode)) /* special handling for folder icons */
+        else
         {
-            FmPath* fmpath = fi->path;
+            /* otherwise it's error so treat the file as simple text */
+_not_desktop_entry:
+            fm_mime_type_unref(fi->mime_type);
+            fi->mime_type = fm_mime_type_from_name("text/plain");
+        }
+        if(icon)
+            fi->icon = icon;
+        else
+            fi->icon = g_object_ref(fm_mime_type_get_icon(fi->mime_type));
+        g_key_file_free(kf);
+    }
+    else if(!S_ISDIR(st.st_mode))
+        ;
+    /* set "locked" icon on unaccesible folder */
+    else if(!fi->accessible)
+        fi->icon = g_object_ref(icon_locked_folder);
+    else if(!get_fast && S_ISDIR(st.st_mode)) /* special handling for folder icons */
+    {
+        FmPath* fmpath = fi->path;
 
-            if(fm_path_equal(fmpath, fm_path_get_home())) /* this file is the home dir */
-                fi->icon = fm_icon_from_name("user-home");
-            else
+        if(fm_path_equal(fmpath, fm_path_get_home())) /* this file is the home dir */
+            fi->icon = fm_icon_from_name("user-home");
+        else
+        {
+            FmPath* parent_path = fm_path_get_parent(fmpath);
+            SpecialDirInfo* si;
+            int i;
+            if(special_dirs_all_in_home)
             {
-                FmPath* parent_path = fm_path_get_parent(fmpath);
-                SpecialDirInfo* si;
-                int i;
-                if(special_dirs_all_in_home)
-                {
-                    /* pcman: This is a little trick for optimization.
-                     * In most normal cases, all of the special folders are
-                     * by default the direct child of user home dir,
-                     * If this is the case, we can skip the check if our file
-                     * is not in home dir since it's impossible for it to be
-                     * a special dir.
-                     * Without this trick, we do all the strcmp() calls
-                     * for every single file found in the dir, which is expansive.
-                     * With this trck, we only do this if we're in the home dir.
-                     */
-                    if(fm_path_equal(parent_path, fm_path_get_home()))
-                    {
-                        /* special dirs are all in home dir and we're in home dir, too */
-                        const char* base_name = fm_path_get_basename(fmpath);
-                        for(i = 0; i < G_USER_N_DIRECTORIES; ++i)
-                        {
-                            si = &special_dir_info[i];
-                            if(si->base_name && strcmp(si->base_name, base_name) == 0)
-                            {
-                                fi->icon = fm_icon_from_name(si->icon_name);
-                                break;
-                            }
-                        }
-                    }
-                    /* if all special dirs are in home dir and this file is not, it can't be a special folder */
-                }
-                else
+                /* pcman: This is a little trick for optimization.
+                 * In most normal cases, all of the special folders are
+                 * by default the direct child of user home dir,
+                 * If this is the case, we can skip the check if our file
+                 * is not in home dir since it's impossible for it to be
+                 * a special dir.
+                 * Without this trick, we do all the strcmp() calls
+                 * for every single file found in the dir, which is expansive.
+                 * With this trck, we only do this if we're in the home dir.
+                 */
+                if(fm_path_equal(parent_path, fm_path_get_home()))
                 {
+                    /* special dirs are all in home dir and we're in home dir, too */
                     const char* base_name = fm_path_get_basename(fmpath);
                     for(i = 0; i < G_USER_N_DIRECTORIES; ++i)
                     {
                         si = &special_dir_info[i];
-                        /* compare base name first, and then prefix if needed. */
-                        if(si->base_name && strcmp(si->base_name, base_name) == 0
-                            && strncmp(si->path_str, path, (si->base_name - si->path_str)) == 0)
+                        if(si->base_name && strcmp(si->base_name, base_name) == 0)
                         {
                             fi->icon = fm_icon_from_name(si->icon_name);
                             break;
                         }
                     }
                 }
+                /* if all special dirs are in home dir and this file is not, it can't be a special folder */
+            }
+            else
+            {
+                const char* base_name = fm_path_get_basename(fmpath);
+                for(i = 0; i < G_USER_N_DIRECTORIES; ++i)
+                {
+                    si = &special_dir_info[i];
+                    /* compare base name first, and then prefix if needed. */
+                    if(si->base_name && strcmp(si->base_name, base_name) == 0
+                        && strncmp(si->path_str, path, (si->base_name - si->path_str)) == 0)
+                    {
+                        fi->icon = fm_icon_from_name(si->icon_name);
+                        break;
+                    }
+                }
             }
         }
-        if(!fi->icon)
-            fi->icon = g_object_ref(fm_mime_type_get_icon(fi->mime_type));
+    }
+    if(!fi->icon)
+        fi->icon = g_object_ref(fm_mime_type_get_icon(fi->mime_type));
 
-        gfile = g_file_new_for_path(path);
+    gfile = g_file_new_for_path(path);
 
-        /* get emblems using gio/gvfs-metadata */
-        inf = g_file_query_info(gfile, "metadata::emblems,standard::icon", G_FILE_QUERY_INFO_NONE, NULL, NULL);
-        if(inf)
-        {
-            _fm_file_info_set_emblems(fi, inf);
-            g_object_unref(inf);
-        }
+    /* get emblems using gio/gvfs-metadata */
+    inf = g_file_query_info(gfile, "metadata::emblems,standard::icon", G_FILE_QUERY_INFO_NONE, NULL, NULL);
+    if(inf)
+    {
+        _fm_file_info_set_emblems(fi, inf);
+        g_object_unref(inf);
+    }
 
-        if (!dname)
-            dname = g_filename_display_basename(path);
-        _fm_path_set_display_name(fi->path, dname);
-        g_free(dname);
+    if (!dname)
+        dname = g_filename_display_basename(path);
+    _fm_path_set_display_name(fi->path, dname);
+    g_free(dname);
 
-        /* check if directory's file system is read-only, default is FALSE */
-        fi->fs_is_ro = FALSE;
-        if (S_ISDIR(st.st_mode))
+    /* check if directory's file system is read-only, default is FALSE */
+    fi->fs_is_ro = FALSE;
+    if (S_ISDIR(st.st_mode))
+    {
+        inf = g_file_query_filesystem_info(gfile, G_FILE_ATTRIBUTE_FILESYSTEM_READONLY,
+                                           NULL, NULL);
+        if (inf)
         {
-            inf = g_file_query_filesystem_info(gfile, G_FILE_ATTRIBUTE_FILESYSTEM_READONLY,
-                                               NULL, NULL);
-            if (inf)
-            {
-                fi->fs_is_ro = g_file_info_get_attribute_boolean(inf, G_FILE_ATTRIBUTE_FILESYSTEM_READONLY);
-                g_object_unref(inf);
-            }
+            fi->fs_is_ro = g_file_info_get_attribute_boolean(inf, G_FILE_ATTRIBUTE_FILESYSTEM_READONLY);
+            g_object_unref(inf);
         }
-        g_object_unref(gfile);
-    }
-    else
-    {
-        g_set_error(err, G_IO_ERROR, g_io_error_from_errno(errno),
-                    "%s: %s", path, g_strerror(errno));
-        return FALSE;
     }
+    g_object_unref(gfile);
     /* name is changeable for native files */
     fi->name_is_changeable = TRUE;
     /* hidden attribute is immutable for native files */
@@ -489,7 +541,6 @@ _not_desktop_entry:
     /* we can change icon only for accessible desktop entry */
     fi->icon_is_changeable = fm_file_info_is_desktop_entry(fi);
         /* FIXME: add support for icon change on directories too */
-    return TRUE;
 }
 
 gboolean fm_file_info_set_from_native_file(FmFileInfo* fi, const char* path, GError** err)
@@ -712,8 +763,15 @@ _file_is_symlink:
     }
 
     fi->mtime = g_file_info_get_attribute_uint64(inf, G_FILE_ATTRIBUTE_TIME_MODIFIED);
-    fi->atime = g_file_info_get_attribute_uint64(inf, G_FILE_ATTRIBUTE_TIME_ACCESS);
-    fi->ctime = g_file_info_get_attribute_uint64(inf, G_FILE_ATTRIBUTE_TIME_CHANGED);
+    /* we cannot query non-native file later cheaply so keep it now */
+    if(!fm_path_is_native(fi->path))
+    {
+        if(fi->ext == NULL)
+            fi->ext = g_slice_new(FmFileInfoExt);
+        fi->ext->atime = g_file_info_get_attribute_uint64(inf, G_FILE_ATTRIBUTE_TIME_ACCESS);
+        fi->ext->ctime = g_file_info_get_attribute_uint64(inf, G_FILE_ATTRIBUTE_TIME_CHANGED);
+        fi->ext->blocks = g_file_info_get_attribute_uint64(inf, G_FILE_ATTRIBUTE_UNIX_BLOCKS);
+    }
     fi->hidden = g_file_info_get_is_hidden(inf);
     fi->backup = g_file_info_get_is_backup(inf);
     fi->name_is_changeable = TRUE; /* GVFS tends to ignore this attribute */
@@ -865,11 +923,9 @@ static void fm_file_info_clear(FmFileInfo* fi)
         fi->path = NULL;
     }
 
-    if(G_LIKELY(fi->disp_size))
-    {
+    if(!fi->disp_size_interned)
         g_free(fi->disp_size);
-        fi->disp_size = NULL;
-    }
+    fi->disp_size = NULL;
 
     if(G_UNLIKELY(fi->disp_mtime))
     {
@@ -877,10 +933,11 @@ static void fm_file_info_clear(FmFileInfo* fi)
         fi->disp_mtime = NULL;
     }
 
-    g_free(fi->disp_owner);
-    fi->disp_owner = NULL;
-    g_free(fi->disp_group);
-    fi->disp_group = NULL;
+    if(G_UNLIKELY(fi->ext))
+    {
+        g_slice_free(FmFileInfoExt, fi->ext);
+        fi->ext = NULL;
+    }
 
     if(G_UNLIKELY(fi->target))
     {
@@ -967,11 +1024,8 @@ void fm_file_info_update(FmFileInfo* fi, FmFileInfo* src)
     fi->gid = src->gid;
     fi->size = src->size;
     fi->mtime = src->mtime;
-    fi->atime = src->atime;
-    fi->ctime = src->ctime;
-
-    fi->blksize = src->blksize;
-    fi->blocks = src->blocks;
+    if(src->ext)
+        fi->ext = g_slice_dup(FmFileInfoExt, src->ext);
 
     if(src->collate_key == COLLATE_USING_DISPLAY_NAME)
         fi->collate_key = COLLATE_USING_DISPLAY_NAME;
@@ -981,10 +1035,12 @@ void fm_file_info_update(FmFileInfo* fi, FmFileInfo* src)
         fi->collate_key_case = COLLATE_USING_DISPLAY_NAME;
     else
         fi->collate_key_case = g_strdup(src->collate_key_case);
-    fi->disp_size = g_strdup(src->disp_size);
+    fi->disp_size_interned = src->disp_size_interned;
+    if(src->disp_size_interned)
+        fi->disp_size = src->disp_size;
+    else
+        fi->disp_size = g_strdup(src->disp_size);
     fi->disp_mtime = g_strdup(src->disp_mtime);
-    fi->disp_owner = g_strdup(src->disp_owner);
-    fi->disp_group = g_strdup(src->disp_group);
     fi->target = g_strdup(src->target);
     fi->accessible = src->accessible;
     fi->hidden = src->hidden;
@@ -1163,23 +1219,54 @@ const char* fm_file_info_get_disp_size(FmFileInfo* fi)
         if(S_ISREG(fi->mode))
         {
             char buf[ 64 ];
-            fm_file_size_to_str2(buf, sizeof(buf), fi->size,
-                        fm_config->list_view_size_units ? fm_config->list_view_size_units[0] : 0);
-            fi->disp_size = g_strdup(buf);
+            char units = fm_config->list_view_size_units ? fm_config->list_view_size_units[0] : 0;
+            fm_file_size_to_str2(buf, sizeof(buf), fi->size, units);
+            /* there are not many distinct values with adaptive units so
+               share them; exact sizes are unique for almost every file */
+            fi->disp_size_interned = (units == 0 || units == 'h' || units == 'H');
+            if(fi->disp_size_interned)
+                fi->disp_size = (char*)g_intern_string(buf);
+            else
+                fi->disp_size = g_strdup(buf);
         }
     }
     return fi->disp_size;
 }
 
+/* retrieves rarely used data, for native file it is queried on demand */
+static FmFileInfoExt *_fm_file_info_get_ext(FmFileInfo* fi)
+{
+    if (G_UNLIKELY(fi->ext == NULL))
+    {
+        struct stat st;
+        char *path_str;
+
+        fi->ext = g_slice_new0(FmFileInfoExt);
+        if (fi->path == NULL || !fm_path_is_native(fi->path))
+            return fi->ext;
+        path_str = fm_path_to_str(fi->path);
+        if (lstat(path_str, &st) == 0)
+        {
+            fi->ext->atime = st.st_atime;
+            fi->ext->ctime = st.st_ctime;
+            fi->ext->blocks = st.st_blocks;
+        }
+        g_free(path_str);
+    }
+    return fi->ext;
+}
+
 /**
  * fm_file_info_get_blocks
  * @fi:  A FmFileInfo struct
  *
+ * This API is not thread-safe and should be used only in default context.
+ *
  * Returns: how many filesystem blocks used by the file.
  */
 goffset fm_file_info_get_blocks(FmFileInfo* fi)
 {
-    return fi->blocks;
+    return _fm_file_info_get_ext(fi)->blocks;
 }
 
 /**
@@ -1651,11 +1738,13 @@ time_t fm_file_info_get_mtime(FmFileInfo* fi)
  * fm_file_info_get_atime
  * @fi:  A FmFileInfo struct
  * 
+ * This API is not thread-safe and should be used only in default context.
+ *
  * Returns: file access time.
  */
 time_t fm_file_info_get_atime(FmFileInfo* fi)
 {
-    return fi->atime;
+    return _fm_file_info_get_ext(fi)->atime;
 }
 
 /**
@@ -1664,13 +1753,15 @@ time_t fm_file_info_get_atime(FmFileInfo* fi)
  *
  * Retrieves time when access right were changed last time for file @fi.
  *
+ * This API is not thread-safe and should be used only in default context.
+ *
  * Returns: file access change time.
  *
  * Since: 1.2.0
  */
 time_t fm_file_info_get_ctime(FmFileInfo *fi)
 {
-    return fi->ctime;
+    return _fm_file_info_get_ext(fi)->ctime;
 }
 
 /**
@@ -1798,6 +1889,62 @@ gboolean fm_file_info_is_writable_directory(FmFileInfo* fi)
     return (!fi->fs_is_ro && fm_file_info_is_dir(fi));
 }
 
+static const char *_fm_file_info_owner_name(uid_t uid)
+{
+    const char *name;
+
+    G_LOCK(id_names);
+    if (G_UNLIKELY(owner_names == NULL))
+        owner_names = g_hash_table_new(g_direct_hash, NULL);
+    name = g_hash_table_lookup(owner_names, GUINT_TO_POINTER(uid));
+    if (name == NULL)
+    {
+        struct passwd* pw = NULL;
+        struct passwd pwb;
+        char unamebuf[1024];
+
+        getpwuid_r(uid, &pwb, unamebuf, sizeof(unamebuf), &pw);
+        if (pw)
+            name = g_intern_string(pw->pw_name);
+        else
+        {
+            g_snprintf(unamebuf, sizeof(unamebuf), "%u", (guint)uid);
+            name = g_intern_string(unamebuf);
+        }
+        g_hash_table_insert(owner_names, GUINT_TO_POINTER(uid), (gpointer)name);
+    }
+    G_UNLOCK(id_names);
+    return name;
+}
+
+static const char *_fm_file_info_group_name(gid_t gid)
+{
+    const char *name;
+
+    G_LOCK(id_names);
+    if (G_UNLIKELY(group_names == NULL))
+        group_names = g_hash_table_new(g_direct_hash, NULL);
+    name = g_hash_table_lookup(group_names, GUINT_TO_POINTER(gid));
+    if (name == NULL)
+    {
+        struct group* grp = NULL;
+        struct group grpb;
+        char unamebuf[1024];
+
+        getgrgid_r(gid, &grpb, unamebuf, sizeof(unamebuf), &grp);
+        if (grp)
+            name = g_intern_string(grp->gr_name);
+        else
+        {
+            g_snprintf(unamebuf, sizeof(unamebuf), "%u", (guint)gid);
+            name = g_intern_string(unamebuf);
+        }
+        g_hash_table_insert(group_names, GUINT_TO_POINTER(gid), (gpointer)name);
+    }
+    G_UNLOCK(id_names);
+    return name;
+}
+
 /**
  * fm_file_info_get_disp_owner
  * @fi: file info to inspect
@@ -1814,19 +1961,7 @@ gboolean fm_file_info_is_writable_directory(FmFileInfo* fi)
 const char *fm_file_info_get_disp_owner(FmFileInfo *fi)
 {
     g_return_val_if_fail(fi, NULL);
-    if (!fi->disp_owner)
-    {
-        struct passwd* pw = NULL;
-        struct passwd pwb;
-        char unamebuf[1024];
-
-        getpwuid_r(fi->uid, &pwb, unamebuf, sizeof(unamebuf), &pw);
-        if (pw)
-            fi->disp_owner = g_strdup(pw->pw_name);
-        else
-            fi->disp_owner = g_strdup_printf("%u", (guint)fi->uid);
-    }
-    return fi->disp_owner;
+    return _fm_file_info_owner_name(fi->uid);
 }
 
 /**
@@ -1845,19 +1980,7 @@ const char *fm_file_info_get_disp_owner(FmFileInfo *fi)
 const char *fm_file_info_get_disp_group(FmFileInfo *fi)
 {
     g_return_val_if_fail(fi, NULL);
-    if (!fi->disp_group)
-    {
-        struct group* grp = NULL;
-        struct group grpb;
-        char unamebuf[1024];
-
-        getgrgid_r(fi->gid, &grpb, unamebuf, sizeof(unamebuf), &grp);
-        if (grp)
-            fi->disp_group = g_strdup(grp->gr_name);
-        else
-            fi->disp_group = g_strdup_printf("%u", (guint)fi->gid);
-    }
-    return fi->disp_group;
+    return _fm_file_info_group_name(fi->gid);
 }
 
 
@@ -166,6 +166,10 @@ static inline GList* fm_file_info_list_peek_head_link(FmFileInfoList* list)
 {
     return fm_list_peek_head_link((FmList*)list);
 }
+static inline GList* fm_file_info_list_peek_tail_link(FmFileInfoList* list)
+{
+    return fm_list_peek_tail_link((FmList*)list);
+}
 
 static inline void fm_file_info_list_push_tail(FmFileInfoList* list, FmFileInfo* d)
 {
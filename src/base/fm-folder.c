@@ -68,13 +68,13 @@ struct _FmFolder
     FmDirListJob* dirlist_job;
     FmFileInfo* dir_fi;
     FmFileInfoList* files;
+    GHashTable* files_index; /* FmPath -> GList link in files */
 
     /* for file monitor */
     guint idle_handler;
-    GSList* files_to_add;
-    GSList* files_to_update;
-    GSList* files_to_del;
-    GSList* pending_jobs;
+    gboolean update_delayed; /* idle_handler is a timeout */
+    GHashTable* journal; /* FmPath -> FmFolderEvent, holds references */
+    FmFileInfoJob* update_job; /* the only update job running for the folder */
     gboolean pending_change_notify;
     gboolean filesystem_info_pending;
     gboolean wants_incremental;
@@ -90,6 +90,15 @@ struct _FmFolder
     gboolean defer_content_test : 1;
 };
 
+/* coalesced state of queued changes for a file */
+typedef enum
+{
+    FOLDER_EVENT_NONE = 0,
+    FOLDER_EVENT_ADDED,
+    FOLDER_EVENT_CHANGED,
+    FOLDER_EVENT_DELETED
+} FmFolderEvent;
+
 static void fm_folder_dispose(GObject *object);
 static void fm_folder_finalize(GObject *object);
 static void fm_folder_content_changed(FmFolder* folder);
@@ -111,9 +120,36 @@ static void on_mount_removed(GVolumeMonitor* vm, GMount* mount, gpointer user_da
 G_LOCK_DEFINE_STATIC(query);
 /* protects hash access */
 G_LOCK_DEFINE_STATIC(hash);
-/* protects access to files_to_add, files_to_update and files_to_del */
+/* protects access to journal and idle_handler, also any change of
+   files_index; it is changed only from main thread so main thread may
+   read it without lock */
 G_LOCK_DEFINE_STATIC(lists);
 
+/* should be called only with G_LOCK(lists) on! */
+static inline void _fm_folder_push_file(FmFolder *folder, FmFileInfo *fi)
+{
+    fm_file_info_list_push_tail(folder->files, fi);
+    g_hash_table_insert(folder->files_index, fm_file_info_get_path(fi),
+                        fm_file_info_list_peek_tail_link(folder->files));
+}
+
+/* should be called only with G_LOCK(lists) on! */
+static inline void _fm_folder_unlink_file(FmFolder *folder, GList *l)
+{
+    FmPath *path = fm_file_info_get_path(l->data);
+
+    /* we should not remove index if it refers another file */
+    if (g_hash_table_lookup(folder->files_index, path) == l)
+        g_hash_table_remove(folder->files_index, path);
+    fm_file_info_list_delete_link_nounref(folder->files, l);
+}
+
+/* should be called only with G_LOCK(lists) on! */
+static inline FmFolderEvent _fm_folder_journal_get(FmFolder *folder, FmPath *path)
+{
+    return GPOINTER_TO_INT(g_hash_table_lookup(folder->journal, path));
+}
+
 static void fm_folder_class_init(FmFolderClass *klass)
 {
     GObjectClass *g_object_class;
@@ -342,6 +378,10 @@ static void fm_folder_class_init(FmFolderClass *klass)
 static void fm_folder_init(FmFolder *folder)
 {
     folder->files = fm_file_info_list_new();
+    folder->files_index = g_hash_table_new(g_direct_hash, NULL);
+    /* FmPath objects are unique so we can compare pointers */
+    folder->journal = g_hash_table_new_full(g_direct_hash, NULL,
+                                            (GDestroyNotify)fm_path_unref, NULL);
     G_LOCK(hash);
     if (G_UNLIKELY(hash_uses == 0))
     {
@@ -382,6 +422,89 @@ static void queue_reload(FmFolder* folder)
     G_UNLOCK(query);
 }
 
+static gboolean on_idle(FmFolder* folder);
+
+/* should be called only with G_LOCK(lists) on! */
+static void queue_update(FmFolder *folder)
+{
+    guint n_queued = g_hash_table_size(folder->journal);
+    guint batch = MAX(fm_config->folder_update_batch, 1);
+
+    if (folder->idle_handler)
+    {
+        /* flush it right away if there is enough changes collected */
+        if (!folder->update_delayed || n_queued < batch)
+            return;
+        /* reference borrowed by removed source is passed to new one */
+        g_source_remove(folder->idle_handler);
+    }
+    else
+        /* borrow reference on folder */
+        g_object_ref(folder);
+    if (n_queued < batch && fm_config->folder_update_delay > 0)
+    {
+        /* wait a bit so changes on the same file are coalesced */
+        folder->idle_handler = g_timeout_add_full(G_PRIORITY_LOW,
+                                                  fm_config->folder_update_delay,
+                                                  (GSourceFunc)on_idle,
+                                                  folder, NULL);
+        folder->update_delayed = TRUE;
+    }
+    else
+    {
+        folder->idle_handler = g_idle_add_full(G_PRIORITY_LOW, (GSourceFunc)on_idle,
+                                               folder, NULL);
+        folder->update_delayed = FALSE;
+    }
+}
+
+/* merges event into the journal, superseded events are dropped
+   returns TRUE if reference was taken from path
+   should be called only with G_LOCK(lists) on! */
+static gboolean _fm_folder_journal_add(FmFolder *folder, FmPath *path,
+                                       FmFolderEvent event)
+{
+    FmFolderEvent state = _fm_folder_journal_get(folder, path);
+    gboolean exists;
+
+    if (state == event || (state == FOLDER_EVENT_ADDED && event == FOLDER_EVENT_CHANGED))
+        /* duplicate, or file is still not queried anyway */
+        return FALSE;
+    exists = (path == folder->dir_path || _fm_folder_get_file_by_path(folder, path));
+    switch (event)
+    {
+    case FOLDER_EVENT_ADDED:
+        /* if we already have the file in FmFolder, update the existing one
+           instead; bug #3591771: 'ln -fns . test' leave no file visible in
+           folder, therefore it replaces queued deletion as well */
+        if (state == FOLDER_EVENT_CHANGED)
+            return FALSE;
+        if (exists)
+            event = FOLDER_EVENT_CHANGED;
+        break;
+    case FOLDER_EVENT_CHANGED:
+        /* ensure it is our file and it's not going to be deleted */
+        if (state == FOLDER_EVENT_DELETED || !exists)
+            return FALSE;
+        break;
+    case FOLDER_EVENT_DELETED:
+        /* if the file is already queued for addition or update, that
+           operation will be just a waste, therefore cancel it right now;
+           the deletion is kept even if we don't have the file yet so
+           the running update job will not add it */
+        break;
+    case FOLDER_EVENT_NONE:
+        return FALSE;
+    }
+    if (state != FOLDER_EVENT_NONE)
+        /* the journal already holds a reference on path, keep it */
+        g_hash_table_insert(folder->journal, fm_path_ref(path), GINT_TO_POINTER(event));
+    else
+        g_hash_table_insert(folder->journal, path, GINT_TO_POINTER(event));
+    queue_update(folder);
+    return (state == FOLDER_EVENT_NONE);
+}
+
 static void on_file_info_job_finished(FmFileInfoJob* job, FmFolder* folder)
 {
     GList* l;
@@ -392,11 +515,15 @@ static void on_file_info_job_finished(FmFileInfoJob* job, FmFolder* folder)
         gboolean need_added = g_signal_has_handler_pending(folder, signals[FILES_ADDED], 0, TRUE);
         gboolean need_changed = g_signal_has_handler_pending(folder, signals[FILES_CHANGED], 0, TRUE);
 
+        G_LOCK(lists);
         for(l=fm_file_info_list_peek_head_link(job->file_infos);l;l=l->next)
         {
             FmFileInfo* fi = (FmFileInfo*)l->data;
             FmPath* path = fm_file_info_get_path(fi);
             GList* l2;
+            if (_fm_folder_journal_get(folder, path) == FOLDER_EVENT_DELETED)
+                /* the file was deleted while we were querying it */
+                continue;
             if (fm_folder_is_valid(folder) && path == fm_file_info_get_path(folder->dir_fi))
                 /* update for folder itself, also see FIXME below! */
                 fm_file_info_update(folder->dir_fi, fi);
@@ -418,9 +545,10 @@ static void on_file_info_job_finished(FmFileInfoJob* job, FmFolder* folder)
             {
                 if(need_added)
                     files_to_add = g_slist_prepend(files_to_add, fi);
-                fm_file_info_list_push_tail(folder->files, fi);
+                _fm_folder_push_file(folder, fi);
             }
         }
+        G_UNLOCK(lists);
         if(files_to_add)
         {
             g_signal_emit(folder, signals[FILES_ADDED], 0, files_to_add);
@@ -433,34 +561,74 @@ static void on_file_info_job_finished(FmFileInfoJob* job, FmFolder* folder)
         }
         g_signal_emit(folder, signals[CONTENT_CHANGED], 0);
     }
-    folder->pending_jobs = g_slist_remove(folder->pending_jobs, job);
+    folder->update_job = NULL;
     g_object_unref(job);
+    /* changes collected while job was running are waiting for us */
+    G_LOCK(lists);
+    if (g_hash_table_size(folder->journal) > 0)
+        queue_update(folder);
+    G_UNLOCK(lists);
 }
 
 static gboolean on_idle(FmFolder* folder)
 {
-    GSList* l;
+    GHashTableIter it;
+    gpointer key, value;
     FmFileInfoJob* job = NULL;
-    GSList *files_to_add, *files_to_del, *files_to_update;
+    GSList *l, *files_to_query = NULL, *files_to_del = NULL;
     gboolean stop_emission;
 
-    /* check if folder still exists */
+    G_LOCK(lists);
+    /* check if source was replaced in queue_update() */
     if(g_source_is_destroyed(g_main_current_source()))
     {
-        /* it should be impossible, folder cannot be disposed at this point */
+        /* the borrowed reference was passed to the new source */
+        G_UNLOCK(lists);
         return FALSE;
     }
-    G_LOCK(lists);
     folder->idle_handler = 0;
     stop_emission = folder->stop_emission;
     if (!stop_emission)
     {
-        files_to_add = folder->files_to_add;
-        folder->files_to_add = NULL;
-        files_to_del = folder->files_to_del;
-        folder->files_to_del = NULL;
-        files_to_update = folder->files_to_update;
-        folder->files_to_update = NULL;
+        gint batch = MAX(fm_config->folder_update_batch, 1);
+
+        g_hash_table_iter_init(&it, folder->journal);
+        while (batch > 0 && g_hash_table_iter_next(&it, &key, &value))
+        {
+            FmPath *path = key;
+
+            if (GPOINTER_TO_INT(value) == FOLDER_EVENT_DELETED)
+            {
+                /* remove deleted files from the list right away */
+                GList *link = _fm_folder_get_file_by_path(folder, path);
+                if (link)
+                {
+                    files_to_del = g_slist_prepend(files_to_del, link->data);
+                    _fm_folder_unlink_file(folder, link);
+                }
+                else if (folder->update_job)
+                    /* keep it until the job is finished */
+                    continue;
+                g_hash_table_iter_remove(&it);
+            }
+            else if (folder->update_job)
+                /* wait for running job, it will queue update when finished */
+                continue;
+            else
+            {
+                /* take reference from journal, it will be unref'ed below */
+                files_to_query = g_slist_prepend(files_to_query, path);
+                g_hash_table_iter_steal(&it);
+            }
+            batch--;
+        }
+        if (batch == 0)
+        {
+            /* there might be more changes, continue as soon as possible */
+            folder->idle_handler = g_idle_add_full(G_PRIORITY_LOW, (GSourceFunc)on_idle,
+                                                   g_object_ref(folder), NULL);
+            folder->update_delayed = FALSE;
+        }
     }
     G_UNLOCK(lists);
 
@@ -470,38 +638,22 @@ static gboolean on_idle(FmFolder* folder)
 
     /* g_debug("folder: on_idle() started"); */
 
-    if(files_to_update || files_to_add)
-        job = (FmFileInfoJob*)fm_file_info_job_new(NULL, 0);
-
-    if(files_to_update)
-    {
-        for(l=files_to_update; l; l = l->next)
-        {
-            FmPath *path = l->data;
-            fm_file_info_job_add(job, path);
-            fm_path_unref(path);
-        }
-        g_slist_free(files_to_update);
-    }
-
-    if(files_to_add)
+    if(files_to_query)
     {
-        for(l=files_to_add;l;l=l->next)
+        job = (FmFileInfoJob*)fm_file_info_job_new(NULL, 0);
+        for(l = files_to_query; l; l = l->next)
         {
             FmPath *path = l->data;
             fm_file_info_job_add(job, path);
             fm_path_unref(path);
         }
-        g_slist_free(files_to_add);
-    }
+        g_slist_free(files_to_query);
 
-    if(job)
-    {
         g_signal_connect(job, "finished", G_CALLBACK(on_file_info_job_finished), folder);
-        folder->pending_jobs = g_slist_prepend(folder->pending_jobs, job);
+        folder->update_job = job;
         if (!fm_job_run_async(FM_JOB(job)))
         {
-            folder->pending_jobs = g_slist_remove(folder->pending_jobs, job);
+            folder->update_job = NULL;
             g_object_unref(job);
             g_critical("failed to start folder update job");
         }
@@ -510,13 +662,6 @@ static gboolean on_idle(FmFolder* folder)
 
     if(files_to_del)
     {
-        GSList* ll;
-        for(ll=files_to_del;ll;ll=ll->next)
-        {
-            GList* l= (GList*)ll->data;
-            ll->data = l->data;
-            fm_file_info_list_delete_link_nounref(folder->files, l);
-        }
         g_signal_emit(folder, signals[FILES_REMOVED], 0, files_to_del);
         g_slist_foreach(files_to_del, (GFunc)fm_file_info_unref, NULL);
         g_slist_free(files_to_del);
@@ -549,50 +694,13 @@ _finish:
     return FALSE;
 }
 
-/* should be called only with G_LOCK(lists) on! */
-static inline void queue_update(FmFolder *folder)
-{
-    if (!folder->idle_handler)
-        /* borrow reference on folder */
-        folder->idle_handler = g_idle_add_full(G_PRIORITY_LOW, (GSourceFunc)on_idle,
-                                               g_object_ref(folder), NULL);
-}
-
 /* returns TRUE if reference was taken from path */
 gboolean _fm_folder_event_file_added(FmFolder *folder, FmPath *path)
 {
-    gboolean added = TRUE;
+    gboolean added;
 
     G_LOCK(lists);
-    /* make sure that the file is not already queued for addition. */
-    if(!g_slist_find(folder->files_to_add, path))
-    {
-        GList *l = _fm_folder_get_file_by_path(folder, path);
-        if(!l) /* it's new file */
-        {
-            /* add the file name to queue for addition. */
-            folder->files_to_add = g_slist_append(folder->files_to_add, path);
-        }
-        else if(g_slist_find(folder->files_to_update, path))
-        {
-            /* file already queued for update, don't duplicate */
-            added = FALSE;
-        }
-        /* if we already have the file in FmFolder, update the existing one instead. */
-        else
-        {
-            /* bug #3591771: 'ln -fns . test' leave no file visible in folder.
-               If it is queued for deletion then cancel that operation */
-            folder->files_to_del = g_slist_remove(folder->files_to_del, l);
-            /* update the existing item. */
-            folder->files_to_update = g_slist_append(folder->files_to_update, path);
-        }
-    }
-    else
-        /* file already queued for adding, don't duplicate */
-        added = FALSE;
-    if (added)
-        queue_update(folder);
+    added = _fm_folder_journal_add(folder, path, FOLDER_EVENT_ADDED);
     G_UNLOCK(lists);
     return added;
 }
@@ -602,50 +710,18 @@ gboolean _fm_folder_event_file_changed(FmFolder *folder, FmPath *path)
     gboolean added;
 
     G_LOCK(lists);
-    /* make sure that the file is not already queued for changes or
-     * it's already queued for addition. */
-    if(!g_slist_find(folder->files_to_update, path) &&
-       !g_slist_find(folder->files_to_add, path) &&
-       _fm_folder_get_file_by_path(folder, path)) /* ensure it is our file */
-    {
-        folder->files_to_update = g_slist_append(folder->files_to_update, path);
-        added = TRUE;
-        queue_update(folder);
-    }
-    else
-    {
-        added = FALSE;
-    }
+    added = _fm_folder_journal_add(folder, path, FOLDER_EVENT_CHANGED);
     G_UNLOCK(lists);
     return added;
 }
 
 void _fm_folder_event_file_deleted(FmFolder *folder, FmPath *path)
 {
-    GList *l;
-    GSList *sl;
-
     G_LOCK(lists);
-    l = _fm_folder_get_file_by_path(folder, path);
-    if(l && !g_slist_find(folder->files_to_del, l) )
-        folder->files_to_del = g_slist_prepend(folder->files_to_del, l);
-    /* if the file is already queued for addition or update, that operation
-       will be just a waste, therefore cancel it right now */
-    sl = g_slist_find(folder->files_to_update, path);
-    if(sl)
-    {
-        folder->files_to_update = g_slist_delete_link(folder->files_to_update, sl);
-    }
-    else if((sl = g_slist_find(folder->files_to_add, path)))
-    {
-        folder->files_to_add = g_slist_delete_link(folder->files_to_add, sl);
-    }
-    else
-        path = NULL;
-    queue_update(folder);
+    /* caller keeps own reference */
+    if (_fm_folder_journal_add(folder, fm_path_ref(path), FOLDER_EVENT_DELETED) == FALSE)
+        fm_path_unref(path);
     G_UNLOCK(lists);
-    if (path != NULL)
-        fm_path_unref(path); /* link was freed above so we should unref it */
 }
 
 static void on_folder_changed(GFileMonitor* mon, GFile* gf, GFile* other, GFileMonitorEvent evt, FmFolder* folder)
@@ -697,11 +773,9 @@ static void on_folder_changed(GFileMonitor* mon, GFile* gf, GFile* other, GFileM
         case G_FILE_MONITOR_EVENT_CHANGED:
             folder->pending_change_notify = TRUE;
             G_LOCK(lists);
-            if (g_slist_find(folder->files_to_update, folder->dir_path) == NULL)
-            {
-                folder->files_to_update = g_slist_append(folder->files_to_update, fm_path_ref(folder->dir_path));
-                queue_update(folder);
-            }
+            if (!_fm_folder_journal_add(folder, fm_path_ref(folder->dir_path),
+                                        FOLDER_EVENT_CHANGED))
+                fm_path_unref(folder->dir_path);
             G_UNLOCK(lists);
             /* g_debug("folder is changed"); */
             break;
@@ -756,12 +830,14 @@ static void on_dirlist_job_finished(FmDirListJob* job, FmFolder* folder)
     if(!fm_job_is_cancelled(FM_JOB(job)) && !folder->wants_incremental)
     {
         GList* l;
+        G_LOCK(lists);
         for(l = fm_file_info_list_peek_head_link(job->files); l; l=l->next)
         {
             FmFileInfo* inf = (FmFileInfo*)l->data;
             files = g_slist_prepend(files, inf);
-            fm_file_info_list_push_tail(folder->files, inf);
+            _fm_folder_push_file(folder, inf);
         }
+        G_UNLOCK(lists);
         if(G_LIKELY(files))
         {
             GSList *l;
@@ -770,8 +846,11 @@ static void on_dirlist_job_finished(FmDirListJob* job, FmFolder* folder)
             if (folder->defer_content_test && fm_path_is_native(folder->dir_path))
                 /* we got only basic info on content, schedule update it now */
                 for (l = files; l; l = l->next)
-                    folder->files_to_update = g_slist_prepend(folder->files_to_update,
-                                                fm_path_ref(fm_file_info_get_path(l->data)));
+                {
+                    FmPath *path = fm_path_ref(fm_file_info_get_path(l->data));
+                    if (!_fm_folder_journal_add(folder, path, FOLDER_EVENT_CHANGED))
+                        fm_path_unref(path);
+                }
             G_UNLOCK(lists);
             g_signal_emit(folder, signals[FILES_ADDED], 0, files);
             g_slist_free(files);
@@ -780,29 +859,9 @@ static void on_dirlist_job_finished(FmDirListJob* job, FmFolder* folder)
         if(job->dir_fi)
             folder->dir_fi = fm_file_info_ref(job->dir_fi);
 
-        /* Some new files are created while FmDirListJob is loading the folder. */
-        G_LOCK(lists);
-        if(G_UNLIKELY(folder->files_to_add))
-        {
-            /* This should be a very rare case. Could this happen? */
-            GSList* l;
-            for(l = folder->files_to_add; l;)
-            {
-                FmPath *path = l->data;
-                GSList* next = l->next;
-                if(_fm_folder_get_file_by_path(folder, path))
-                {
-                    /* we already have the file. remove it from files_to_add, 
-                     * and put it in files_to_update instead.
-                     * No strdup for name is needed here. We steal
-                     * the string from files_to_add.*/
-                    folder->files_to_update = g_slist_prepend(folder->files_to_update, path);
-                    folder->files_to_add = g_slist_delete_link(folder->files_to_add, l);
-                }
-                l = next;
-            }
-        }
-        G_UNLOCK(lists);
+        /* Some new files may be created while FmDirListJob is loading the
+         * folder. Those are queued for addition but the update job will
+         * find them in the folder already and update them instead. */
     }
     else if(!folder->dir_fi && job->dir_fi)
         /* we may need dir_fi for incremental folders too */
@@ -819,11 +878,13 @@ static void on_dirlist_job_files_found(FmDirListJob* job, GSList* files, gpointe
 {
     FmFolder* folder = FM_FOLDER(user_data);
     GSList* l;
+    G_LOCK(lists);
     for(l = files; l; l = l->next)
     {
         FmFileInfo* file = FM_FILE_INFO(l->data);
-        fm_file_info_list_push_tail(folder->files, file);
+        _fm_folder_push_file(folder, file);
     }
+    G_UNLOCK(lists);
     if (G_UNLIKELY(!folder->dir_fi && job->dir_fi))
         /* we may want info while folder is still loading */
         folder->dir_fi = fm_file_info_ref(job->dir_fi);
@@ -904,18 +965,13 @@ static void fm_folder_dispose(GObject *object)
     if(folder->dirlist_job)
         free_dirlist_job(folder);
 
-    if(folder->pending_jobs)
+    if(folder->update_job)
     {
-        GSList* l;
-        for(l = folder->pending_jobs;l;l=l->next)
-        {
-            FmJob* job = FM_JOB(l->data);
-            g_signal_handlers_disconnect_by_func(job, on_file_info_job_finished, folder);
-            fm_job_cancel(job);
-            g_object_unref(job);
-        }
-        g_slist_free(folder->pending_jobs);
-        folder->pending_jobs = NULL;
+        FmJob* job = FM_JOB(folder->update_job);
+        g_signal_handlers_disconnect_by_func(job, on_file_info_job_finished, folder);
+        fm_job_cancel(job);
+        g_object_unref(job);
+        folder->update_job = NULL;
     }
 
     if(folder->mon)
@@ -947,24 +1003,10 @@ static void fm_folder_dispose(GObject *object)
         /* FIXME: it should be impossible, folder should be referenced if handler added */
         g_source_remove(folder->idle_handler);
         folder->idle_handler = 0;
-        if(folder->files_to_add)
-        {
-            g_slist_foreach(folder->files_to_add, (GFunc)fm_path_unref, NULL);
-            g_slist_free(folder->files_to_add);
-            folder->files_to_add = NULL;
-        }
-        if(folder->files_to_update)
-        {
-            g_slist_foreach(folder->files_to_update, (GFunc)fm_path_unref, NULL);
-            g_slist_free(folder->files_to_update);
-            folder->files_to_update = NULL;
-        }
-        if(folder->files_to_del)
-        {
-            g_slist_free(folder->files_to_del);
-            folder->files_to_del = NULL;
-        }
     }
+    g_hash_table_remove_all(folder->journal);
+    /* files will be freed below */
+    g_hash_table_remove_all(folder->files_index);
     G_UNLOCK(lists);
 
     /* remove from hash table */
@@ -1000,6 +1042,11 @@ static void fm_folder_dispose(GObject *object)
 
 static void fm_folder_finalize(GObject *object)
 {
+    FmFolder *folder = (FmFolder*)object;
+
+    g_hash_table_destroy(folder->journal);
+    g_hash_table_destroy(folder->files_index);
+
     G_LOCK(hash);
     hash_uses--;
     if (G_UNLIKELY(hash_uses == 0))
@@ -1122,27 +1169,23 @@ void fm_folder_reload(FmFolder* folder)
 
     /* clear all update-lists now, see SF bug #919 - if update comes before
        listing job is finished, a duplicate may be created in the folder */
+    G_LOCK(lists);
     if (folder->idle_handler)
     {
         g_source_remove(folder->idle_handler);
         folder->idle_handler = 0;
-        if (folder->files_to_add)
-        {
-            g_slist_foreach(folder->files_to_add, (GFunc)fm_path_unref, NULL);
-            g_slist_free(folder->files_to_add);
-            folder->files_to_add = NULL;
-        }
-        if (folder->files_to_update)
-        {
-            g_slist_foreach(folder->files_to_update, (GFunc)fm_path_unref, NULL);
-            g_slist_free(folder->files_to_update);
-            folder->files_to_update = NULL;
-        }
-        if (folder->files_to_del)
-        {
-            g_slist_free(folder->files_to_del);
-            folder->files_to_del = NULL;
-        }
+        /* release reference borrowed in queue_update() */
+        g_object_unref(folder);
+    }
+    g_hash_table_remove_all(folder->journal);
+    G_UNLOCK(lists);
+    /* results of running update job would be stale as well */
+    if (folder->update_job)
+    {
+        g_signal_handlers_disconnect_by_func(folder->update_job, on_file_info_job_finished, folder);
+        fm_job_cancel(FM_JOB(folder->update_job));
+        g_object_unref(folder->update_job);
+        folder->update_job = NULL;
     }
 
     /* remove all items and re-run a dir list job. */
@@ -1164,7 +1207,10 @@ void fm_folder_reload(FmFolder* folder)
             g_signal_emit(folder, signals[FILES_REMOVED], 0, files_to_del);
             g_slist_free(files_to_del);
         }
+        G_LOCK(lists);
+        g_hash_table_remove_all(folder->files_index);
         fm_file_info_list_clear(folder->files); /* fm_file_info_unref will be invoked. */
+        G_UNLOCK(lists);
     }
 
     /* also re-create a new file monitor */
@@ -1276,17 +1322,10 @@ FmPath* fm_folder_get_path(FmFolder* folder)
     return folder->dir_path;
 }
 
+/* should be called either from main thread or with G_LOCK(lists) on */
 static GList* _fm_folder_get_file_by_path(FmFolder* folder, FmPath *path)
 {
-    GList* l = fm_file_info_list_peek_head_link(folder->files);
-    for(;l;l=l->next)
-    {
-        FmFileInfo* fi = (FmFileInfo*)l->data;
-        FmPath* lpath = fm_file_info_get_path(fi);
-        if(lpath == path)
-            return l;
-    }
-    return NULL;
+    return g_hash_table_lookup(folder->files_index, path);
 }
 
 /**
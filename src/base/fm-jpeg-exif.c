@@ -0,0 +1,246 @@
+/*
+ *      fm-jpeg-exif.c
+ *
+ *      This file is a part of the Libfm library.
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Reader of thumbnails embedded into EXIF data of JPEG files.
+ * Instead of feeding whole file into a parser it walks JPEG markers up to
+ * the APP1 segment, then reads only TIFF header, IFD0 (for orientation)
+ * and IFD1 (for thumbnail location), and at last the thumbnail itself.
+ * All those except the thumbnail usually fit into the first block of the
+ * file so in most cases it costs two pread() calls per file. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "fm-jpeg-exif.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+/* size of first block of file which is read at once */
+#define HEAD_SIZE           4096
+/* give up if APP1 isn't among first segments of file */
+#define MAX_SEGMENTS        16
+
+#define TAG_ORIENTATION     0x0112
+#define TAG_JPEG_OFFSET     0x0201
+#define TAG_JPEG_LENGTH     0x0202
+
+#define TYPE_SHORT          3
+#define TYPE_LONG           4
+
+typedef struct
+{
+    int fd;
+    gsize head_len;
+    guchar head[HEAD_SIZE];
+} JpegReader;
+
+static gboolean pread_all(int fd, void* buf, gsize len, goffset offset)
+{
+    while(len > 0)
+    {
+        gssize n = pread(fd, buf, len, offset);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return FALSE;
+        }
+        if(n == 0) /* unexpected EOF */
+            return FALSE;
+        buf = (guchar*)buf + n;
+        len -= n;
+        offset += n;
+    }
+    return TRUE;
+}
+
+static gboolean jpeg_read(JpegReader* r, guint64 offset, void* buf, gsize len)
+{
+    if(offset + len <= r->head_len)
+    {
+        memcpy(buf, r->head + offset, len);
+        return TRUE;
+    }
+    return pread_all(r->fd, buf, len, offset);
+}
+
+static inline guint16 get_short(const guchar* p, gboolean be)
+{
+    return be ? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+}
+
+static inline guint32 get_long(const guchar* p, gboolean be)
+{
+    return be ? ((guint32)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]
+              : ((guint32)p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+/* value of IFD entry which fits into entry itself */
+static guint32 get_entry_value(const guchar* entry, gboolean be)
+{
+    switch(get_short(entry + 2, be))
+    {
+    case TYPE_SHORT:
+        return get_short(entry + 8, be);
+    case TYPE_LONG:
+        return get_long(entry + 8, be);
+    }
+    return 0;
+}
+
+/**
+ * _fm_jpeg_exif_read_thumbnail:
+ * @fd: file descriptor of JPEG file
+ * @thumbnail: (out) location to store embedded JPEG thumbnail
+ * @len: (out) location to store length of @thumbnail
+ * @orientation: (out) location to store EXIF orientation
+ *
+ * Retrieves thumbnail and orientation from EXIF data of JPEG file. If
+ * there is no thumbnail in EXIF data then @thumbnail is set to %NULL.
+ * Orientation is set to 1 (no transformation) if it is not found. This
+ * call doesn't change file offset of @fd so may be used from any thread.
+ * Returned data should be freed with g_free() after usage.
+ *
+ * Returns: %TRUE if file has EXIF data.
+ */
+gboolean _fm_jpeg_exif_read_thumbnail(int fd, guchar** thumbnail, gsize* len,
+                                      int* orientation)
+{
+    JpegReader r;
+    guchar buf[8];
+    guchar* entries;
+    gssize n;
+    guint64 pos, tiff = 0;
+    guint32 tiff_len = 0, ifd, thumb_offset = 0, thumb_len = 0;
+    guint i, j, n_ifd, n_entries;
+    gboolean be;
+
+    *thumbnail = NULL;
+    *len = 0;
+    *orientation = 1;
+
+    r.fd = fd;
+    do
+        n = pread(fd, r.head, HEAD_SIZE, 0);
+    while(n < 0 && errno == EINTR);
+    if(n < 4 || r.head[0] != 0xFF || r.head[1] != 0xD8) /* not JPEG */
+        return FALSE;
+    r.head_len = n;
+
+    /* find APP1 segment with EXIF data */
+    for(pos = 2, i = 0; i < MAX_SEGMENTS; i++)
+    {
+        guint seg_len;
+
+        if(!jpeg_read(&r, pos, buf, 4) || buf[0] != 0xFF)
+            return FALSE;
+        if(buf[1] == 0xFF) /* fill byte */
+        {
+            pos++;
+            continue;
+        }
+        if(buf[1] == 0xDA || buf[1] == 0xD9) /* image data started */
+            return FALSE;
+        seg_len = (buf[2] << 8) | buf[3]; /* includes length itself */
+        if(seg_len < 2)
+            return FALSE;
+        if(buf[1] == 0xE1 && seg_len >= 8 + 8
+           && jpeg_read(&r, pos + 4, buf, 6) && memcmp(buf, "Exif\0\0", 6) == 0)
+        {
+            tiff = pos + 10;
+            tiff_len = seg_len - 8;
+            break;
+        }
+        pos += 2 + seg_len;
+    }
+    if(tiff == 0)
+        return FALSE;
+
+    /* TIFF header: byte order, magic number, offset of IFD0 */
+    if(!jpeg_read(&r, tiff, buf, 8))
+        return FALSE;
+    if(buf[0] == 'M' && buf[1] == 'M')
+        be = TRUE;
+    else if(buf[0] == 'I' && buf[1] == 'I')
+        be = FALSE;
+    else
+        return FALSE;
+    if(get_short(buf + 2, be) != 42)
+        return FALSE;
+    ifd = get_long(buf + 4, be);
+
+    /* IFD0 describes main image, IFD1 describes thumbnail */
+    for(n_ifd = 0; n_ifd < 2 && ifd != 0; n_ifd++)
+    {
+        gsize size;
+
+        if((guint64)ifd + 2 > tiff_len || !jpeg_read(&r, tiff + ifd, buf, 2))
+            break;
+        n_entries = get_short(buf, be);
+        size = n_entries * 12 + 4; /* entries and offset of next IFD */
+        if((guint64)ifd + 2 + size > tiff_len)
+            break;
+        entries = g_malloc(size);
+        if(!jpeg_read(&r, tiff + ifd + 2, entries, size))
+        {
+            g_free(entries);
+            break;
+        }
+        for(j = 0; j < n_entries; j++)
+        {
+            const guchar* entry = entries + j * 12;
+            switch(get_short(entry, be))
+            {
+            case TAG_ORIENTATION:
+                if(n_ifd == 0)
+                    *orientation = get_entry_value(entry, be);
+                break;
+            case TAG_JPEG_OFFSET:
+                if(n_ifd == 1)
+                    thumb_offset = get_entry_value(entry, be);
+                break;
+            case TAG_JPEG_LENGTH:
+                if(n_ifd == 1)
+                    thumb_len = get_entry_value(entry, be);
+                break;
+            }
+        }
+        ifd = get_long(entries + n_entries * 12, be);
+        g_free(entries);
+    }
+
+    if(thumb_offset > 0 && thumb_len >= 2
+       && (guint64)thumb_offset + thumb_len <= tiff_len)
+    {
+        *thumbnail = g_malloc(thumb_len);
+        if(jpeg_read(&r, tiff + thumb_offset, *thumbnail, thumb_len)
+           && (*thumbnail)[0] == 0xFF && (*thumbnail)[1] == 0xD8)
+            *len = thumb_len;
+        else
+        {
+            g_free(*thumbnail);
+            *thumbnail = NULL;
+        }
+    }
+    return TRUE;
+}
@@ -0,0 +1,35 @@
+/*
+ *      fm-jpeg-exif.h
+ *
+ *      This file is a part of the Libfm library.
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __FM_JPEG_EXIF_H__
+#define __FM_JPEG_EXIF_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* this is internal API for thumbnail loader, not exported from the library */
+
+gboolean _fm_jpeg_exif_read_thumbnail(int fd, guchar** thumbnail, gsize* len,
+                                      int* orientation);
+
+G_END_DECLS
+
+#endif /* __FM_JPEG_EXIF_H__ */
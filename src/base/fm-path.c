@@ -49,10 +49,11 @@
 struct _FmPath
 {
     gint n_ref;
+    guint hash; /* cached fm_path_hash() */
     FmPath* parent;
     char *disp_name;
-    GSequenceIter *iter; /* iterator in parent, NULL for root path */
-    GSequence *children; /* children to reuse paths */
+    GHashTable *children; /* children to reuse paths, keyed by name */
+    guint name_size; /* allocated space for name, to free it */
     guchar flags; /* FmPathFlags flags : 8; */
     char name[1]; /* basename: in local encoding if native, uri-escaped otherwise */
 };
@@ -80,20 +81,102 @@ static FmPath* apps_root_path = NULL;
 
 static GSList* roots = NULL;
 
-/* a lock for access to changeable data: roots list, and
-   members of FmPath struct: disp_name, iter, children */
+/* locks for access to changeable data: children of a path and members of
+   its children FmPath struct: disp_name; the lock is selected by parent
+   so threads working in different directories don't wait each other;
+   roots list is protected by the lock of NULL parent */
+#if GLIB_CHECK_VERSION(2, 32, 0)
+#define N_PATH_LOCKS 32 /* should be power of 2 */
+static GMutex path_locks[N_PATH_LOCKS];
+/* skip low bits of pointer, those are the same due to malloc() alignment */
+#define _path_lock(parent) \
+    (&path_locks[(GPOINTER_TO_SIZE(parent) >> 4) & (N_PATH_LOCKS - 1)])
+#define LOCK_CHILDREN(parent) g_mutex_lock(_path_lock(parent))
+#define UNLOCK_CHILDREN(parent) g_mutex_unlock(_path_lock(parent))
+#else
 G_LOCK_DEFINE_STATIC(roots);
+#define LOCK_CHILDREN(parent) G_LOCK(roots)
+#define UNLOCK_CHILDREN(parent) G_UNLOCK(roots)
+#endif
+
+/* path data are locked by the parent */
+#define LOCK_PATH(path) LOCK_CHILDREN((path)->parent)
+#define UNLOCK_PATH(path) UNLOCK_CHILDREN((path)->parent)
 
 static FmPath* _fm_path_alloc(FmPath* parent, int name_len, int flags)
 {
     FmPath* path;
-    path = (FmPath*)g_malloc(sizeof(FmPath) + name_len);
+    /* GSlice keeps objects of the same size together and it's much
+       better than malloc() for millions of small paths */
+    path = (FmPath*)g_slice_alloc(sizeof(FmPath) + name_len);
+    path->name_size = name_len;
     path->n_ref = 1;
     path->flags = flags;
     path->parent = parent ? fm_path_ref(parent) : NULL;
     path->disp_name = NULL;
     path->children = NULL;
-    path->iter = NULL;
+    return path;
+}
+
+/* should be called after name is set */
+static inline void _fm_path_init_hash(FmPath* path)
+{
+    guint hash = g_str_hash(path->name);
+    if(path->parent)
+    {
+        /* this is learned from g_str_hash() of glib. */
+        hash = (hash << 5) - hash + '/';
+        /* this is learned from g_icon_hash() of gio. */
+        hash ^= path->parent->hash;
+    }
+    path->hash = hash;
+}
+
+/* takes a reference unless path is being destroyed by another thread */
+static inline gboolean _fm_path_try_ref(FmPath* path)
+{
+    gint n_ref;
+
+    do
+    {
+        n_ref = g_atomic_int_get(&path->n_ref);
+        if (n_ref == 0)
+            return FALSE;
+    }
+    while (!g_atomic_int_compare_and_exchange(&path->n_ref, n_ref, n_ref + 1));
+    return TRUE;
+}
+
+/* children of the same parent are equal if their names are equal */
+static gboolean _fm_path_name_equal(gconstpointer a, gconstpointer b)
+{
+    return strcmp(((FmPath*)a)->name, ((FmPath*)b)->name) == 0;
+}
+
+/* adds new path into children of its parent if there is no such path yet,
+   otherwise drops it and returns the existing one */
+static FmPath* _fm_path_intern(FmPath* path)
+{
+    FmPath* parent = path->parent;
+    FmPath* np;
+
+    _fm_path_init_hash(path);
+    LOCK_CHILDREN(parent);
+    if (parent->children == NULL)
+        parent->children = g_hash_table_new((GHashFunc)fm_path_hash,
+                                            _fm_path_name_equal);
+    else if ((np = g_hash_table_lookup(parent->children, path)) != NULL &&
+             _fm_path_try_ref(np))
+    {
+        /* g_debug("found reusable path '%s'", path->name); */
+        UNLOCK_CHILDREN(parent); /* we should not unref with lock up */
+        fm_path_unref(path); /* drop this path and reuse found one */
+        return np;
+    }
+    /* if found one is being destroyed then replace it right away, it will
+       not remove the new one from the table when destroyed */
+    g_hash_table_replace(parent->children, path, path);
+    UNLOCK_CHILDREN(parent);
     return path;
 }
 
@@ -103,14 +186,8 @@ static inline FmPath* _fm_path_new_internal(FmPath* parent, const char* name, in
     memcpy(path->name, name, name_len);
     path->name[name_len] = '\0';
     if (parent)
-    {
-        G_LOCK(roots);
-        if (parent->children == NULL)
-            parent->children = g_sequence_new(NULL);
-        path->iter = g_sequence_insert_sorted(parent->children, path,
-                                              (GCompareDataFunc)fm_path_compare, NULL);
-        G_UNLOCK(roots);
-    }
+        return _fm_path_intern(path);
+    _fm_path_init_hash(path);
     return path;
 }
 
@@ -221,22 +298,19 @@ static FmPath* _fm_path_new_uri_root(const char* uri, int len, const char** rema
 
     /* it's reasonable to have double slashes :// for URIs other than mailto: */
     len = scheme_len + 3 + host_len + 1;
-    G_LOCK(roots);
+    LOCK_CHILDREN(NULL);
     for(l = roots; l; l = l->next)
     {
         path = l->data;
         if(strncmp(path->name, uri, scheme_len) == 0 &&
            (!host_len || !strncmp(&path->name[scheme_len + 3], host, host_len)) &&
-           strcmp(&path->name[len-1], "/") == 0)
+           strcmp(&path->name[len-1], "/") == 0 && _fm_path_try_ref(path))
         {
-            fm_path_ref(path);
-            G_UNLOCK(roots);
+            UNLOCK_CHILDREN(NULL);
             return path;
         }
     }
     path = _fm_path_alloc(NULL, len, flags);
-    roots = g_slist_append(roots, path);
-    G_UNLOCK(roots);
     buf = path->name;
     memcpy(buf, uri, scheme_len); /* the scheme */
     buf += scheme_len;
@@ -249,8 +323,11 @@ static FmPath* _fm_path_new_uri_root(const char* uri, int len, const char** rema
     }
     buf[0] = '/'; /* the trailing / */
     buf[1] = '\0';
+    _fm_path_init_hash(path);
     if (disp_name)
         path->disp_name = g_strdup(disp_name); /* no lock required, it's new data */
+    roots = g_slist_prepend(roots, path);
+    UNLOCK_CHILDREN(NULL);
     return path;
 
 on_error: /* this is not a valid URI */
@@ -341,48 +418,8 @@ FmPath* _fm_path_new_child_len(FmPath* parent, const char* basename, int name_le
     }
     path->name[name_len] = '\0';
 
-    G_LOCK(roots);
-    if (parent->children)
-    {
-        GSequenceIter *iter;
-
-        /* try to reuse existing path */
-#if GLIB_CHECK_VERSION(2, 28, 0)
-        iter = g_sequence_lookup(parent->children, path,
-                                 (GCompareDataFunc)fm_path_compare, NULL);
-#else
-        iter = g_sequence_search(parent->children, path,
-                                 (GCompareDataFunc)fm_path_compare, NULL);
-        if (iter)
-        {
-            FmPath *pp = NULL;
-            iter = g_sequence_iter_prev(iter);
-            if (iter)
-                pp = g_sequence_get(iter);
-            if (fm_path_compare(pp, path) != 0)
-                iter = NULL;
-        }
-#endif
-        if (iter)
-        {
-                /* g_debug("found reusable path '%.*s'", name_len, basename); */
-            FmPath *np = fm_path_ref(g_sequence_get(iter));
-            G_UNLOCK(roots); /* we should not unref with lock up */
-            fm_path_unref(path); /* drop this path and reuse found one */
-            return np;
-        }
-        else
-            path->iter = g_sequence_insert_sorted(parent->children, path,
-                                                  (GCompareDataFunc)fm_path_compare,
-                                                  NULL);
-    }
-    else
-    {
-        parent->children = g_sequence_new(NULL);
-        path->iter = g_sequence_append(parent->children, path);
-    }
-    G_UNLOCK(roots);
-    return path;
+    /* try to reuse existing path */
+    return _fm_path_intern(path);
 }
 
 FmPath* fm_path_new_child_len(FmPath* parent, const char* basename, int name_len)
@@ -569,30 +606,31 @@ static FmPath *_lookup_in_children(FmPath *path, const char *display_name)
 {
     FmPath *subpath = NULL;
 
-    G_LOCK(roots);
-    if (path->children != NULL)
+    FmPath *parent = path;
+
+    LOCK_CHILDREN(parent);
+    if (parent->children != NULL)
     {
-        GSequenceIter *iter = g_sequence_get_begin_iter(path->children);
+        GHashTableIter iter;
         const char *name;
 
-        while (!g_sequence_iter_is_end(iter))
+        g_hash_table_iter_init(&iter, parent->children);
+        while (g_hash_table_iter_next(&iter, (gpointer*)&path, NULL))
         {
-            path = (FmPath*)g_sequence_get(iter);
             name = path->disp_name;
             if (name)
             {
                 if (name == BASENAME_AS_DISP_NAME)
                     name = path->name;
-                if (strcmp(display_name, name) == 0)
+                if (strcmp(display_name, name) == 0 && _fm_path_try_ref(path))
                 {
-                    subpath = fm_path_ref(path);
+                    subpath = path;
                     break;
                 }
             }
-            iter = g_sequence_iter_next(iter);
         }
     }
-    G_UNLOCK(roots);
+    UNLOCK_CHILDREN(parent);
     return subpath;
 }
 
@@ -795,29 +833,33 @@ void fm_path_unref(FmPath* path)
     /* g_debug("fm_path_unref: %s, n_ref = %d", fm_path_to_str(path), path->n_ref); */
     if(g_atomic_int_dec_and_test(&path->n_ref))
     {
-        G_LOCK(roots);
-        if(G_LIKELY(path->parent))
+        FmPath *parent = path->parent;
+
+        LOCK_CHILDREN(parent);
+        if(G_LIKELY(parent))
         {
-            if (G_LIKELY(path->iter))
-                g_sequence_remove(path->iter);
-                /* otherwise it's fresh abandoned one, see above */
-            G_UNLOCK(roots); /* we should not unref with lock up */
-            fm_path_unref(path->parent);
+            /* it may be fresh abandoned one or already replaced one, see
+               _fm_path_intern(), then we should not touch the table */
+            if (G_LIKELY(parent->children) &&
+                g_hash_table_lookup(parent->children, path) == path)
+                g_hash_table_remove(parent->children, path);
+            UNLOCK_CHILDREN(parent); /* we should not unref with lock up */
+            fm_path_unref(parent);
         }
         else
         {
             roots = g_slist_remove(roots, path);
-            G_UNLOCK(roots);
+            UNLOCK_CHILDREN(parent);
         }
         /* no further lock required, it is removed from lists */
         if (path->disp_name != BASENAME_AS_DISP_NAME)
             g_free(path->disp_name);
         if (G_UNLIKELY(path->children))
         {
-            g_assert(g_sequence_get_length(path->children) == 0);
-            g_sequence_free(path->children);
+            g_assert(g_hash_table_size(path->children) == 0);
+            g_hash_table_destroy(path->children);
         }
-        g_free(path);
+        g_slice_free1(sizeof(FmPath) + path->name_size, path);
     }
 }
 
@@ -1074,19 +1116,19 @@ char* fm_path_display_basename(FmPath* path)
 {
     if(G_UNLIKELY(!path->parent)) /* root_path element */
         return g_strdup(path->name);
-    G_LOCK(roots);
+    LOCK_PATH(path);
     if (G_LIKELY(path->disp_name == BASENAME_AS_DISP_NAME))
     {
-        G_UNLOCK(roots);
+        UNLOCK_PATH(path);
         return g_strdup(path->name);
     }
     if (path->disp_name)
     {
         char *name = g_strdup(path->disp_name);
-        G_UNLOCK(roots);
+        UNLOCK_PATH(path);
         return name;
     }
-    G_UNLOCK(roots);
+    UNLOCK_PATH(path);
     if(!fm_path_is_native(path))
         return g_uri_unescape_string(path->name, NULL);
     return g_filename_display_name(path->name);
@@ -1105,13 +1147,13 @@ void _fm_path_set_display_name(FmPath *path, const char *disp_name)
         g_free(_name);
         return;
     }
-    G_LOCK(roots);
+    LOCK_PATH(path);
     if (path->disp_name != BASENAME_AS_DISP_NAME)
     {
         /* check if it is set already */
         if (g_strcmp0(disp_name, path->disp_name) == 0)
         {
-            G_UNLOCK(roots);
+            UNLOCK_PATH(path);
             return;
         }
         g_free(path->disp_name);
@@ -1125,7 +1167,7 @@ void _fm_path_set_display_name(FmPath *path, const char *disp_name)
         path->disp_name = BASENAME_AS_DISP_NAME;
     else
         path->disp_name = g_strdup(disp_name);
-    G_UNLOCK(roots);
+    UNLOCK_PATH(path);
 }
 
 /* use this to avoid change from another thread */
@@ -1134,10 +1176,10 @@ static char *_display_name_static_keeper = NULL;
 /* this API is not thread capable! */
 const char *_fm_path_get_display_name(FmPath *path)
 {
-    G_LOCK(roots);
+    LOCK_PATH(path);
     if (path->disp_name == BASENAME_AS_DISP_NAME)
     {
-        G_UNLOCK(roots);
+        UNLOCK_PATH(path);
         return path->name;
     }
     g_free(_display_name_static_keeper);
@@ -1145,7 +1187,7 @@ const char *_fm_path_get_display_name(FmPath *path)
        thread may change it at that time, although _display_name_static_keeper
        isn't protected by lock so should be protected by general glib lock */
     _display_name_static_keeper = g_strdup(path->disp_name);
-    G_UNLOCK(roots);
+    UNLOCK_PATH(path);
     return _display_name_static_keeper;
 }
 
@@ -1342,15 +1384,8 @@ void _fm_path_finalize(void)
 /* FIXME: is this good enough? */
 guint fm_path_hash(FmPath* path)
 {
-    guint hash = g_str_hash(path->name);
-    if(path->parent)
-    {
-        /* this is learned from g_str_hash() of glib. */
-        hash = (hash << 5) - hash + '/';
-        /* this is learned from g_icon_hash() of gio. */
-        hash ^= fm_path_hash(path->parent);
-    }
-    return hash;
+    /* it's calculated once when path is created, see _fm_path_init_hash() */
+    return path->hash;
 }
 
 /**
@@ -38,6 +38,7 @@
 #endif
 
 #include "fm-thumbnail-loader.h"
+#include "fm-thumbnail-pack.h"
 #include "glib-compat.h"
 
 #include "fm-config.h"
@@ -45,12 +46,14 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <signal.h>
 
 #ifdef USE_EXIF
 #include <libexif/exif-loader.h>
+#include "fm-jpeg-exif.h"
 #endif
 
 /* #define ENABLE_DEBUG */
@@ -62,8 +65,15 @@
 
 #define THUMBNAILER_TIMEOUT_SEC     30
 
+/* subdirectory in thumbnails/fail/ for our failure marks */
+#define THUMBNAIL_FAIL_DIR          "libfm-" PACKAGE_VERSION
+
+/* threads reading ready thumbnails from disk */
+#define THUMBNAIL_LOADER_THREADS    2
+
 static gboolean backend_loaded = FALSE;
 static FmThumbnailLoaderBackend backend = {NULL};
+static FmThumbnailLoaderReadAtSizeFunc read_image_from_file_at_size = NULL;
 
 typedef enum
 {
@@ -82,7 +92,10 @@ struct _ThumbnailTask
     char* uri;              /* used internally */
     char* normal_path;      /* used internally */
     char* large_path;       /* used internally */
+    char* fail_path;        /* used internally */
     GList* requests;        /* access should be locked */
+    guint n_active;         /* number of requests not cancelled yet */
+    GList* link;            /* link in lane queue, NULL while processed */
 };
 /* cancelled above raised when all requests are cancelled and never dropped again */
 
@@ -99,22 +112,18 @@ struct _FmThumbnailLoader
     gboolean done : 1; /* it has pix set so will be pushed into ready queue */
 };
 
+/* item of in-memory cache, it's both key and value in the hash */
 typedef struct _ThumbnailCacheItem ThumbnailCacheItem;
 struct _ThumbnailCacheItem
-{
-    guint size;
-    GObject* pix; /* no reference on it */
-};
-
-typedef struct _ThumbnailCache ThumbnailCache;
-struct _ThumbnailCache
 {
     FmPath* path;
-    GSList* items;
+    guint size;
+    time_t mtime;           /* mtime of the file the thumbnail is for */
+    gsize bytes;            /* approximate memory used by pix */
+    GObject* pix;
+    GList lru;              /* link in cache_lru, data points to item */
 };
 
-/* FIXME: use thread pool */
-
 /* Lock for loader, generator, and ready queues */
 #if GLIB_CHECK_VERSION(2, 32, 0)
 static GMutex queue_lock;
@@ -128,30 +137,81 @@ static GCond *queue_cond;
 #define cond_ptr queue_cond
 #endif
 
+/* tasks are handled by two lanes of threads: one loads already generated
+   thumbnails and another one generates missing ones, so slow generation
+   never delays thumbnails which are in disk cache already */
+typedef struct _ThumbnailLane ThumbnailLane;
+struct _ThumbnailLane
+{
+    GQueue queue;           /* consists of ThumbnailTask */
+    guint n_threads;        /* number of threads running for the lane */
+    const char* name;
+};
+
 /* load generated thumbnails */
-static GQueue loader_queue = G_QUEUE_INIT; /* consists of ThumbnailTask */
-static gboolean loader_thread_running = FALSE;
+static ThumbnailLane loader_lane = { G_QUEUE_INIT, 0, "loader" };
+/* generate new thumbnails */
+static ThumbnailLane generator_lane = { G_QUEUE_INIT, 0, "generator" };
+
+/* Lock for external thumbnailers scheduling, it's never held together
+   with the queue lock so children are reaped without blocking queues */
+#if GLIB_CHECK_VERSION(2, 32, 0)
+static GMutex thumbnailer_lock;
+#define tlock_ptr &thumbnailer_lock
+static GCond thumbnailer_cond;
+#define tcond_ptr &thumbnailer_cond
+#else
+static GMutex *thumbnailer_lock;
+#define tlock_ptr thumbnailer_lock
+static GCond *thumbnailer_cond;
+#define tcond_ptr thumbnailer_cond
+#endif
+/* number of running external thumbnailers, total and per MIME type */
+static guint n_thumbnailers = 0;
+static GHashTable* thumbnailers_per_type = NULL; /* interned type -> count */
 
 /* already loaded thumbnails */
 static GQueue ready_queue = G_QUEUE_INIT; /* consists of FmThumbnailLoader */
 /* idle handler to call ready callback */
 static guint ready_idle_handler = 0;
 
-/* cached thumbnails, elements are ThumbnailCache* */
+/* cached thumbnails, elements are ThumbnailCacheItem* */
 static GHashTable* hash = NULL;
+/* the same items, most recently used first */
+static GQueue cache_lru = G_QUEUE_INIT;
+/* sum of bytes of all items */
+static gsize cache_bytes = 0;
 
-static char* thumb_dir = NULL;
+/* files which failed thumbnailing, FmPath -> mtime */
+static GHashTable* failed_hash = NULL;
+/* tasks in loader lane which aren't started yet, FmPath -> ThumbnailTask */
+static GHashTable* queued_hash = NULL;
 
-static guint thumbnailer_timeout_id = 0;
+/* activity counters, locked by queue lock; queue sizes aren't used there */
+static FmThumbnailLoaderStats loader_stats;
 
-static gpointer load_thumbnail_thread(gpointer user_data);
+static char* thumb_dir = NULL;
+
+static gpointer thumbnail_thread(gpointer user_data);
 static void load_thumbnails(ThumbnailTask* task);
 static void generate_thumbnails(ThumbnailTask* task);
-static gboolean generate_thumbnails_with_builtin(ThumbnailTask* task);
-static void generate_thumbnails_with_thumbnailers(ThumbnailTask* task);
+static gboolean generate_thumbnails_with_builtin(ThumbnailTask* task, gboolean* skipped);
+static gboolean generate_thumbnails_with_thumbnailers(ThumbnailTask* task, gboolean* skipped);
 static GObject* scale_pix(GObject* ori_pix, int size);
 static void save_thumbnail_to_disk(ThumbnailTask* task, GObject* pix, const char* path);
 
+/* time in microseconds for stats */
+static inline gint64 stats_now(void)
+{
+#if GLIB_CHECK_VERSION(2, 28, 0)
+    return g_get_monotonic_time();
+#else
+    GTimeVal tv;
+    g_get_current_time(&tv);
+    return (gint64)tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+#endif
+}
+
 /* may be called in thread */
 static void fm_thumbnail_loader_free(FmThumbnailLoader* req)
 {
@@ -211,66 +271,63 @@ static gint comp_request(gconstpointer a, gconstpointer b)
     return ((FmThumbnailLoader*)a)->size - ((FmThumbnailLoader*)b)->size;
 }
 
-/* called when cached pixbuf get destroyed */
-static void on_pixbuf_destroy(gpointer data, GObject* obj_ptr)
+static guint cache_item_hash(gconstpointer key)
 {
-    ThumbnailCache* cache = (ThumbnailCache*)data;
-    GObject* pix = (GObject*)obj_ptr;
-    GSList* l;
-    /* remove it from cache */
-    DEBUG("remove from cache!");
-    g_mutex_lock(lock_ptr);
-    for(l=cache->items;l;l=l->next)
-    {
-        ThumbnailCacheItem* item = (ThumbnailCacheItem*)l->data;
-        if(item->pix == pix)
-        {
-            cache->items = g_slist_delete_link(cache->items, l);
-            g_slice_free(ThumbnailCacheItem, item);
-            if(!cache->items)
-            {
-                if(hash) /* it could be already destroyed */
-                    g_hash_table_remove(hash, cache->path);
-                fm_path_unref(cache->path);
-                g_slice_free(ThumbnailCache, cache);
-            }
-            break;
-        }
-    }
-    g_mutex_unlock(lock_ptr);
+    const ThumbnailCacheItem* item = key;
+    return fm_path_hash(item->path) * 31 + item->size;
+}
+
+static gboolean cache_item_equal(gconstpointer a, gconstpointer b)
+{
+    const ThumbnailCacheItem* item1 = a;
+    const ThumbnailCacheItem* item2 = b;
+    return item1->size == item2->size && fm_path_equal(item1->path, item2->path);
+}
+
+/* may be called in thread */
+static void cache_item_free(gpointer data)
+{
+    ThumbnailCacheItem* item = data;
+    cache_bytes -= item->bytes;
+    fm_path_unref(item->path);
+    g_object_unref(item->pix);
+    g_slice_free(ThumbnailCacheItem, item);
+}
+
+/* should be called with queue lock held */
+/* may be called in thread */
+static void cache_item_remove(ThumbnailCacheItem* item)
+{
+    g_queue_unlink(&cache_lru, &item->lru);
+    g_hash_table_remove(hash, item); /* frees it */
 }
 
 /* called with queue lock held */
 /* in thread */
-inline static void cache_thumbnail_in_hash(FmPath* path, GObject* pix, guint size)
+inline static void cache_thumbnail_in_hash(FmFileInfo* fi, GObject* pix, guint size)
 {
-    ThumbnailCache* cache;
-    ThumbnailCacheItem* item;
-    GSList* l = NULL;
-    cache = (ThumbnailCache*)g_hash_table_lookup(hash, path);
-    if(cache)
-    {
-        for(l=cache->items;l;l=l->next)
-        {
-            item = (ThumbnailCacheItem*)l->data;
-            if(item->size == size)
-                break;
-        }
-    }
-    else
-    {
-        cache = g_slice_new0(ThumbnailCache);
-        cache->path = fm_path_ref(path);
-        g_hash_table_insert(hash, cache->path, cache);
-    }
-    if(!l) /* the item is not in cache->items */
-    {
-        item = g_slice_new(ThumbnailCacheItem);
-        item->size = size;
-        item->pix = pix;
-        cache->items = g_slist_prepend(cache->items, item);
-        g_object_weak_ref(G_OBJECT(pix), on_pixbuf_destroy, cache);
-    }
+    ThumbnailCacheItem key, *item;
+    gsize budget = (gsize)fm_config->thumbnail_cache_size << 10;
+
+    key.path = fm_file_info_get_path(fi);
+    key.size = size;
+    item = g_hash_table_lookup(hash, &key);
+    if(item) /* replace outdated one */
+        cache_item_remove(item);
+    item = g_slice_new(ThumbnailCacheItem);
+    item->path = fm_path_ref(key.path);
+    item->size = size;
+    item->mtime = fm_file_info_get_mtime(fi);
+    item->bytes = (gsize)backend.get_image_width(pix) * backend.get_image_height(pix) * 4;
+    item->pix = g_object_ref(pix);
+    item->lru.data = item;
+    item->lru.prev = item->lru.next = NULL;
+    g_queue_push_head_link(&cache_lru, &item->lru);
+    g_hash_table_insert(hash, item, item);
+    cache_bytes += item->bytes;
+    /* drop least recently used thumbnails which are out of budget */
+    while(cache_bytes > budget && cache_lru.tail != NULL)
+        cache_item_remove(cache_lru.tail->data);
 }
 
 /* in thread */
@@ -323,7 +380,7 @@ static void thumbnail_task_finish(ThumbnailTask* task, GObject* normal_pix, GObj
         g_mutex_lock(lock_ptr);
         /* cache this in hash table */
         if(cached_pix)
-            cache_thumbnail_in_hash(fm_file_info_get_path(req->fi), cached_pix, cached_size);
+            cache_thumbnail_in_hash(req->fi, cached_pix, cached_size);
         else
             continue;
 
@@ -370,6 +427,169 @@ static gboolean is_thumbnail_outdated(GObject* thumb_pix, const char* thumbnail_
     return outdated;
 }
 
+/* in thread */
+/* checks if there is a valid failure mark for the task in fail cache */
+static gboolean is_thumbnail_failed(ThumbnailTask* task)
+{
+    GObject* fail_pix = backend.read_image_from_file(task->fail_path);
+    char* thumb_mtime;
+    gboolean failed = FALSE;
+
+    if(!fail_pix)
+        return FALSE;
+    thumb_mtime = backend.get_image_text(fail_pix, "tEXt::Thumb::MTime");
+    if(thumb_mtime)
+    {
+        failed = (atol(thumb_mtime) == fm_file_info_get_mtime(task->fi));
+        g_free(thumb_mtime);
+    }
+    g_object_unref(fail_pix);
+    if(!failed) /* the file was changed since, try again */
+        unlink(task->fail_path);
+    return failed;
+}
+
+/* should be called with queue lock held */
+/* in thread */
+static void remember_failed_thumbnail(ThumbnailTask* task)
+{
+    g_hash_table_insert(failed_hash, fm_path_ref(fm_file_info_get_path(task->fi)),
+                        GSIZE_TO_POINTER((gsize)fm_file_info_get_mtime(task->fi)));
+}
+
+/* computes CRC of PNG chunk */
+static guint32 png_crc(const guchar* buf, gsize len)
+{
+    guint32 c = 0xffffffff;
+    gsize i;
+    int k;
+
+    for(i = 0; i < len; i++)
+    {
+        c ^= buf[i];
+        for(k = 0; k < 8; k++)
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    }
+    return c ^ 0xffffffff;
+}
+
+static void png_append_chunk(GByteArray* png, const char* type,
+                             const guchar* data, guint32 len)
+{
+    guint32 val = GUINT32_TO_BE(len);
+    guint start;
+
+    g_byte_array_append(png, (guchar*)&val, 4);
+    start = png->len;
+    g_byte_array_append(png, (guchar*)type, 4);
+    if(len > 0)
+        g_byte_array_append(png, data, len);
+    val = GUINT32_TO_BE(png_crc(png->data + start, len + 4));
+    g_byte_array_append(png, (guchar*)&val, 4);
+}
+
+static void png_append_text(GByteArray* png, const char* key, const char* val)
+{
+    gsize key_len = strlen(key) + 1; /* including separating '\0' */
+    gsize val_len = strlen(val);
+    guchar* data = g_malloc(key_len + val_len);
+
+    memcpy(data, key, key_len);
+    memcpy(data + key_len, val, val_len);
+    png_append_chunk(png, "tEXt", data, key_len + val_len);
+    g_free(data);
+}
+
+/* in thread */
+/* saves failure mark as XDG specification requires: 1x1 transparent PNG
+   image with Thumb::URI and Thumb::MTime, we cannot use backend for this
+   since there is no image to save in case of failure */
+static void save_failed_thumbnail(ThumbnailTask* task)
+{
+    static const guchar signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    static const guchar ihdr[13] = { 0, 0, 0, 1, 0, 0, 0, 1, /* 1x1 */
+                                     8, 6, 0, 0, 0 }; /* 8 bits, RGBA */
+    /* zlib stream with one stored block: filter byte and a RGBA pixel */
+    static const guchar idat[] = { 0x78, 0x01, 0x01, 0x05, 0x00, 0xfa, 0xff,
+                                   0, 0, 0, 0, 0,
+                                   0x00, 0x05, 0x00, 0x01 }; /* Adler-32 */
+    GByteArray* png;
+    char mtime_str[100];
+    char* tmpfile;
+    char* fail_dir;
+    gint fd;
+
+    fail_dir = g_path_get_dirname(task->fail_path);
+    g_mkdir_with_parents(fail_dir, 0700);
+    g_free(fail_dir);
+    png = g_byte_array_sized_new(256);
+    g_byte_array_append(png, signature, sizeof(signature));
+    png_append_chunk(png, "IHDR", ihdr, sizeof(ihdr));
+    png_append_text(png, "Thumb::URI", task->uri);
+    g_snprintf(mtime_str, 100, "%lu", fm_file_info_get_mtime(task->fi));
+    png_append_text(png, "Thumb::MTime", mtime_str);
+    png_append_text(png, "Software", "libfm");
+    png_append_chunk(png, "IDAT", idat, sizeof(idat));
+    png_append_chunk(png, "IEND", NULL, 0);
+    tmpfile = g_strconcat(task->fail_path, ".XXXXXX", NULL);
+    fd = g_mkstemp(tmpfile); /* save to a temp file first */
+    if(fd != -1)
+    {
+        gboolean ok = (write(fd, png->data, png->len) == (ssize_t)png->len);
+        close(fd);
+        if(ok)
+            g_rename(tmpfile, task->fail_path);
+        else
+            unlink(tmpfile);
+    }
+    g_free(tmpfile);
+    g_byte_array_free(png, TRUE);
+    DEBUG("generator: failure mark saved to %s", task->fail_path);
+}
+
+/* in thread */
+static GObject* read_thumbnail_from_pack(ThumbnailTask* task, guint size)
+{
+    GObject* pix = NULL;
+    GInputStream* stream;
+    guchar* data;
+    gsize len;
+
+    if(_fm_thumbnail_pack_lookup(fm_file_info_get_path(task->fi), size,
+                                 fm_file_info_get_mtime(task->fi), &data, &len))
+    {
+        stream = g_memory_input_stream_new_from_data(data, len, g_free);
+        pix = backend.read_image_from_stream(stream, len, task->cancellable);
+        g_object_unref(stream);
+    }
+    return pix;
+}
+
+/* in thread */
+/* reads thumbnail from cache; if @data isn't NULL then PNG data are read
+   into memory and returned in it so they can be added to pack as well */
+static GObject* read_thumbnail_from_file(ThumbnailTask* task, const char* path,
+                                         guchar** data, gsize* len)
+{
+    GObject* pix = NULL;
+    GInputStream* stream;
+    gchar* contents;
+
+    if(data == NULL)
+        return backend.read_image_from_file(path);
+    *data = NULL;
+    if(!g_file_get_contents(path, &contents, len, NULL))
+        return NULL;
+    stream = g_memory_input_stream_new_from_data(contents, *len, NULL);
+    pix = backend.read_image_from_stream(stream, *len, task->cancellable);
+    g_object_unref(stream);
+    if(pix)
+        *data = (guchar*)contents;
+    else
+        g_free(contents);
+    return pix;
+}
+
 /* in thread */
 static void load_thumbnails(ThumbnailTask* task)
 {
@@ -377,6 +597,10 @@ static void load_thumbnails(ThumbnailTask* task)
     GObject* large_pix = NULL;
     const char* normal_path = task->normal_path;
     const char* large_path = task->large_path;
+    gboolean use_pack = fm_config->thumbnail_pack;
+    time_t mtime = fm_file_info_get_mtime(task->fi);
+    guchar* data;
+    gsize len;
 
     if( g_cancellable_is_cancelled(task->cancellable) )
         goto _out;
@@ -385,18 +609,30 @@ static void load_thumbnails(ThumbnailTask* task)
 
     if(task->flags & LOAD_NORMAL)
     {
-        normal_pix = backend.read_image_from_file(normal_path);
-        if(!normal_pix || is_thumbnail_outdated(normal_pix, normal_path, fm_file_info_get_mtime(task->fi)))
-        {
-            /* normal_pix is freed in is_thumbnail_outdated() if it's out of date. */
-            /* generate normal size thumbnail */
-            task->flags |= GENERATE_NORMAL;
-            normal_pix = NULL;
-            /* DEBUG("need to generate normal thumbnail"); */
-        }
+        /* pack entry is checked against mtime already */
+        if(use_pack && (normal_pix = read_thumbnail_from_pack(task, 128)))
+            DEBUG("normal thumbnail loaded from pack: %p", normal_pix);
         else
         {
-            DEBUG("normal thumbnail loaded: %p", normal_pix);
+            normal_pix = read_thumbnail_from_file(task, normal_path,
+                                                  use_pack ? &data : NULL, &len);
+            if(!normal_pix || is_thumbnail_outdated(normal_pix, normal_path, mtime))
+            {
+                /* normal_pix is freed in is_thumbnail_outdated() if it's out of date. */
+                /* generate normal size thumbnail */
+                task->flags |= GENERATE_NORMAL;
+                normal_pix = NULL;
+                /* DEBUG("need to generate normal thumbnail"); */
+                if(use_pack)
+                    g_free(data);
+            }
+            else
+            {
+                DEBUG("normal thumbnail loaded: %p", normal_pix);
+                if(use_pack) /* data are passed to pack */
+                    _fm_thumbnail_pack_add(fm_file_info_get_path(task->fi), 128,
+                                           mtime, data, len);
+            }
         }
     }
 
@@ -405,16 +641,38 @@ static void load_thumbnails(ThumbnailTask* task)
 
     if(task->flags & LOAD_LARGE)
     {
-        large_pix = backend.read_image_from_file(large_path);
-        if(!large_pix || is_thumbnail_outdated(large_pix, large_path, fm_file_info_get_mtime(task->fi)))
+        if(use_pack && (large_pix = read_thumbnail_from_pack(task, 512)))
+            DEBUG("large thumbnail loaded from pack: %p", large_pix);
+        else
         {
-            /* large_pix is freed in is_thumbnail_outdated() if it's out of date. */
-            /* generate large size thumbnail */
-            task->flags |= GENERATE_LARGE;
-            large_pix = NULL;
+            large_pix = read_thumbnail_from_file(task, large_path,
+                                                 use_pack ? &data : NULL, &len);
+            if(!large_pix || is_thumbnail_outdated(large_pix, large_path, mtime))
+            {
+                /* large_pix is freed in is_thumbnail_outdated() if it's out of date. */
+                /* generate large size thumbnail */
+                task->flags |= GENERATE_LARGE;
+                large_pix = NULL;
+                if(use_pack)
+                    g_free(data);
+            }
+            else if(use_pack)
+                _fm_thumbnail_pack_add(fm_file_info_get_path(task->fi), 512,
+                                       mtime, data, len);
         }
     }
 
+    g_mutex_lock(lock_ptr);
+    if(normal_pix)
+        loader_stats.disk_hits++;
+    if(large_pix)
+        loader_stats.disk_hits++;
+    if(task->flags & GENERATE_NORMAL)
+        loader_stats.misses++;
+    if(task->flags & GENERATE_LARGE)
+        loader_stats.misses++;
+    g_mutex_unlock(lock_ptr);
+
     /* thumbnails which don't require re-generation should all be loaded at this point. */
     if(!g_cancellable_is_cancelled(task->cancellable) && task->requests)
         thumbnail_task_finish(task, normal_pix, large_pix);
@@ -428,15 +686,55 @@ _out:
     return;
 }
 
+/* may be called in thread */
+static guint thumbnail_lane_max_threads(ThumbnailLane* lane)
+{
+    if(lane == &loader_lane)
+        return THUMBNAIL_LOADER_THREADS;
+    if(fm_config->thumbnail_workers > 0)
+        return fm_config->thumbnail_workers;
+#if GLIB_CHECK_VERSION(2, 36, 0)
+    return g_get_num_processors();
+#else
+    return 2;
+#endif
+}
+
+/* should be called with queue lock held */
+/* may be called in thread */
+static void thumbnail_lane_push(ThumbnailLane* lane, ThumbnailTask* task)
+{
+    g_queue_push_tail(&lane->queue, task);
+    task->link = g_queue_peek_tail_link(&lane->queue);
+    /* threads exit when queue is empty so start one if there is a room */
+    if(lane->n_threads < thumbnail_lane_max_threads(lane))
+    {
+        lane->n_threads++;
+#if GLIB_CHECK_VERSION(2, 32, 0)
+        g_thread_new(lane->name, thumbnail_thread, lane);
+        /* we don't keep the GThread but Glib 2.32 crashes if we unref
+           GThread while it's in creation progress. It is a bug of GLib
+           certainly but as workaround we'll unref it in the thread itself */
+#else
+        g_thread_create(thumbnail_thread, lane, FALSE, NULL);
+#endif
+    }
+}
+
 /* in thread */
-static gpointer load_thumbnail_thread(gpointer user_data)
+static gpointer thumbnail_thread(gpointer user_data)
 {
+    ThumbnailLane* lane = (ThumbnailLane*)user_data;
     ThumbnailTask* task;
+    gboolean flushed = TRUE;
     GChecksum* sum = g_checksum_new(G_CHECKSUM_MD5);
     gchar* normal_path  = g_build_filename(thumb_dir, "normal/00000000000000000000000000000000.png", NULL);
     gchar* normal_basename = strrchr(normal_path, '/') + 1;
     gchar* large_path = g_build_filename(thumb_dir, "large/00000000000000000000000000000000.png", NULL);
     gchar* large_basename = strrchr(large_path, '/') + 1;
+    gchar* fail_path = g_build_filename(thumb_dir, "fail", THUMBNAIL_FAIL_DIR,
+                                        "00000000000000000000000000000000.png", NULL);
+    gchar* fail_basename = strrchr(fail_path, '/') + 1;
 
     /* ensure thumbnail directories exists */
     *(normal_basename - 1) = '\0';
@@ -450,17 +748,17 @@ static gpointer load_thumbnail_thread(gpointer user_data)
     for(;;)
     {
         g_mutex_lock(lock_ptr);
-        task = g_queue_pop_head(&loader_queue);
+        task = g_queue_pop_head(&lane->queue);
         if(G_LIKELY(task))
         {
             char* uri;
             const char* md5;
-            GList *reql;
 
-            for (reql = task->requests; reql; reql = reql->next)
-                if (!((FmThumbnailLoader*)reql->data)->cancelled)
-                    break;
-            if (reql == NULL) /* all requests were cancelled already */
+            task->link = NULL;
+
+            if (lane == &loader_lane)
+                g_hash_table_remove(queued_hash, fm_file_info_get_path(task->fi));
+            if (task->n_active == 0) /* all requests were cancelled already */
                 goto _free_task;
             if (!task->cancellable)
                 task->cancellable = g_cancellable_new();
@@ -483,10 +781,24 @@ static gpointer load_thumbnail_thread(gpointer user_data)
                 memcpy( large_basename, md5, 32 );
                 task->large_path = large_path;
             }
-            /* FIXME: support fail/<PRG>/<MD5>.png to skip creation */
+            memcpy( fail_basename, md5, 32 );
+            task->fail_path = fail_path;
 
             if(task->flags & (GENERATE_NORMAL|GENERATE_LARGE))
-                generate_thumbnails(task); /* second cycle */
+            {
+                /* second cycle */
+                if(is_thumbnail_failed(task))
+                {
+                    /* we failed it before, don't try again */
+                    DEBUG("skipping failed thumbnail: %s", fm_file_info_get_name(task->fi));
+                    g_mutex_lock(lock_ptr);
+                    remember_failed_thumbnail(task);
+                    g_mutex_unlock(lock_ptr);
+                    g_cancellable_cancel(task->cancellable);
+                }
+                else
+                    generate_thumbnails(task);
+            }
             else
                 load_thumbnails(task); /* first cycle */
 
@@ -494,6 +806,7 @@ static gpointer load_thumbnail_thread(gpointer user_data)
             task->uri = NULL;
             task->normal_path = NULL;
             task->large_path = NULL;
+            task->fail_path = NULL;
             g_free(uri);
 
             g_mutex_lock(lock_ptr);
@@ -502,17 +815,27 @@ static gpointer load_thumbnail_thread(gpointer user_data)
                || (task->flags & (GENERATE_NORMAL|GENERATE_LARGE)) == 0)
 _free_task:
                 thumbnail_task_free(task);
-            else
-                g_queue_push_tail(&loader_queue, task); /* return it to regen */
+            else /* pass it to regen */
+                thumbnail_lane_push(&generator_lane, task);
 
             g_mutex_unlock(lock_ptr);
+            flushed = FALSE;
         }
-        else /* no task is left in the loader_queue */
+        else if(lane == &loader_lane && !flushed)
         {
-            loader_thread_running = FALSE;
+            /* write collected thumbnail packs if it is time to */
             g_mutex_unlock(lock_ptr);
+            _fm_thumbnail_pack_flush();
+            flushed = TRUE;
+        }
+        else /* no task is left in the queue */
+        {
+            lane->n_threads--;
+            g_mutex_unlock(lock_ptr);
+            g_cond_broadcast(cond_ptr); /* finalizer may wait for it */
             g_free(normal_path);
             g_free(large_path);
+            g_free(fail_path);
             g_checksum_free(sum);
 #if GLIB_CHECK_VERSION(2, 32, 0)
             g_thread_unref(g_thread_self());
@@ -524,37 +847,24 @@ _free_task:
 
 /* should be called with queue locked */
 /* in main loop */
-inline static GObject* find_thumbnail_in_hash(FmPath* path, guint size)
+inline static GObject* find_thumbnail_in_hash(FmFileInfo* fi, guint size)
 {
-    ThumbnailCache* cache = (ThumbnailCache*)g_hash_table_lookup(hash, path);
-    if(cache)
+    ThumbnailCacheItem key, *item;
+
+    key.path = fm_file_info_get_path(fi);
+    key.size = size;
+    item = g_hash_table_lookup(hash, &key);
+    if(item == NULL)
+        return NULL;
+    if(item->mtime != fm_file_info_get_mtime(fi)) /* file was changed */
     {
-        GSList* l;
-        for(l=cache->items;l;l=l->next)
-        {
-            ThumbnailCacheItem* item = (ThumbnailCacheItem*)l->data;
-            if(item->size == size)
-                return item->pix;
-        }
+        cache_item_remove(item);
+        return NULL;
     }
-    return NULL;
-}
-
-/* should be called with queue locked */
-/* may be called in thread */
-static ThumbnailTask* find_queued_task(GQueue* queue, FmFileInfo* fi)
-{
-    GList* l;
-    for( l = queue->head; l; l=l->next )
-    {
-        ThumbnailTask* task = (ThumbnailTask*)l->data;
-        /* if it's processing then it's too late to add */
-        if(task->cancellable)
-            continue;
-        if(G_UNLIKELY(task->fi == fi || fm_path_equal(fm_file_info_get_path(task->fi), fm_file_info_get_path(fi))))
-            return task;
-    }
-    return NULL;
+    /* move it to head of LRU list */
+    g_queue_unlink(&cache_lru, &item->lru);
+    g_queue_push_head_link(&cache_lru, &item->lru);
+    return item->pix;
 }
 
 /**
@@ -582,8 +892,8 @@ FmThumbnailLoader* fm_thumbnail_loader_load(FmFileInfo* src_file,
     FmThumbnailLoader* req;
     ThumbnailTask* task;
     GObject* pix;
+    gpointer failed_mtime;
     FmPath* src_path = fm_file_info_get_path(src_file);
-    gboolean thread_running;
 
     g_return_val_if_fail(hash != NULL, NULL);
     g_assert(callback != NULL);
@@ -602,10 +912,11 @@ FmThumbnailLoader* fm_thumbnail_loader_load(FmFileInfo* src_file,
     g_mutex_lock(lock_ptr);
 
     /* find in the cache first to see if thumbnail is already cached */
-    pix = find_thumbnail_in_hash(src_path, size);
+    pix = find_thumbnail_in_hash(src_file, size);
     if(pix)
     {
         DEBUG("cache found!");
+        loader_stats.memory_hits++;
         req->pix = (GObject*)g_object_ref(pix);
         /* call the ready callback in main loader_thread_id from idle handler. */
         g_queue_push_tail(&ready_queue, req);
@@ -615,14 +926,29 @@ FmThumbnailLoader* fm_thumbnail_loader_load(FmFileInfo* src_file,
         return req;
     }
 
-    /* if it's not cached, add it to the loader_queue for loading. */
-    task = find_queued_task(&loader_queue, src_file);
+    /* if we failed it already then don't try again */
+    if(g_hash_table_lookup_extended(failed_hash, src_path, NULL, &failed_mtime) &&
+       GPOINTER_TO_SIZE(failed_mtime) == (gsize)fm_file_info_get_mtime(src_file))
+    {
+        DEBUG("thumbnail failed before");
+        loader_stats.memory_hits++;
+        g_queue_push_tail(&ready_queue, req);
+        if( 0 == ready_idle_handler ) /* schedule an idle handler if there isn't one. */
+            ready_idle_handler = g_idle_add_full(G_PRIORITY_LOW, on_ready_idle, NULL, NULL);
+        g_mutex_unlock(lock_ptr);
+        return req;
+    }
+
+    /* if it's not cached, add it to the loader queue for loading. */
+    /* if it's processing then it's too late to add so only queued are there */
+    task = g_hash_table_lookup(queued_hash, fm_file_info_get_path(src_file));
 
     if(!task)
     {
         task = g_slice_new0(ThumbnailTask);
         task->fi = fm_file_info_ref(src_file);
-        g_queue_push_tail(&loader_queue, task);
+        thumbnail_lane_push(&loader_lane, task);
+        g_hash_table_insert(queued_hash, fm_file_info_get_path(task->fi), task);
     }
     else
     {
@@ -635,25 +961,22 @@ FmThumbnailLoader* fm_thumbnail_loader_load(FmFileInfo* src_file,
     else
         task->flags |= LOAD_NORMAL;
 
-    task->requests = g_list_append(task->requests, req);
+    task->requests = g_list_prepend(task->requests, req);
+    task->n_active++;
 
-    thread_running = loader_thread_running;
-    loader_thread_running = TRUE;
     g_mutex_unlock(lock_ptr);
 
-    if(!thread_running)
-#if GLIB_CHECK_VERSION(2, 32, 0)
-        g_thread_new("loader", load_thumbnail_thread, NULL);
-        /* we don't use loader_thread_id but Glib 2.32 crashes if we unref
-           GThread while it's in creation progress. It is a bug of GLib
-           certainly but as workaround we'll unref it in the thread itself */
-#else
-        g_thread_create( load_thumbnail_thread, NULL, FALSE, NULL);
-#endif
-
     return req;
 }
 
+/* should be called with queue lock held */
+static inline ThumbnailLane* thumbnail_task_get_lane(ThumbnailTask* task)
+{
+    if(task->flags & (GENERATE_NORMAL|GENERATE_LARGE))
+        return &generator_lane;
+    return &loader_lane;
+}
+
 /**
  * fm_thumbnail_loader_cancel
  * @req: the request descriptor
@@ -667,31 +990,99 @@ FmThumbnailLoader* fm_thumbnail_loader_load(FmFileInfo* src_file,
 /* in main loop */
 void fm_thumbnail_loader_cancel(FmThumbnailLoader* req)
 {
-    GList* l;
+    ThumbnailTask* task;
 
     g_return_if_fail(req != NULL);
 
     g_mutex_lock(lock_ptr);
+    task = req->task;
+    if(task == NULL || req->cancelled)
+    {
+        req->cancelled = TRUE;
+        goto done;
+    }
     req->cancelled = TRUE;
 
-    if(req->task == NULL)
+    if(--task->n_active > 0) /* someone still waits for it */
         goto done;
-
-    for(l = req->task->requests; l; l = l->next)
+    if(task->link != NULL) /* not started yet, drop it from the queue */
     {
-        req = (FmThumbnailLoader*)l->data;
-        if(!req->cancelled)
-            break;
+        ThumbnailLane* lane = thumbnail_task_get_lane(task);
+        g_queue_delete_link(&lane->queue, task->link);
+        task->link = NULL;
+        if(lane == &loader_lane)
+            g_hash_table_remove(queued_hash, fm_file_info_get_path(task->fi));
+        thumbnail_task_free(task);
+        DEBUG("dropping the task");
     }
-    if(l == NULL && req->task->cancellable != NULL)
+    else if(task->cancellable != NULL)
     {
-        g_cancellable_cancel(req->task->cancellable);
+        g_cancellable_cancel(task->cancellable);
         DEBUG("cancelling the task");
     }
 
 done:
     g_mutex_unlock(lock_ptr);
     g_cond_broadcast(cond_ptr); /* if it is loading right now then let it die */
+    g_mutex_lock(tlock_ptr);
+    g_cond_broadcast(tcond_ptr); /* the same for thumbnailer waits */
+    g_mutex_unlock(tlock_ptr);
+}
+
+/* should be called with queue lock held */
+/* in main loop */
+static void thumbnail_task_move(ThumbnailTask* task, gboolean to_head)
+{
+    ThumbnailLane* lane;
+
+    if(task == NULL || task->link == NULL) /* it is being processed now */
+        return;
+    lane = thumbnail_task_get_lane(task);
+    g_queue_unlink(&lane->queue, task->link);
+    if(to_head)
+        g_queue_push_head_link(&lane->queue, task->link);
+    else
+        g_queue_push_tail_link(&lane->queue, task->link);
+}
+
+/**
+ * fm_thumbnail_loader_raise
+ * @req: the request descriptor
+ *
+ * Moves @req to the head of the queue so it will be handled before any
+ * other queued requests. Should be used for files which user sees right
+ * now, e.g. in visible part of the folder view.
+ *
+ * Since: 1.4.1
+ */
+/* in main loop */
+void fm_thumbnail_loader_raise(FmThumbnailLoader* req)
+{
+    g_return_if_fail(req != NULL);
+
+    g_mutex_lock(lock_ptr);
+    thumbnail_task_move(req->task, TRUE);
+    g_mutex_unlock(lock_ptr);
+}
+
+/**
+ * fm_thumbnail_loader_lower
+ * @req: the request descriptor
+ *
+ * Moves @req to the tail of the queue so it will be handled after all
+ * other queued requests. Should be used for files which are not visible
+ * to user anymore.
+ *
+ * Since: 1.4.1
+ */
+/* in main loop */
+void fm_thumbnail_loader_lower(FmThumbnailLoader* req)
+{
+    g_return_if_fail(req != NULL);
+
+    g_mutex_lock(lock_ptr);
+    thumbnail_task_move(req->task, FALSE);
+    g_mutex_unlock(lock_ptr);
 }
 
 /**
@@ -744,14 +1135,57 @@ guint fm_thumbnail_loader_get_size(FmThumbnailLoader* req)
     return req->size;
 }
 
+/**
+ * fm_thumbnail_loader_get_stats
+ * @stats: (out caller-allocates): location to store counters
+ *
+ * Retrieves counters of thumbnail loader activity since start or since
+ * last call to fm_thumbnail_loader_reset_stats(). Sizes of queues are
+ * retrieved for the moment of the call.
+ *
+ * Since: 1.4.1
+ */
+void fm_thumbnail_loader_get_stats(FmThumbnailLoaderStats* stats)
+{
+    g_return_if_fail(stats != NULL);
+
+    g_mutex_lock(lock_ptr);
+    *stats = loader_stats;
+    stats->loader_queue = g_queue_get_length(&loader_lane.queue);
+    stats->generator_queue = g_queue_get_length(&generator_lane.queue);
+    g_mutex_unlock(lock_ptr);
+}
+
+/**
+ * fm_thumbnail_loader_reset_stats
+ *
+ * Resets counters of thumbnail loader activity to zero.
+ *
+ * Since: 1.4.1
+ */
+void fm_thumbnail_loader_reset_stats(void)
+{
+    g_mutex_lock(lock_ptr);
+    memset(&loader_stats, 0, sizeof(loader_stats));
+    g_mutex_unlock(lock_ptr);
+}
+
 /* in main loop */
 void _fm_thumbnail_loader_init()
 {
     thumb_dir = g_build_filename(g_get_user_cache_dir(), "thumbnails", NULL);
-    hash = g_hash_table_new((GHashFunc)fm_path_hash, (GEqualFunc)fm_path_equal);
+    hash = g_hash_table_new_full(cache_item_hash, cache_item_equal, NULL, cache_item_free);
+    failed_hash = g_hash_table_new_full((GHashFunc)fm_path_hash, (GEqualFunc)fm_path_equal,
+                                        (GDestroyNotify)fm_path_unref, NULL);
+    /* keys are owned by tasks */
+    queued_hash = g_hash_table_new((GHashFunc)fm_path_hash, (GEqualFunc)fm_path_equal);
+    thumbnailers_per_type = g_hash_table_new(g_direct_hash, g_direct_equal);
+    _fm_thumbnail_pack_init(thumb_dir);
 #if !GLIB_CHECK_VERSION(2, 32, 0)
     lock_ptr = g_mutex_new();
     cond_ptr = g_cond_new();
+    tlock_ptr = g_mutex_new();
+    tcond_ptr = g_cond_new();
 #endif
 }
 
@@ -759,45 +1193,71 @@ static gboolean fm_thumbnail_loader_cleanup(gpointer unused)
 {
     FmThumbnailLoader* req;
 
-    /* loader_queue is empty and cur_loading is finished */
+    /* lanes are empty and all threads are finished */
     while((req = g_queue_pop_head(&ready_queue)))
         fm_thumbnail_loader_free(req);
-    g_hash_table_destroy(hash); /* caches will be destroyed by pixbufs */
+    g_hash_table_destroy(hash);
     hash = NULL;
+    g_queue_init(&cache_lru); /* links were freed with items */
+    g_hash_table_destroy(failed_hash);
+    failed_hash = NULL;
+    g_hash_table_destroy(queued_hash);
+    queued_hash = NULL;
     g_free(thumb_dir);
     thumb_dir = NULL;
     return FALSE;
 }
 
 /* in main loop */
-void _fm_thumbnail_loader_finalize(void)
+/* should be called with queue lock held */
+static void thumbnail_lane_cancel(ThumbnailLane* lane)
 {
     ThumbnailTask* task;
     GList *qlist, *rlist;
 
-    g_mutex_lock(lock_ptr);
-    /* cancel all pending requests before destroying hash */
-    for (qlist = g_queue_peek_head_link(&loader_queue); qlist; qlist = qlist->next)
+    for (qlist = g_queue_peek_head_link(&lane->queue); qlist; qlist = qlist->next)
     {
         task = qlist->data;
+        task->n_active = 0;
         if (task->cancellable)
             g_cancellable_cancel(task->cancellable);
         for (rlist = task->requests; rlist; rlist = rlist->next)
             //g_assert(!((FmThumbnailLoader*)rlist->data)->cancelled);
             ((FmThumbnailLoader*)rlist->data)->cancelled = TRUE;
     }
+}
+
+/* in main loop */
+void _fm_thumbnail_loader_finalize(void)
+{
+    ThumbnailTask* task;
+
+    g_mutex_lock(lock_ptr);
+    /* cancel all pending requests before destroying hash */
+    thumbnail_lane_cancel(&loader_lane);
+    thumbnail_lane_cancel(&generator_lane);
     g_mutex_unlock(lock_ptr);
-    /* if thread was alive it will die after that */
+    /* if threads were alive they will die after that */
     g_cond_broadcast(cond_ptr);
+    g_mutex_lock(tlock_ptr);
+    g_cond_broadcast(tcond_ptr);
+    g_mutex_unlock(tlock_ptr);
     g_mutex_lock(lock_ptr);
-    while (loader_thread_running)
+    while (loader_lane.n_threads > 0 || generator_lane.n_threads > 0)
         g_cond_wait(cond_ptr, lock_ptr);
     g_mutex_unlock(lock_ptr);
 #if !GLIB_CHECK_VERSION(2, 32, 0)
     g_mutex_free(lock_ptr);
     g_cond_free(cond_ptr);
+    g_mutex_free(tlock_ptr);
+    g_cond_free(tcond_ptr);
 #endif
-    while((task = g_queue_pop_head(&loader_queue)))
+    g_hash_table_destroy(thumbnailers_per_type);
+    thumbnailers_per_type = NULL;
+    _fm_thumbnail_pack_finalize();
+    while((task = g_queue_pop_head(&loader_lane.queue)))
+        thumbnail_task_free(task);
+    while((task = g_queue_pop_head(&generator_lane.queue)))
         thumbnail_task_free(task);
     fm_thumbnail_loader_cleanup(NULL);
 }
@@ -805,15 +1265,33 @@ void _fm_thumbnail_loader_finalize(void)
 /* in thread */
 static void generate_thumbnails(ThumbnailTask* task)
 {
+    gboolean ok, skipped = FALSE;
+    gint64 start = stats_now();
+
     if (fm_file_info_is_image(task->fi) &&
         /* if the image file is too large, don't generate thumbnail for it. */
         (fm_config->thumbnail_max == 0 ||
          fm_file_info_get_size(task->fi) <= (fm_config->thumbnail_max << 10)))
     {
-        generate_thumbnails_with_builtin(task);
+        ok = generate_thumbnails_with_builtin(task, &skipped);
     }
     else
-        generate_thumbnails_with_thumbnailers(task);
+        ok = generate_thumbnails_with_thumbnailers(task, &skipped);
+
+    g_mutex_lock(lock_ptr);
+    loader_stats.generated++;
+    loader_stats.generation_time += stats_now() - start;
+    g_mutex_unlock(lock_ptr);
+
+    /* save failure mark so we don't try it each time, but only if the file
+       is at fault, not the configuration which may be changed later */
+    if (!ok && !skipped && !g_cancellable_is_cancelled(task->cancellable))
+    {
+        save_failed_thumbnail(task);
+        g_mutex_lock(lock_ptr);
+        remember_failed_thumbnail(task);
+        g_mutex_unlock(lock_ptr);
+    }
 
     /* mark it as fully done, see thread loop */
     g_cancellable_cancel(task->cancellable);
@@ -871,9 +1349,17 @@ static void save_thumbnail_to_disk(ThumbnailTask* task, GObject* pix, const char
 {
     /* do not save thumbnails generated in thumbail cache directory
      * (prevents runaway thumbnailing when browsing thumbail cache directory) */
-    if(strncmp(path,thumb_dir,strlen(thumb_dir)) == 0)
+    FmPath* src_path = fm_file_info_get_path(task->fi);
+    if(fm_path_is_native(src_path))
     {
-        return;
+        char* src_file = fm_path_to_str(src_path);
+        gsize len = strlen(thumb_dir);
+        /* it should not match "thumbnails-old" and such */
+        gboolean in_cache = (strncmp(src_file, thumb_dir, len) == 0 &&
+                             (src_file[len] == G_DIR_SEPARATOR || src_file[len] == '\0'));
+        g_free(src_file);
+        if(in_cache)
+            return;
     }
     /* save the generated thumbnail to disk */
     char* tmpfile = g_strconcat(path, ".XXXXXX", NULL);
@@ -894,8 +1380,99 @@ static void save_thumbnail_to_disk(ThumbnailTask* task, GObject* pix, const char
     DEBUG("generator: save to %s", path);
 }
 
+#ifdef USE_EXIF
+/* reference for EXIF orientation tag:
+ * http://www.impulseadventure.com/photo/exif-orientation.html */
+static int exif_orientation_to_degrees(int orient)
+{
+    switch(orient) {
+    case 8:
+        return 90;
+    case 3:
+        return 180;
+    case 6:
+        return 270;
+    }
+    return 0; /* no rotation */
+}
+
 /* in thread */
-static gboolean generate_thumbnails_with_builtin(ThumbnailTask* task)
+static GObject* read_exif_thumbnail_from_file(const char* file_name,
+                                              GCancellable* cancellable,
+                                              int* rotate_degrees)
+{
+    GObject* pix = NULL;
+    guchar* data;
+    gsize len;
+    int orient;
+    int fd = open(file_name, O_RDONLY);
+
+    if(fd < 0)
+        return NULL;
+    if(_fm_jpeg_exif_read_thumbnail(fd, &data, &len, &orient))
+    {
+        *rotate_degrees = exif_orientation_to_degrees(orient);
+        if(data) /* if an embedded thumbnail is available */
+        {
+            /* load the embedded jpeg thumbnail */
+            GInputStream* mem_stream = g_memory_input_stream_new_from_data(data, len, g_free);
+            pix = backend.read_image_from_stream(mem_stream, len, cancellable);
+            g_object_unref(mem_stream);
+        }
+    }
+    close(fd);
+    return pix;
+}
+
+/* in thread */
+static GObject* read_exif_thumbnail_from_stream(GFile* gf, GCancellable* cancellable,
+                                                int* rotate_degrees)
+{
+    /* use libexif to extract thumbnails embedded in jpeg files */
+    GObject* pix = NULL;
+    ExifLoader *exif_loader;
+    ExifData *exif_data;
+    GFileInputStream* ins = g_file_read(gf, cancellable, NULL);
+
+    if(!ins)
+        return NULL;
+    exif_loader = exif_loader_new();
+    while(!g_cancellable_is_cancelled(cancellable)) {
+        unsigned char buf[4096];
+        gssize read_size = g_input_stream_read((GInputStream*)ins, buf, 4096, cancellable, NULL);
+        if(read_size <= 0) /* EOF or error */
+            break;
+        if(exif_loader_write(exif_loader, buf, read_size) == 0)
+            break; /* no more EXIF data */
+    }
+    exif_data = exif_loader_get_data(exif_loader);
+    exif_loader_unref(exif_loader);
+    if(exif_data)
+    {
+        ExifEntry* orient_ent = exif_data_get_entry(exif_data, EXIF_TAG_ORIENTATION);
+        if(orient_ent) /* orientation flag found in EXIF */
+        {
+            ExifByteOrder bo = exif_data_get_byte_order(exif_data);
+            *rotate_degrees = exif_orientation_to_degrees(exif_get_short(orient_ent->data, bo));
+        }
+        if(exif_data->data) /* if an embedded thumbnail is available */
+        {
+            /* load the embedded jpeg thumbnail */
+            GInputStream* mem_stream = g_memory_input_stream_new_from_data(exif_data->data, exif_data->size, NULL);
+            pix = backend.read_image_from_stream(mem_stream, exif_data->size, cancellable);
+            g_object_unref(mem_stream);
+        }
+        exif_data_unref(exif_data);
+    }
+    g_input_stream_close(G_INPUT_STREAM(ins), NULL, NULL);
+    g_object_unref(ins);
+    return pix;
+}
+#endif
+
+/* in thread */
+/* sets *skipped if image was not decoded due to configured size limit */
+static gboolean generate_thumbnails_with_builtin(ThumbnailTask* task, gboolean* skipped)
 {
     /* FIXME: only formats supported by GObject should be handled this way. */
     GFile* gf = fm_path_to_gfile(fm_file_info_get_path(task->fi));
@@ -908,75 +1485,32 @@ static gboolean generate_thumbnails_with_builtin(ThumbnailTask* task)
 
     GObject* ori_pix = NULL;
     int rotate_degrees = 0;
+    int width = 0, height = 0; /* sizes of original image */
 #ifdef USE_EXIF
     FmMimeType* mime_type;
 
-    /* use libexif to extract thumbnails embedded in jpeg files */
+    /* extract thumbnails embedded in jpeg files */
     mime_type = fm_file_info_get_mime_type(task->fi);
     if(strcmp(fm_mime_type_get_type(mime_type), "image/jpeg") == 0) /* if this is a jpeg file */
     {
-        /* try to extract thumbnails embedded in jpeg files */
-        ExifLoader *exif_loader = exif_loader_new();
-        ExifData *exif_data;
-        GFileInputStream* ins = g_file_read(gf, cancellable, NULL);
-        if(ins)
-        {
-            while(!g_cancellable_is_cancelled(cancellable)) {
-                unsigned char buf[4096];
-                gssize read_size = g_input_stream_read((GInputStream*)ins, buf, 4096, cancellable, NULL);
-                if(read_size == 0) /* EOF */
-                    break;
-                if(exif_loader_write(exif_loader, buf, read_size) == 0)
-                    break; /* no more EXIF data */
-            }
-            exif_data = exif_loader_get_data(exif_loader);
-            exif_loader_unref(exif_loader);
-            if(exif_data)
-            {
-                /* reference for EXIF orientation tag:
-                 * http://www.impulseadventure.com/photo/exif-orientation.html */
-                ExifEntry* orient_ent = exif_data_get_entry(exif_data, EXIF_TAG_ORIENTATION);
-                if(orient_ent) /* orientation flag found in EXIF */
-                {
-                    gushort orient;
-                    ExifByteOrder bo = exif_data_get_byte_order(exif_data);
-                    /* bo == EXIF_BYTE_ORDER_INTEL ; */
-                    orient = exif_get_short (orient_ent->data, bo);
-                    switch(orient) {
-                    case 1: /* no rotation */
-                        rotate_degrees = 0;
-                        break;
-                    case 8:
-                        rotate_degrees = 90;
-                        break;
-                    case 3:
-                        rotate_degrees = 180;
-                        break;
-                    case 6:
-                        rotate_degrees = 270;
-                        break;
-                    }
-                    /* g_print("orientation flag found, rotate: %d\n", rotate_degrees); */
-                }
-                if(exif_data->data) /* if an embedded thumbnail is available */
-                {
-                    /* load the embedded jpeg thumbnail */
-                    GInputStream* mem_stream = g_memory_input_stream_new_from_data(exif_data->data, exif_data->size, NULL);
-                    ori_pix = backend.read_image_from_stream(mem_stream, exif_data->size, cancellable);
-                    g_object_unref(mem_stream);
-                }
-                exif_data_unref(exif_data);
-            }
-            g_input_stream_close(G_INPUT_STREAM(ins), NULL, NULL);
-            g_object_unref(ins);
-        }
+        file_name = g_file_get_path(gf);
+        if(file_name) /* read only EXIF parts of local file */
+            ori_pix = read_exif_thumbnail_from_file(file_name, cancellable, &rotate_degrees);
+        else
+            ori_pix = read_exif_thumbnail_from_stream(gf, cancellable, &rotate_degrees);
+        g_free(file_name);
     }
 
     if(!ori_pix)
     {
 #endif
         file_name = g_file_get_path(gf);
-        if (file_name)
+        if (file_name && read_image_from_file_at_size)
+            /* decode it once at the biggest size we need */
+            ori_pix = read_image_from_file_at_size(file_name,
+                                (task->flags & GENERATE_LARGE) ? 512 : 128,
+                                &width, &height);
+        else if (file_name)
             ori_pix = backend.read_image_from_file(file_name);
         g_free(file_name);
 #ifdef USE_EXIF
@@ -985,10 +1519,14 @@ static gboolean generate_thumbnails_with_builtin(ThumbnailTask* task)
 
     if(ori_pix) /* if the original image is successfully loaded */
     {
-        int width = backend.get_image_width(ori_pix);
-        int height = backend.get_image_height(ori_pix);
         gboolean need_save;
 
+        if(width == 0 || height == 0) /* it was loaded in original size */
+        {
+            width = backend.get_image_width(ori_pix);
+            height = backend.get_image_height(ori_pix);
+        }
+
         if(task->flags & GENERATE_NORMAL)
         {
             /* don't create thumbnails for images which are too small */
@@ -1040,6 +1578,14 @@ static gboolean generate_thumbnails_with_builtin(ThumbnailTask* task)
     }
     else
     {
+        /* backend refuses images over thumbnail_max pixels, it can be told
+           only if it reported size of image, and there was nothing to read
+           if the file is not local */
+        if (!fm_path_is_native(fm_file_info_get_path(task->fi)) ||
+            (fm_config->thumbnail_max > 0 &&
+             (!read_image_from_file_at_size ||
+              (guint64)width * height > ((guint64)fm_config->thumbnail_max << 10))))
+            *skipped = TRUE;
         g_object_unref(gf);
         /* g_debug("failed to generate thumbnail internally, revert to external"); */
         return FALSE;
@@ -1056,39 +1602,50 @@ static gboolean generate_thumbnails_with_builtin(ThumbnailTask* task)
     return TRUE;
 }
 
+typedef struct
+{
+    gboolean finished;
+    gboolean timed_out;
+    int status;
+} ThumbnailerStatus;
+
 /* call from main thread */
 static gboolean on_thumbnailer_timeout(gpointer user_data)
 {
-    gboolean *timed_out;
+    ThumbnailerStatus *st = user_data;
 
-    /* check if it is destroyed already */
-    if(g_source_is_destroyed(g_main_current_source()))
-        return FALSE;
-    timed_out = user_data;
-    /* g_print("thumbnail timeout!\n"); */
-    g_mutex_lock(lock_ptr);
-    *timed_out = TRUE;
-    thumbnailer_timeout_id = 0;
-    g_mutex_unlock(lock_ptr);
-    g_cond_broadcast(cond_ptr);
+    g_mutex_lock(tlock_ptr);
+    /* check if it is destroyed already, the thread removes the source
+       under the same lock so st is still valid if it isn't destroyed */
+    if(!g_source_is_destroyed(g_main_current_source()))
+    {
+        /* g_print("thumbnail timeout!\n"); */
+        st->timed_out = TRUE;
+        g_cond_broadcast(tcond_ptr);
+    }
+    g_mutex_unlock(tlock_ptr);
     return FALSE;
 }
 
-typedef struct
-{
-    gboolean finished;
-    int status;
-} ThumbnailerStatus;
-
 /* this is in main loop due to g_child_watch_add() */
 static void _pid_watcher(GPid pid, gint status, gpointer user_data)
 {
     ThumbnailerStatus *st = user_data;
 
     DEBUG("pid %d terminated", (int)pid);
+    g_mutex_lock(tlock_ptr);
     st->status = status;
     st->finished = TRUE;
-    g_cond_broadcast(cond_ptr);
+    g_cond_broadcast(tcond_ptr);
+    /* st may be invalid after unlock */
+    g_mutex_unlock(tlock_ptr);
+}
+
+/* may be called in thread */
+static inline guint thumbnailers_max(void)
+{
+    /* thumbnailers may be multithreaded, don't let them take all CPUs */
+    return MAX(1, thumbnail_lane_max_threads(&generator_lane) / 2);
 }
 
 /* call from the thumbnail thread */
@@ -1096,49 +1653,87 @@ static gboolean run_thumbnailer(FmThumbnailer* thumbnailer, ThumbnailTask* task,
                                 const char* output_file, guint size)
 {
     /* g_print("run_thumbnailer: uri: %s\n", uri); */
-    ThumbnailerStatus status = { FALSE, 0 };
-    gboolean timed_out = FALSE;
-    GPid _pid = fm_thumbnailer_launch_for_uri_async(thumbnailer, task->uri,
-                                                    output_file, size, NULL);
-    if(_pid <= 0) /* failed to launch */
-        /* FIXME: print error message from failed thumbnailer */
-        return FALSE;
-    g_mutex_lock(lock_ptr);
-    if(thumbnailer_timeout_id)
+    ThumbnailerStatus status = { FALSE, FALSE, 0 };
+    FmMimeType* mime_type = fm_file_info_get_mime_type(task->fi);
+    const char* type = g_intern_string(fm_mime_type_get_type(mime_type));
+    guint max = thumbnailers_max();
+    /* one MIME type may not take more than half of slots so if a folder
+       has both videos and documents then both get processed */
+    guint max_per_type = MAX(1, max / 2);
+    guint timeout_id;
+    GPid _pid;
+    gint64 start;
+
+    g_mutex_lock(tlock_ptr);
+    while (!g_cancellable_is_cancelled(task->cancellable) &&
+           (n_thumbnailers >= max ||
+            GPOINTER_TO_UINT(g_hash_table_lookup(thumbnailers_per_type, type)) >= max_per_type))
+        g_cond_wait(tcond_ptr, tlock_ptr);
+    if (g_cancellable_is_cancelled(task->cancellable))
     {
-        g_mutex_unlock(lock_ptr);
-        g_critical("libfm: run_thumbnailer() concurrent process attempt");
-        kill(_pid, SIGTERM);
+        g_mutex_unlock(tlock_ptr);
         return FALSE;
     }
-    thumbnailer_timeout_id = g_timeout_add_seconds(THUMBNAILER_TIMEOUT_SEC,
-                                                   on_thumbnailer_timeout, &timed_out);
+    n_thumbnailers++;
+    g_hash_table_insert(thumbnailers_per_type, (gpointer)type,
+                        GUINT_TO_POINTER(GPOINTER_TO_UINT(g_hash_table_lookup(thumbnailers_per_type, type)) + 1));
+    g_mutex_unlock(tlock_ptr);
+
+    start = stats_now();
+    _pid = fm_thumbnailer_launch_for_uri_async(thumbnailer, task->uri,
+                                               output_file, size, NULL);
+    g_mutex_lock(tlock_ptr);
+    if(_pid <= 0) /* failed to launch */
+    {
+        /* FIXME: print error message from failed thumbnailer */
+        goto _release;
+    }
+    timeout_id = g_timeout_add_seconds(THUMBNAILER_TIMEOUT_SEC,
+                                       on_thumbnailer_timeout, &status);
     g_child_watch_add(_pid, _pid_watcher, &status);
     /* g_print("pid: %d\n", thumbnailer_pid); */
-    while (!timed_out && !status.finished &&
+    while (!status.timed_out && !status.finished &&
            !g_cancellable_is_cancelled(task->cancellable))
-        g_cond_wait(cond_ptr, lock_ptr);
-    if (thumbnailer_timeout_id)
-        g_source_remove(thumbnailer_timeout_id);
-    thumbnailer_timeout_id = 0;
+        g_cond_wait(tcond_ptr, tlock_ptr);
+    /* it's safe to remove it even if it is dispatched right now, see
+       on_thumbnailer_timeout(), but if it timed out it's removed already */
+    if (!status.timed_out)
+        g_source_remove(timeout_id);
     if (!status.finished)
         kill(_pid, SIGTERM);
     /* wait for the thumbnailer process to terminate */
     while (!status.finished)
-        g_cond_wait(cond_ptr, lock_ptr);
-    g_mutex_unlock(lock_ptr);
+        g_cond_wait(tcond_ptr, tlock_ptr);
+
+_release:
+    n_thumbnailers--;
+    g_hash_table_insert(thumbnailers_per_type, (gpointer)type,
+                        GUINT_TO_POINTER(GPOINTER_TO_UINT(g_hash_table_lookup(thumbnailers_per_type, type)) - 1));
+    g_cond_broadcast(tcond_ptr); /* let next thumbnailer run */
+    g_mutex_unlock(tlock_ptr);
+
+    if(_pid > 0)
+    {
+        g_mutex_lock(lock_ptr);
+        loader_stats.thumbnailer_runs++;
+        loader_stats.thumbnailer_time += stats_now() - start;
+        g_mutex_unlock(lock_ptr);
+    }
 
     /* the process is terminated */
-    return (WIFEXITED(status.status) && WEXITSTATUS(status.status) == 0);
+    return (_pid > 0 && WIFEXITED(status.status) && WEXITSTATUS(status.status) == 0);
 }
 
 /* in thread */
-static void generate_thumbnails_with_thumbnailers(ThumbnailTask* task)
+/* sets *skipped if there is no thumbnailer to try */
+static gboolean generate_thumbnails_with_thumbnailers(ThumbnailTask* task, gboolean* skipped)
 {
     /* external thumbnailer support */
     GObject* normal_pix = NULL;
     GObject* large_pix = NULL;
     FmMimeType* mime_type = fm_file_info_get_mime_type(task->fi);
+    guint generated = 0;
+    gboolean tried = FALSE;
     /* TODO: we need to add timeout for external thumbnailers.
      * If a thumbnailer program is broken or locked for unknown reason,
      * the thumbnailer process should be killed once a timeout is reached. */
@@ -1146,11 +1741,11 @@ static void generate_thumbnails_with_thumbnailers(ThumbnailTask* task)
     {
         GList* thumbnailers = fm_mime_type_get_thumbnailers_list(mime_type);
         GList* l;
-        guint generated = 0;
         /* g_debug("run thumbnailer: %s, %s, %s", fm_file_info_get_name(task->fi), task->normal_path, task->large_path); */
         for(l = thumbnailers; l; l = l->next)
         {
             FmThumbnailer* thumbnailer = FM_THUMBNAILER(l->data);
+            tried = TRUE;
             if((task->flags & GENERATE_NORMAL) && !(generated & GENERATE_NORMAL))
             {
                 if(run_thumbnailer(thumbnailer, task, task->normal_path, 128))
@@ -1200,6 +1795,10 @@ static void generate_thumbnails_with_thumbnailers(ThumbnailTask* task)
         g_object_unref(normal_pix);
     if(large_pix)
         g_object_unref(large_pix);
+    /* e.g. an image too big for builtin generator and no thumbnailer for it */
+    if(!tried)
+        *skipped = TRUE;
+    return (generated != 0);
 }
 
 /**
@@ -1223,3 +1822,20 @@ gboolean fm_thumbnail_loader_set_backend(FmThumbnailLoaderBackend* _backend)
     backend_loaded = TRUE;
     return TRUE;
 }
+
+/**
+ * fm_thumbnail_loader_set_read_at_size_func
+ * @func: (allow-none): callback to read image at size
+ *
+ * Sets optional callback which reads image scaled down while decoding it,
+ * it is used instead of reading full image and scaling it when thumbnail
+ * is generated. It is kept apart from #FmThumbnailLoaderBackend so that
+ * layout of that structure stays compatible. This function should be
+ * called right after fm_thumbnail_loader_set_backend().
+ *
+ * Since: 1.4.1
+ */
+void fm_thumbnail_loader_set_read_at_size_func(FmThumbnailLoaderReadAtSizeFunc func)
+{
+    read_image_from_file_at_size = func;
+}
@@ -61,12 +61,51 @@ FmThumbnailLoader* fm_thumbnail_loader_load(FmFileInfo* src_file,
 
 void fm_thumbnail_loader_cancel(FmThumbnailLoader* req);
 
+void fm_thumbnail_loader_raise(FmThumbnailLoader* req);
+
+void fm_thumbnail_loader_lower(FmThumbnailLoader* req);
+
 GObject* fm_thumbnail_loader_get_data(FmThumbnailLoader* req);
 
 FmFileInfo* fm_thumbnail_loader_get_file_info(FmThumbnailLoader* req);
 
 guint fm_thumbnail_loader_get_size(FmThumbnailLoader* req);
 
+typedef struct _FmThumbnailLoaderStats FmThumbnailLoaderStats;
+
+/**
+ * FmThumbnailLoaderStats:
+ * @loader_queue: number of files waiting to be loaded from disk cache
+ * @generator_queue: number of files waiting for thumbnail generation
+ * @memory_hits: number of requests answered from memory, including known failures
+ * @disk_hits: number of thumbnails loaded from disk cache
+ * @misses: number of thumbnails which were not found in disk cache
+ * @generated: number of files thumbnail generation was tried for
+ * @generation_time: time spent in generation, in microseconds
+ * @thumbnailer_runs: number of external thumbnailer runs
+ * @thumbnailer_time: time external thumbnailers were running, in microseconds
+ *
+ * Counters of thumbnail loader activity.
+ *
+ * Since: 1.4.1
+ */
+struct _FmThumbnailLoaderStats
+{
+    guint loader_queue;
+    guint generator_queue;
+    guint64 memory_hits;
+    guint64 disk_hits;
+    guint64 misses;
+    guint64 generated;
+    guint64 generation_time;
+    guint64 thumbnailer_runs;
+    guint64 thumbnailer_time;
+};
+
+void fm_thumbnail_loader_get_stats(FmThumbnailLoaderStats* stats);
+
+void fm_thumbnail_loader_reset_stats(void);
+
 /* for toolkit-specific image loading code */
 
 typedef struct _FmThumbnailLoaderBackend FmThumbnailLoaderBackend;
@@ -102,6 +141,24 @@ struct _FmThumbnailLoaderBackend {
 gboolean fm_thumbnail_loader_set_backend(FmThumbnailLoaderBackend* _backend)
                                 __attribute__((warn_unused_result,nonnull(1)));
 
+/**
+ * FmThumbnailLoaderReadAtSizeFunc:
+ * @filename: path to image file
+ * @size: size of square which image should fit into
+ * @width: (out): location to store original image width
+ * @height: (out): location to store original image height
+ *
+ * Reads image by file path scaled down to fit into square of @size.
+ *
+ * Returns: (transfer full): image object or %NULL on failure.
+ *
+ * Since: 1.4.1
+ */
+typedef GObject* (*FmThumbnailLoaderReadAtSizeFunc)(const char* filename, int size,
+                                                    int* width, int* height);
+
+void fm_thumbnail_loader_set_read_at_size_func(FmThumbnailLoaderReadAtSizeFunc func);
+
 G_END_DECLS
 
 #endif /* __FM_THUMBNAIL_LOADER_H__ */
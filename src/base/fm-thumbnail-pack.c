@@ -0,0 +1,690 @@
+/*
+ *      fm-thumbnail-pack.c
+ *
+ *      This file is a part of the Libfm library.
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Per-directory thumbnail packs.
+ * Opening a folder with many images otherwise means opening, reading and
+ * closing one PNG file in the thumbnail cache per file. A pack keeps copies
+ * of those PNG files for all files of one directory and one thumbnail size
+ * in a single file which is mapped into memory, so a lookup is a hash table
+ * access. The freedesktop.org cache is still the authoritative store, packs
+ * are filled from it and rewritten when the loader goes idle, but not more
+ * often than once in PACK_FLUSH_INTERVAL, or when the directory is dropped
+ * from memory. Entries for files which are gone are pruned when a pack is
+ * rewritten first time in a day, and packs not used for PACK_MAX_AGE are
+ * removed.
+ *
+ * Pack file layout, all numbers are little endian:
+ *   header: "FMTP", version, number of entries, reserved (4 x 32 bit)
+ *   entries: mtime (64 bit), name offset, data offset, data length,
+ *            reserved (4 x 32 bit)
+ *   NUL-terminated file names
+ *   PNG data */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "fm-thumbnail-pack.h"
+
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* #define ENABLE_DEBUG */
+#ifdef ENABLE_DEBUG
+#define DEBUG(...)  g_debug(__VA_ARGS__)
+#else
+#define DEBUG(...)
+#endif
+
+#define PACK_MAGIC          "FMTP"
+#define PACK_VERSION        1
+/* packs of so many directories are kept mapped at most */
+#define PACK_MAX_DIRS       16
+/* packs are written not more often than once in so many seconds */
+#define PACK_FLUSH_INTERVAL 30
+/* packs which were not used so long are removed, in seconds */
+#define PACK_MAX_AGE        (30 * 24 * 60 * 60)
+
+typedef struct
+{
+    char magic[4];
+    guint32 version;
+    guint32 n_entries;
+    guint32 reserved;
+} PackHeader;
+
+typedef struct
+{
+    guint64 mtime;
+    guint32 name_offset;
+    guint32 data_offset;
+    guint32 data_len;
+    guint32 reserved;
+} PackEntry;
+
+typedef struct
+{
+    time_t mtime;
+    gsize len;
+    guchar* data;
+} PendingEntry;
+
+typedef struct
+{
+    char* file;             /* path of pack file */
+    GMappedFile* map;       /* contents of pack file */
+    GHashTable* index;      /* name in map -> PackEntry in map */
+    GHashTable* pending;    /* name -> PendingEntry not written yet */
+    gboolean loaded;        /* file was tried to map already */
+    gboolean compact;       /* drop entries of deleted files on next write */
+} ThumbnailPack;
+
+typedef struct
+{
+    FmPath* dir;
+    ThumbnailPack packs[2]; /* normal and large */
+} PackDir;
+
+/* snapshot of a pack to be written without holding packs lock */
+typedef struct
+{
+    FmPath* dir;
+    guint idx;              /* index in PackDir packs */
+    char* file;
+    GMappedFile* map;       /* old contents, NULL if there are none */
+    GHashTable* pending;    /* name -> PendingEntry */
+    gboolean compact;       /* drop entries of deleted files */
+} PackWrite;
+
+G_LOCK_DEFINE_STATIC(packs);
+static GHashTable* pack_dirs = NULL; /* FmPath -> PackDir */
+static char* pack_dir_path = NULL;
+static gboolean packs_dirty = FALSE;
+static GSList* pack_writes = NULL; /* PackWrite to be done, newest first */
+
+/* taken before packs lock, serializes writing of pack files */
+G_LOCK_DEFINE_STATIC(pack_write);
+static time_t last_flush = 0;
+static gboolean packs_expired = FALSE;
+
+static void pending_entry_free(gpointer data)
+{
+    PendingEntry* entry = (PendingEntry*)data;
+    g_free(entry->data);
+    g_slice_free(PendingEntry, entry);
+}
+
+static GHashTable* pending_table_new(void)
+{
+    return g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                 pending_entry_free);
+}
+
+static void thumbnail_pack_unload(ThumbnailPack* pack)
+{
+    if(pack->index)
+    {
+        g_hash_table_destroy(pack->index);
+        pack->index = NULL;
+    }
+    if(pack->map)
+    {
+#if GLIB_CHECK_VERSION(2, 22, 0)
+        g_mapped_file_unref(pack->map);
+#else
+        g_mapped_file_free(pack->map);
+#endif
+        pack->map = NULL;
+    }
+    pack->loaded = FALSE;
+}
+
+static void pack_dir_free(gpointer data)
+{
+    PackDir* pd = (PackDir*)data;
+    guint i;
+
+    for(i = 0; i < G_N_ELEMENTS(pd->packs); i++)
+    {
+        thumbnail_pack_unload(&pd->packs[i]);
+        if(pd->packs[i].pending)
+            g_hash_table_destroy(pd->packs[i].pending);
+        g_free(pd->packs[i].file);
+    }
+    fm_path_unref(pd->dir);
+    g_slice_free(PackDir, pd);
+}
+
+/* should be called with packs lock held */
+static void thumbnail_pack_load(ThumbnailPack* pack)
+{
+    const char* contents;
+    const PackHeader* header;
+    const PackEntry* entries;
+    struct stat st;
+    gsize len;
+    guint32 i, n;
+
+    pack->loaded = TRUE;
+    pack->map = g_mapped_file_new(pack->file, FALSE, NULL);
+    if(!pack->map)
+        return;
+    contents = g_mapped_file_get_contents(pack->map);
+    len = g_mapped_file_get_length(pack->map);
+    header = (const PackHeader*)contents;
+    if(contents == NULL || len < sizeof(PackHeader)
+       || memcmp(header->magic, PACK_MAGIC, 4) != 0
+       || GUINT32_FROM_LE(header->version) != PACK_VERSION)
+        goto _invalid;
+    n = GUINT32_FROM_LE(header->n_entries);
+    if((guint64)n * sizeof(PackEntry) > len - sizeof(PackHeader))
+        goto _invalid;
+    entries = (const PackEntry*)(contents + sizeof(PackHeader));
+    pack->index = g_hash_table_new(g_str_hash, g_str_equal);
+    for(i = 0; i < n; i++)
+    {
+        guint32 name_offset = GUINT32_FROM_LE(entries[i].name_offset);
+        guint64 data_end = (guint64)GUINT32_FROM_LE(entries[i].data_offset)
+                           + GUINT32_FROM_LE(entries[i].data_len);
+
+        if(name_offset >= len || data_end > len
+           || memchr(contents + name_offset, '\0', len - name_offset) == NULL)
+            goto _invalid;
+        g_hash_table_insert(pack->index, (char*)contents + name_offset,
+                            (gpointer)&entries[i]);
+    }
+    DEBUG("thumbnail pack %s: %u entries", pack->file, n);
+    /* mark it used so it is not expired, once a day is enough; checking
+       entries for deleted files is not needed more often either */
+    if(g_stat(pack->file, &st) == 0 && time(NULL) - st.st_mtime > 24 * 60 * 60)
+    {
+        g_utime(pack->file, NULL);
+        pack->compact = TRUE;
+    }
+    return;
+
+_invalid:
+    g_warning("invalid thumbnail pack %s, removing it", pack->file);
+    thumbnail_pack_unload(pack);
+    pack->loaded = TRUE;
+    g_unlink(pack->file);
+}
+
+static gboolean write_all(int fd, const void* buf, gsize len)
+{
+    while(len > 0)
+    {
+        gssize written = write(fd, buf, len);
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return FALSE;
+        }
+        buf = (const char*)buf + written;
+        len -= written;
+    }
+    return TRUE;
+}
+
+/* should be called with packs lock held */
+static void thumbnail_pack_queue_write(PackDir* pd, guint idx)
+{
+    ThumbnailPack* pack = &pd->packs[idx];
+    GHashTableIter it;
+    gpointer key, value;
+    GSList* l;
+    PackWrite* pw;
+
+    if(g_hash_table_size(pack->pending) == 0)
+        return;
+    /* if directory was evicted and loaded again before its pack was written
+       then add new entries to that write so they don't get overwritten */
+    for(l = pack_writes; l; l = l->next)
+    {
+        pw = l->data;
+        if(pw->idx != idx || !fm_path_equal(pw->dir, pd->dir))
+            continue;
+        g_hash_table_iter_init(&it, pack->pending);
+        while(g_hash_table_iter_next(&it, &key, &value))
+        {
+            g_hash_table_iter_steal(&it);
+            g_hash_table_replace(pw->pending, key, value);
+        }
+        pw->compact |= pack->compact;
+        pack->compact = FALSE;
+        return;
+    }
+    pw = g_slice_new(PackWrite);
+    pw->dir = fm_path_ref(pd->dir);
+    pw->idx = idx;
+    pw->file = g_strdup(pack->file);
+    /* the mapping is never changed so it can be read without lock */
+#if GLIB_CHECK_VERSION(2, 22, 0)
+    pw->map = pack->index ? g_mapped_file_ref(pack->map) : NULL;
+#else
+    /* cannot be shared, old entries will be lost */
+    pw->map = NULL;
+#endif
+    /* until it is written those are looked up in thumbnails cache */
+    pw->pending = pack->pending;
+    pack->pending = pending_table_new();
+    pw->compact = pack->compact;
+    pack->compact = FALSE;
+    pack_writes = g_slist_prepend(pack_writes, pw);
+}
+
+static void pack_write_free(PackWrite* pw)
+{
+    fm_path_unref(pw->dir);
+    g_free(pw->file);
+    if(pw->map)
+#if GLIB_CHECK_VERSION(2, 22, 0)
+        g_mapped_file_unref(pw->map);
+#else
+        g_mapped_file_free(pw->map);
+#endif
+    g_hash_table_destroy(pw->pending);
+    g_slice_free(PackWrite, pw);
+}
+
+/* in thread, should be called with pack_write lock held */
+static void pack_write_run(PackWrite* pw)
+{
+    GArray* entries = g_array_new(FALSE, FALSE, sizeof(PackEntry));
+    GPtrArray* blobs = g_ptr_array_new(); /* data of entries in order */
+    GString* names = g_string_new(NULL);
+    const char* contents = pw->map ? g_mapped_file_get_contents(pw->map) : NULL;
+    char* dir_path = NULL;
+    GHashTableIter it;
+    gpointer key, value;
+    PackHeader header;
+    PackEntry entry;
+    guint64 offset;
+    guint i;
+    char* tmpfile;
+    int fd;
+
+    memset(&entry, 0, sizeof(entry));
+    if(pw->compact && fm_path_is_native(pw->dir))
+        dir_path = fm_path_to_str(pw->dir);
+    /* entries from file which weren't replaced, then new ones */
+    if(contents)
+    {
+        const PackEntry* old = (const PackEntry*)(contents + sizeof(PackHeader));
+        guint32 n = GUINT32_FROM_LE(((const PackHeader*)contents)->n_entries);
+
+        /* it was validated when loaded */
+        for(i = 0; i < n; i++, old++)
+        {
+            const char* name = contents + GUINT32_FROM_LE(old->name_offset);
+
+            if(g_hash_table_lookup(pw->pending, name))
+                continue;
+            if(dir_path) /* drop files which were deleted */
+            {
+                char* path = g_build_filename(dir_path, name, NULL);
+                gboolean exists = g_file_test(path, G_FILE_TEST_EXISTS);
+
+                g_free(path);
+                if(!exists)
+                    continue;
+            }
+            entry.mtime = GUINT64_FROM_LE(old->mtime);
+            entry.name_offset = names->len;
+            entry.data_len = GUINT32_FROM_LE(old->data_len);
+            g_string_append_len(names, name, strlen(name) + 1);
+            g_array_append_val(entries, entry);
+            g_ptr_array_add(blobs, (gpointer)(contents + GUINT32_FROM_LE(old->data_offset)));
+        }
+    }
+    g_free(dir_path);
+    g_hash_table_iter_init(&it, pw->pending);
+    while(g_hash_table_iter_next(&it, &key, &value))
+    {
+        PendingEntry* pending = (PendingEntry*)value;
+        entry.mtime = pending->mtime;
+        entry.name_offset = names->len;
+        entry.data_len = pending->len;
+        g_string_append_len(names, key, strlen(key) + 1);
+        g_array_append_val(entries, entry);
+        g_ptr_array_add(blobs, pending->data);
+    }
+
+    /* now we know the layout so fix offsets */
+    offset = sizeof(PackHeader) + (guint64)entries->len * sizeof(PackEntry);
+    for(i = 0; i < entries->len; i++)
+    {
+        PackEntry* e = &g_array_index(entries, PackEntry, i);
+        e->name_offset = GUINT32_TO_LE(e->name_offset + offset);
+        e->mtime = GUINT64_TO_LE(e->mtime);
+    }
+    offset += names->len;
+    for(i = 0; i < entries->len; i++)
+    {
+        PackEntry* e = &g_array_index(entries, PackEntry, i);
+        e->data_offset = GUINT32_TO_LE(offset);
+        offset += e->data_len;
+        e->data_len = GUINT32_TO_LE(e->data_len);
+    }
+    if(offset > G_MAXUINT32) /* too big to be indexed, don't save it */
+        goto _out;
+
+    memcpy(header.magic, PACK_MAGIC, 4);
+    header.version = GUINT32_TO_LE(PACK_VERSION);
+    header.n_entries = GUINT32_TO_LE(entries->len);
+    header.reserved = 0;
+
+    /* write to a temp file first so readers never see a partial pack */
+    tmpfile = g_strconcat(pw->file, ".XXXXXX", NULL);
+    fd = g_mkstemp(tmpfile);
+    if(fd != -1)
+    {
+        gboolean ok;
+
+        ok = write_all(fd, &header, sizeof(header))
+             && write_all(fd, entries->data, entries->len * sizeof(PackEntry))
+             && write_all(fd, names->str, names->len);
+        for(i = 0; ok && i < entries->len; i++)
+            ok = write_all(fd, blobs->pdata[i],
+                           GUINT32_FROM_LE(g_array_index(entries, PackEntry, i).data_len));
+        if(close(fd) != 0)
+            ok = FALSE;
+        if(ok && g_rename(tmpfile, pw->file) == 0)
+            DEBUG("thumbnail pack %s: %u entries written", pw->file, entries->len);
+        else
+            g_unlink(tmpfile);
+    }
+    g_free(tmpfile);
+
+_out:
+    g_array_free(entries, TRUE);
+    g_ptr_array_free(blobs, TRUE);
+    g_string_free(names, TRUE);
+}
+
+/* should be called with packs lock held */
+static void flush_packs(void)
+{
+    GHashTableIter it;
+    gpointer value;
+    guint i;
+
+    if(!packs_dirty)
+        return;
+    packs_dirty = FALSE;
+    g_hash_table_iter_init(&it, pack_dirs);
+    while(g_hash_table_iter_next(&it, NULL, &value))
+        for(i = 0; i < G_N_ELEMENTS(((PackDir*)value)->packs); i++)
+            thumbnail_pack_queue_write((PackDir*)value, i);
+}
+
+/* in thread, should be called with pack_write lock held */
+static void expire_packs(const char* path)
+{
+    GDir* dir = g_dir_open(path, 0, NULL);
+    const char* name;
+    time_t now = time(NULL);
+
+    if(dir == NULL)
+        return;
+    /* stale temp files are removed as well */
+    while((name = g_dir_read_name(dir)))
+    {
+        char* file = g_build_filename(path, name, NULL);
+        struct stat st;
+
+        if(g_stat(file, &st) == 0 && now - st.st_mtime > PACK_MAX_AGE)
+        {
+            DEBUG("thumbnail pack %s expired", file);
+            g_unlink(file);
+        }
+        g_free(file);
+    }
+    g_dir_close(dir);
+}
+
+/* should be called with pack_write lock held, takes packs lock */
+static void write_packs(gboolean expire)
+{
+    GSList* writes, *l;
+    char* path;
+
+    G_LOCK(packs);
+    /* write them in order they were queued */
+    writes = g_slist_reverse(pack_writes);
+    pack_writes = NULL;
+    path = g_strdup(pack_dir_path);
+    G_UNLOCK(packs);
+    if(path == NULL) /* finalized */
+        return;
+    if(writes)
+        g_mkdir_with_parents(path, 0700);
+    for(l = writes; l; l = l->next)
+        pack_write_run(l->data);
+    if(expire)
+        expire_packs(path);
+    g_free(path);
+    /* mappings will be reloaded on next lookup */
+    G_LOCK(packs);
+    for(l = writes; l; l = l->next)
+    {
+        PackWrite* pw = l->data;
+        PackDir* pd = pack_dirs ? g_hash_table_lookup(pack_dirs, pw->dir) : NULL;
+        if(pd)
+            thumbnail_pack_unload(&pd->packs[pw->idx]);
+    }
+    G_UNLOCK(packs);
+    g_slist_foreach(writes, (GFunc)pack_write_free, NULL);
+    g_slist_free(writes);
+}
+
+/* should be called with packs lock held */
+static ThumbnailPack* get_pack(FmPath* dir, guint size)
+{
+    PackDir* pd = g_hash_table_lookup(pack_dirs, dir);
+    ThumbnailPack* pack;
+
+    if(pd == NULL)
+    {
+        char* str;
+        char* md5;
+
+        if(g_hash_table_size(pack_dirs) >= PACK_MAX_DIRS)
+        {
+            /* drop mappings of previous directories, new entries of
+               them will be written on next flush */
+            flush_packs();
+            g_hash_table_remove_all(pack_dirs);
+        }
+        pd = g_slice_new0(PackDir);
+        pd->dir = fm_path_ref(dir);
+        str = fm_path_to_str(dir);
+        md5 = g_compute_checksum_for_string(G_CHECKSUM_MD5, str, -1);
+        pd->packs[0].file = g_strdup_printf("%s/%s-normal.pack", pack_dir_path, md5);
+        pd->packs[1].file = g_strdup_printf("%s/%s-large.pack", pack_dir_path, md5);
+        pd->packs[0].pending = pending_table_new();
+        pd->packs[1].pending = pending_table_new();
+        g_free(md5);
+        g_free(str);
+        g_hash_table_insert(pack_dirs, pd->dir, pd);
+    }
+    pack = &pd->packs[size > 128 ? 1 : 0];
+    if(!pack->loaded)
+        thumbnail_pack_load(pack);
+    return pack;
+}
+
+/* in thread */
+/**
+ * _fm_thumbnail_pack_lookup:
+ * @path: file to find thumbnail for
+ * @size: size of thumbnail, 128 or 512
+ * @mtime: modification time of @path
+ * @data: (out) location to store PNG data
+ * @len: (out) location to store length of @data
+ *
+ * Searches pack of directory of @path for thumbnail. Returned data should
+ * be freed with g_free() after usage.
+ *
+ * Returns: %TRUE if thumbnail for @mtime was found.
+ */
+gboolean _fm_thumbnail_pack_lookup(FmPath* path, guint size, time_t mtime,
+                                   guchar** data, gsize* len)
+{
+    FmPath* dir = fm_path_get_parent(path);
+    const char* name = fm_path_get_basename(path);
+    ThumbnailPack* pack;
+    PendingEntry* pending;
+    const PackEntry* entry;
+    gboolean found = FALSE;
+
+    if(dir == NULL)
+        return FALSE;
+    G_LOCK(packs);
+    if(pack_dirs == NULL) /* finalized */
+        goto _out;
+    pack = get_pack(dir, size);
+    pending = g_hash_table_lookup(pack->pending, name);
+    if(pending)
+    {
+        if(pending->mtime == mtime)
+        {
+            *len = pending->len;
+            *data = g_malloc(pending->len);
+            memcpy(*data, pending->data, pending->len);
+            found = TRUE;
+        }
+    }
+    else if(pack->index && (entry = g_hash_table_lookup(pack->index, name)))
+    {
+        if(GUINT64_FROM_LE(entry->mtime) == (guint64)mtime)
+        {
+            const char* contents = g_mapped_file_get_contents(pack->map);
+            *len = GUINT32_FROM_LE(entry->data_len);
+            *data = g_malloc(*len);
+            memcpy(*data, contents + GUINT32_FROM_LE(entry->data_offset), *len);
+            found = TRUE;
+        }
+    }
+_out:
+    G_UNLOCK(packs);
+    return found;
+}
+
+/* in thread */
+/**
+ * _fm_thumbnail_pack_add:
+ * @path: file which thumbnail is
+ * @size: size of thumbnail, 128 or 512
+ * @mtime: modification time of @path the thumbnail was made for
+ * @data: (transfer full): PNG data of thumbnail
+ * @len: length of @data
+ *
+ * Adds thumbnail into pack of directory of @path. The @data will be freed
+ * with g_free() after usage. The pack is written on disk by
+ * _fm_thumbnail_pack_flush().
+ */
+void _fm_thumbnail_pack_add(FmPath* path, guint size, time_t mtime,
+                            guchar* data, gsize len)
+{
+    FmPath* dir = fm_path_get_parent(path);
+    const char* name = fm_path_get_basename(path);
+    PendingEntry* pending;
+    ThumbnailPack* pack;
+
+    if(dir == NULL || len > G_MAXUINT32)
+    {
+        g_free(data);
+        return;
+    }
+    G_LOCK(packs);
+    if(pack_dirs == NULL) /* finalized */
+    {
+        G_UNLOCK(packs);
+        g_free(data);
+        return;
+    }
+    pack = get_pack(dir, size);
+    pending = g_slice_new(PendingEntry);
+    pending->mtime = mtime;
+    pending->len = len;
+    pending->data = data;
+    g_hash_table_replace(pack->pending, g_strdup(name), pending);
+    packs_dirty = TRUE;
+    G_UNLOCK(packs);
+}
+
+/* in thread */
+/**
+ * _fm_thumbnail_pack_flush:
+ *
+ * Writes packs of directories which were dropped from memory, and all packs
+ * which have new entries if they were not written for PACK_FLUSH_INTERVAL.
+ */
+void _fm_thumbnail_pack_flush(void)
+{
+    gboolean expire;
+    time_t now = time(NULL);
+
+    G_LOCK(pack_write);
+    G_LOCK(packs);
+    if(pack_dirs && packs_dirty &&
+       (now < last_flush || now - last_flush >= PACK_FLUSH_INTERVAL))
+    {
+        flush_packs();
+        last_flush = now;
+    }
+    G_UNLOCK(packs);
+    /* once per session is enough */
+    expire = !packs_expired;
+    packs_expired = TRUE;
+    write_packs(expire);
+    G_UNLOCK(pack_write);
+}
+
+void _fm_thumbnail_pack_init(const char* thumb_dir)
+{
+    G_LOCK(packs);
+    pack_dir_path = g_build_filename(thumb_dir, "libfm-pack", NULL);
+    pack_dirs = g_hash_table_new_full((GHashFunc)fm_path_hash,
+                                      (GEqualFunc)fm_path_equal,
+                                      NULL, pack_dir_free);
+    G_UNLOCK(packs);
+}
+
+void _fm_thumbnail_pack_finalize(void)
+{
+    G_LOCK(pack_write);
+    G_LOCK(packs);
+    flush_packs();
+    g_hash_table_destroy(pack_dirs);
+    pack_dirs = NULL;
+    G_UNLOCK(packs);
+    write_packs(FALSE);
+    G_LOCK(packs);
+    g_free(pack_dir_path);
+    pack_dir_path = NULL;
+    G_UNLOCK(packs);
+    G_UNLOCK(pack_write);
+}
@@ -71,6 +71,7 @@ struct _FmFolderModel
     guint thumbnail_max;
     GList* thumbnail_requests;
     GHashTable* items_hash;
+    GHashTable* hidden_hash; /* the same as items_hash but for hidden items */
 
     GSList* filters;
 };
@@ -86,6 +87,10 @@ struct _FmFolderItem
     gboolean thumbnail_failed : 1;
     gboolean is_extra : 1;
     FmFolderModelExtraFilePos pos : 3;
+    guint sort_key_col : 8; /* column for which sort_key was made */
+    gboolean sort_key_owned : 1; /* FALSE if sort_key points into file info */
+    gint old_pos; /* used by fm_folder_model_do_sort() */
+    const char* sort_key; /* cached binary-comparable key, see _fm_folder_item_get_sort_key() */
 };
 
 typedef struct _FmFolderModelFilterItem
@@ -158,6 +163,9 @@ static void fm_folder_model_set_default_sort_func(GtkTreeSortable *sortable,
                                                   gpointer user_data,
                                                   GDestroyNotify destroy);
 static void fm_folder_model_do_sort(FmFolderModel* model);
+static gint fm_folder_model_compare(gconstpointer item1,
+                                    gconstpointer item2,
+                                    gpointer user_data);
 
 static inline gboolean file_can_show(FmFolderModel* model, FmFileInfo* file);
 
@@ -207,11 +215,17 @@ static FmFolderModelInfo** column_infos = NULL;
 enum {
     ROW_DELETING,
     FILTER_CHANGED,
+    ROWS_REPLACING,
+    ROWS_REPLACED,
     N_SIGNALS
 };
 
 static guint signals[N_SIGNALS];
 
+/* minimal number of rows changed at once for which views are asked to
+   detach instead of receiving a signal for each row */
+#define FM_FOLDER_MODEL_BULK_MIN 128
+
 static void fm_folder_model_init(FmFolderModel* model)
 {
     model->sort_mode = FM_SORT_ASCENDING;
@@ -227,6 +241,7 @@ static void fm_folder_model_init(FmFolderModel* model)
 
     model->thumbnail_max = fm_config->thumbnail_max << 10;
     model->items_hash = g_hash_table_new(g_direct_hash, g_direct_equal);
+    model->hidden_hash = g_hash_table_new(g_direct_hash, g_direct_equal);
 }
 
 static void fm_folder_model_class_init(FmFolderModelClass *klass)
@@ -278,6 +293,48 @@ static void fm_folder_model_class_init(FmFolderModelClass *klass)
                      NULL, NULL,
                      g_cclosure_marshal_VOID__VOID,
                      G_TYPE_NONE, 0);
+
+    /**
+     * FmFolderModel::rows-replacing:
+     * @model: folder model instance that received the signal
+     *
+     * This signal is emitted before big amount of rows will be changed at
+     * once, e.g. when filter is applied or many files are added. If the
+     * handler detaches view from @model and there are no handlers left
+     * for #GtkTreeModel::row-inserted, #GtkTreeModel::row-deleted, and
+     * #FmFolderModel::row-deleting signals then rows will be changed
+     * without emitting those signals for each row, otherwise they are
+     * emitted for remaining handlers. The view may attach to @model again
+     * in #FmFolderModel::rows-replaced signal handler.
+     *
+     * Since: 1.4.1
+     */
+    signals[ROWS_REPLACING] =
+        g_signal_new("rows-replacing",
+                     G_TYPE_FROM_CLASS(klass),
+                     G_SIGNAL_RUN_FIRST,
+                     G_STRUCT_OFFSET(FmFolderModelClass, rows_replacing),
+                     NULL, NULL,
+                     g_cclosure_marshal_VOID__VOID,
+                     G_TYPE_NONE, 0);
+
+    /**
+     * FmFolderModel::rows-replaced:
+     * @model: folder model instance that received the signal
+     *
+     * This signal is emitted after #FmFolderModel::rows-replacing when
+     * all changes are done so views may attach to @model again.
+     *
+     * Since: 1.4.1
+     */
+    signals[ROWS_REPLACED] =
+        g_signal_new("rows-replaced",
+                     G_TYPE_FROM_CLASS(klass),
+                     G_SIGNAL_RUN_FIRST,
+                     G_STRUCT_OFFSET(FmFolderModelClass, rows_replaced),
+                     NULL, NULL,
+                     g_cclosure_marshal_VOID__VOID,
+                     G_TYPE_NONE, 0);
 }
 
 static void fm_folder_model_tree_model_init(GtkTreeModelIface *iface)
@@ -372,6 +429,11 @@ static void fm_folder_model_dispose(GObject *object)
         g_hash_table_destroy(model->items_hash);
         model->items_hash = NULL;
     }
+    if(model->hidden_hash)
+    {
+        g_hash_table_destroy(model->hidden_hash);
+        model->hidden_hash = NULL;
+    }
 
     if(model->filters)
     {
@@ -417,10 +479,21 @@ static inline void fm_folder_item_free(gpointer data)
     FmFolderItem* item = (FmFolderItem*)data;
     if( item->icon )
         g_object_unref(item->icon);
+    if(item->sort_key_owned)
+        g_free((char*)item->sort_key);
     fm_file_info_unref(item->inf);
     g_slice_free(FmFolderItem, item);
 }
 
+/* drops data cached from file info, should be called when file is changed */
+static inline void fm_folder_item_reset_sort_key(FmFolderItem* item)
+{
+    if(item->sort_key_owned)
+        g_free((char*)item->sort_key);
+    item->sort_key = NULL;
+    item->sort_key_owned = FALSE;
+}
+
 static void _fm_folder_model_files_changed(FmFolder* dir, GSList* files,
                                            FmFolderModel* model)
 {
@@ -429,10 +502,41 @@ static void _fm_folder_model_files_changed(FmFolder* dir, GSList* files,
         fm_folder_model_file_changed(model, l->data);
 }
 
-static void _fm_folder_model_add_file(FmFolderModel* model, FmFileInfo* file)
+/* checks if changing n_changes rows at once is worth asking views to
+   detach from the model; returns TRUE if views were asked, then
+   _fm_folder_model_bulk_end() should be called. Sets quiet to TRUE if
+   rows may be changed without per-row signals */
+static gboolean _fm_folder_model_bulk_begin(FmFolderModel* model, guint n_changes,
+                                            gboolean* quiet)
+{
+    *quiet = FALSE;
+    if(n_changes < FM_FOLDER_MODEL_BULK_MIN ||
+       n_changes < (guint)g_sequence_get_length(model->items) / 4)
+        return FALSE;
+    g_signal_emit(model, signals[ROWS_REPLACING], 0);
+    /* if someone still watches rows then fall back to per-row signals, but
+       views which detached stay so until the end and don't get them */
+    *quiet = !(g_signal_has_handler_pending(model, g_signal_lookup("row-inserted", GTK_TYPE_TREE_MODEL), 0, FALSE) ||
+               g_signal_has_handler_pending(model, g_signal_lookup("row-deleted", GTK_TYPE_TREE_MODEL), 0, FALSE) ||
+               g_signal_has_handler_pending(model, signals[ROW_DELETING], 0, FALSE));
+    return TRUE;
+}
+
+static inline void _fm_folder_model_bulk_end(FmFolderModel* model)
+{
+    g_signal_emit(model, signals[ROWS_REPLACED], 0);
+}
+
+static void _fm_folder_model_add_file(FmFolderModel* model, FmFileInfo* file,
+                                      gboolean quiet)
 {
     if(!file_can_show(model, file))
-        g_sequence_append( model->hidden, fm_folder_item_new(file) );
+        g_hash_table_insert(model->hidden_hash, file,
+                            g_sequence_append(model->hidden, fm_folder_item_new(file)));
+    else if(quiet) /* nobody watches rows now */
+        g_hash_table_insert(model->items_hash, file,
+                            g_sequence_insert_sorted(model->items, fm_folder_item_new(file),
+                                                     fm_folder_model_compare, model));
     else
         fm_folder_model_file_created(model, file);
 }
@@ -441,11 +545,16 @@ static void _fm_folder_model_files_added(FmFolder* dir, GSList* files,
                                          FmFolderModel* model)
 {
     GSList* l;
+    gboolean quiet;
+    gboolean bulk = _fm_folder_model_bulk_begin(model, g_slist_length(files), &quiet);
+
     for( l = files; l; l=l->next )
     {
         FmFileInfo* fi = FM_FILE_INFO(l->data);
-        _fm_folder_model_add_file(model, fi);
+        _fm_folder_model_add_file(model, fi, quiet);
     }
+    if(bulk)
+        _fm_folder_model_bulk_end(model);
 }
 
 
@@ -569,6 +678,7 @@ void fm_folder_model_set_folder(FmFolderModel* model, FmFolder* dir)
             gtk_tree_path_free(tp);
         }
         g_hash_table_remove_all(model->items_hash);
+        g_hash_table_remove_all(model->hidden_hash);
         g_sequence_free(model->items);
         g_sequence_free(model->hidden);
         g_object_unref(model->folder);
@@ -584,6 +694,13 @@ void fm_folder_model_set_folder(FmFolderModel* model, FmFolder* dir)
         g_hash_table_insert(model->items_hash, item->inf, item_it);
         item_it = g_sequence_iter_next(item_it);
     }
+    item_it = g_sequence_get_begin_iter(model->hidden);
+    while(!g_sequence_iter_is_end(item_it))
+    {
+        item = (FmFolderItem*)g_sequence_get(item_it);
+        g_hash_table_insert(model->hidden_hash, item->inf, item_it);
+        item_it = g_sequence_iter_next(item_it);
+    }
     if( !dir )
         return;
     model->folder = FM_FOLDER(g_object_ref(dir));
@@ -605,8 +722,13 @@ void fm_folder_model_set_folder(FmFolderModel* model, FmFolder* dir)
         {
             GList *l;
             FmFileInfoList* files = fm_folder_get_files(model->folder);
+            gboolean quiet;
+            gboolean bulk = _fm_folder_model_bulk_begin(model,
+                                        fm_file_info_list_get_length(files), &quiet);
             for( l = fm_file_info_list_peek_head_link(files); l; l = l->next )
-                _fm_folder_model_add_file(model, FM_FILE_INFO(l->data));
+                _fm_folder_model_add_file(model, FM_FILE_INFO(l->data), quiet);
+            if(bulk)
+                _fm_folder_model_bulk_end(model);
         }
     }
 }
@@ -1002,16 +1124,47 @@ static void fm_folder_model_set_default_sort_func(GtkTreeSortable *sortable,
     g_warning("fm_folder_model_set_default_sort_func: Not supported\n");
 }
 
+/* makes a key which can be compared with strcmp() once instead of doing
+   expensive things on each comparison; it is kept until the file or sort
+   column is changed, so a key pointing into file info stays valid */
+static const char* _fm_folder_item_get_sort_key(FmFolderItem* item,
+                                                FmFolderModelCol col)
+{
+    const char *name, *ext;
+
+    if (G_LIKELY(item->sort_key != NULL && item->sort_key_col == (guint)col))
+        return item->sort_key;
+    fm_folder_item_reset_sort_key(item);
+    switch (col)
+    {
+    case FM_FOLDER_MODEL_COL_DESC:
+        name = fm_file_info_get_desc(item->inf);
+        item->sort_key = g_utf8_collate_key(name ? name : "", -1);
+        item->sort_key_owned = TRUE;
+        break;
+    case FM_FOLDER_MODEL_COL_EXT:
+        /* extension is compared as is, no need to copy it */
+        name = fm_file_info_get_disp_name(item->inf);
+        ext = strrchr(name, '.');
+        /* empty string is sorted before any extension as NULL was */
+        item->sort_key = (ext && ext != name) ? ext : "";
+        break;
+    default:
+        item->sort_key = "";
+    }
+    item->sort_key_col = col;
+    return item->sort_key;
+}
+
 static gint fm_folder_model_compare(gconstpointer item1,
                                     gconstpointer item2,
                                     gpointer user_data)
 {
-    FmFolderModel* model = FM_FOLDER_MODEL(user_data);
+    FmFolderModel* model = (FmFolderModel*)user_data; /* no type check here */
     FmFileInfo* file1 = ((FmFolderItem*)item1)->inf;
     FmFileInfo* file2 = ((FmFolderItem*)item2)->inf;
     const char* key1;
     const char* key2;
-    const char *name;
     goffset diff;
     int ret = 0;
 
@@ -1075,8 +1228,10 @@ _main_sort:
             goto _sort_by_name;
         break;
     case FM_FOLDER_MODEL_COL_DESC:
-        /* FIXME: this is very slow */
-        ret = g_utf8_collate(fm_file_info_get_desc(file1), fm_file_info_get_desc(file2));
+    case FM_FOLDER_MODEL_COL_EXT:
+        key1 = _fm_folder_item_get_sort_key((FmFolderItem*)item1, model->sort_col);
+        key2 = _fm_folder_item_get_sort_key((FmFolderItem*)item2, model->sort_col);
+        ret = strcmp(key1, key2);
         if(0 == ret)
             goto _sort_by_name;
         break;
@@ -1094,19 +1249,6 @@ _main_sort:
             ret = fm_path_compare(dirpath1, dirpath2);
         }
         break;
-    case FM_FOLDER_MODEL_COL_EXT:
-        name = fm_file_info_get_disp_name(file1);
-        key1 = strrchr(name, '.');
-        if (key1 == name)
-            key1 = NULL;
-        name = fm_file_info_get_disp_name(file2);
-        key2 = strrchr(name, '.');
-        if (key2 == name)
-            key2 = NULL;
-        ret = g_strcmp0(key1, key2);
-        if (ret == 0)
-            goto _sort_by_name;
-        break;
     default:
 _sort_by_name:
         if(model->sort_mode & FM_SORT_CASE_SENSITIVE)
@@ -1135,22 +1277,22 @@ _sort_by_name:
 
 static void fm_folder_model_do_sort(FmFolderModel* model)
 {
-    GHashTable* old_order;
     gint *new_order;
     GSequenceIter *items_it;
     GtkTreePath *path;
+    gint i, n;
+    gboolean changed = FALSE;
 
     /* if there is only one item */
-    if( model->items == NULL || g_sequence_get_length(model->items) <= 1 )
+    if( model->items == NULL || (n = g_sequence_get_length(model->items)) <= 1 )
         return;
 
-    old_order = g_hash_table_new(g_direct_hash, g_direct_equal);
-    /* save old order */
+    /* save old order in items, we walk sequence in order so don't need
+       to ask sequence for position of each item */
     items_it = g_sequence_get_begin_iter(model->items);
-    while( !g_sequence_iter_is_end(items_it) )
+    for(i = 0; !g_sequence_iter_is_end(items_it); i++)
     {
-        int i = g_sequence_iter_get_position(items_it);
-        g_hash_table_insert( old_order, items_it, GINT_TO_POINTER(i) );
+        ((FmFolderItem*)g_sequence_get(items_it))->old_pos = i;
         items_it = g_sequence_iter_next(items_it);
     }
 
@@ -1158,19 +1300,23 @@ static void fm_folder_model_do_sort(FmFolderModel* model)
     g_sequence_sort(model->items, fm_folder_model_compare, model);
 
     /* save new order */
-    new_order = g_new( int, g_sequence_get_length(model->items) );
+    new_order = g_new( int, n );
     items_it = g_sequence_get_begin_iter(model->items);
-    while( !g_sequence_iter_is_end(items_it) )
+    for(i = 0; !g_sequence_iter_is_end(items_it); i++)
     {
-        int i = g_sequence_iter_get_position(items_it);
-        new_order[i] = GPOINTER_TO_INT(g_hash_table_lookup(old_order, items_it));
+        new_order[i] = ((FmFolderItem*)g_sequence_get(items_it))->old_pos;
+        if(new_order[i] != i)
+            changed = TRUE;
         items_it = g_sequence_iter_next(items_it);
     }
-    g_hash_table_destroy(old_order);
-    path = gtk_tree_path_new();
-    gtk_tree_model_rows_reordered(GTK_TREE_MODEL(model),
-                                  path, NULL, new_order);
-    gtk_tree_path_free(path);
+    /* don't make views do anything if nothing was moved */
+    if(changed)
+    {
+        path = gtk_tree_path_new();
+        gtk_tree_model_rows_reordered(GTK_TREE_MODEL(model),
+                                      path, NULL, new_order);
+        gtk_tree_path_free(path);
+    }
     g_free(new_order);
 }
 
@@ -1230,17 +1376,8 @@ gboolean fm_folder_model_extra_file_add(FmFolderModel* model, FmFileInfo* file,
     if (g_hash_table_lookup(model->items_hash, file) != NULL)
         return FALSE; /* it is already there! */
     /* check hidden items as well */
-    if (!file_can_show(model, file)) /* if this is a hidden file */
-    {
-        GSequenceIter *seq_it = g_sequence_get_begin_iter(model->hidden);
-        while (!g_sequence_iter_is_end(seq_it))
-        {
-            item = (FmFolderItem*)g_sequence_get(seq_it);
-            if (item->inf == file) /* found! */
-                return FALSE;
-            seq_it = g_sequence_iter_next(seq_it);
-        }
-    }
+    if (g_hash_table_lookup(model->hidden_hash, file) != NULL)
+        return FALSE;
     item = fm_folder_item_new(file);
     item->is_extra = TRUE;
     item->pos = where;
@@ -1269,21 +1406,15 @@ void fm_folder_model_file_deleted(FmFolderModel* model, FmFileInfo* file)
     GtkTreePath* path;
     GtkTreeIter it;
 
-    if(!file_can_show(model, file)) /* if this is a hidden file */
+    seq_it = g_hash_table_lookup(model->hidden_hash, file);
+    if(seq_it) /* if this is a hidden file */
     {
-        seq_it = g_sequence_get_begin_iter(model->hidden);
-        while( !g_sequence_iter_is_end(seq_it) )
-        {
-            item = (FmFolderItem*)g_sequence_get(seq_it);
-            if( item->inf == file )
-            {
-                g_sequence_remove(seq_it);
-                return;
-            }
-            seq_it = g_sequence_iter_next(seq_it);
-        }
+        g_hash_table_remove(model->hidden_hash, file);
+        g_sequence_remove(seq_it);
         return;
     }
+    if(!file_can_show(model, file)) /* hidden file which we don't have */
+        return;
     seq_it = info2iter(model, file);
     g_return_if_fail(seq_it != NULL);
     item = (FmFolderItem*)g_sequence_get(seq_it);
@@ -1323,17 +1454,9 @@ gboolean fm_folder_model_extra_file_remove(FmFolderModel* model, FmFileInfo* fil
     if (seq_it)
         item = (FmFolderItem*)g_sequence_get(seq_it);
     /* check hidden items */
-    else if (!file_can_show(model, file)) /* if this is a hidden file */
+    else if ((seq_it = g_hash_table_lookup(model->hidden_hash, file)) != NULL)
     {
-        seq_it = g_sequence_get_begin_iter(model->hidden);
-        while (!g_sequence_iter_is_end(seq_it))
-        {
-            item = (FmFolderItem*)g_sequence_get(seq_it);
-            if (item->inf == file) /* found! */
-                break;
-            item = NULL; /* reset it again */
-            seq_it = g_sequence_iter_next(seq_it);
-        }
+        item = (FmFolderItem*)g_sequence_get(seq_it);
         is_hidden = TRUE;
     }
     if (item == NULL) /* item not found */
@@ -1350,6 +1473,8 @@ gboolean fm_folder_model_extra_file_remove(FmFolderModel* model, FmFileInfo* fil
         gtk_tree_path_free(path);
         g_hash_table_remove(model->items_hash, file);
     }
+    else
+        g_hash_table_remove(model->hidden_hash, file);
     g_sequence_remove(seq_it);
     return TRUE;
 }
@@ -1381,6 +1506,7 @@ void fm_folder_model_file_changed(FmFolderModel* model, FmFileInfo* file)
             g_hash_table_remove(model->items_hash, file);
             /* move the item from visible list to hidden list */
             g_sequence_move(items_it, g_sequence_get_begin_iter(model->hidden));
+            g_hash_table_insert(model->hidden_hash, file, items_it);
             /* tell everybody that we removed the item */
             path = gtk_tree_path_new_from_indices(delete_pos, -1);
             item = (FmFolderItem*)g_sequence_get(items_it);
@@ -1396,33 +1522,31 @@ void fm_folder_model_file_changed(FmFolderModel* model, FmFileInfo* file)
     if(!items_it)
     {
         /* handle this: file was hidden and now is visible */
-        items_it = g_sequence_get_begin_iter(model->hidden);
-        while(!g_sequence_iter_is_end(items_it)) /* iterate over the hidden list */
-        {
-            item = (FmFolderItem*)g_sequence_get(items_it);
-            if (item->inf == file)
-            {
-                /* find a nice position in visible item list to insert the item */
-                GSequenceIter* insert_item_it = g_sequence_search(model->items, item,
-                                                        fm_folder_model_compare, model);
-                it.user_data  = items_it; /* setup the tree iterator */
-                /* move the item from hidden items to visible items list */
-                g_sequence_move(items_it, insert_item_it);
-                g_hash_table_insert(model->items_hash, file, items_it);
-
-                /* tell the world that we inserted it */
-                path = gtk_tree_path_new_from_indices(g_sequence_iter_get_position(items_it), -1);
-                gtk_tree_model_row_inserted(GTK_TREE_MODEL(model), path, &it);
-                gtk_tree_path_free(path);
-                return;
-            }
-            items_it = g_sequence_iter_next(items_it);
-        }
+        GSequenceIter* insert_item_it;
+
+        items_it = g_hash_table_lookup(model->hidden_hash, file);
         /* item found nowhere, shouldn't we crash? */
-        g_return_if_reached();
+        g_return_if_fail(items_it != NULL);
+        item = (FmFolderItem*)g_sequence_get(items_it);
+        fm_folder_item_reset_sort_key(item);
+        /* find a nice position in visible item list to insert the item */
+        insert_item_it = g_sequence_search(model->items, item,
+                                           fm_folder_model_compare, model);
+        it.user_data  = items_it; /* setup the tree iterator */
+        /* move the item from hidden items to visible items list */
+        g_hash_table_remove(model->hidden_hash, file);
+        g_sequence_move(items_it, insert_item_it);
+        g_hash_table_insert(model->items_hash, file, items_it);
+
+        /* tell the world that we inserted it */
+        path = gtk_tree_path_new_from_indices(g_sequence_iter_get_position(items_it), -1);
+        gtk_tree_model_row_inserted(GTK_TREE_MODEL(model), path, &it);
+        gtk_tree_path_free(path);
+        return;
     }
 
     item = (FmFolderItem*)g_sequence_get(items_it);
+    fm_folder_item_reset_sort_key(item);
 
     /* update the icon */
     if( item->icon )
@@ -1543,6 +1667,54 @@ static void on_icon_theme_changed(GtkIconTheme* theme, FmFolderModel* model)
     reload_icons(model, RELOAD_ICONS);
 }
 
+/**
+ * fm_folder_model_set_visible_range
+ * @model: the folder model instance
+ * @start: first visible row
+ * @end: last visible row
+ *
+ * Informs @model which rows are visible in the view now. Thumbnails for
+ * those rows will be loaded before any other pending ones, and loading
+ * of thumbnails for other rows is postponed. Views should call this
+ * after they are scrolled.
+ *
+ * Since: 1.4.1
+ */
+void fm_folder_model_set_visible_range(FmFolderModel* model, GtkTreePath* start,
+                                       GtkTreePath* end)
+{
+    GHashTable* visible;
+    GSequenceIter* seq_it;
+    GList* l;
+    gint i, last;
+
+    g_return_if_fail(FM_IS_FOLDER_MODEL(model));
+    g_return_if_fail(start != NULL && end != NULL);
+
+    if(model->thumbnail_requests == NULL || model->items == NULL)
+        return;
+    i = gtk_tree_path_get_indices(start)[0];
+    last = gtk_tree_path_get_indices(end)[0];
+    visible = g_hash_table_new(g_direct_hash, g_direct_equal);
+    seq_it = g_sequence_get_iter_at_pos(model->items, i);
+    for(; i <= last && !g_sequence_iter_is_end(seq_it); i++)
+    {
+        FmFolderItem* item = (FmFolderItem*)g_sequence_get(seq_it);
+        if(item->thumbnail_loading)
+            g_hash_table_insert(visible, item->inf, item);
+        seq_it = g_sequence_iter_next(seq_it);
+    }
+    for(l = model->thumbnail_requests; l; l = l->next)
+    {
+        FmThumbnailRequest* req = (FmThumbnailRequest*)l->data;
+        if(g_hash_table_lookup(visible, fm_thumbnail_request_get_file_info(req)))
+            fm_thumbnail_loader_raise(req);
+        else
+            fm_thumbnail_loader_lower(req);
+    }
+    g_hash_table_destroy(visible);
+}
+
 /**
  * fm_folder_model_find_iter_by_filename
  * @model: the folder model instance
@@ -1920,9 +2092,13 @@ void fm_folder_model_apply_filters(FmFolderModel* model)
 {
     FmFolderItem* item;
     GSList* items_to_show = NULL;
+    GSList* items_to_hide = NULL;
+    GSList* l;
     GtkTreeIter tree_it;
     GtkTreePath* tree_path;
     GSequenceIter *item_it;
+    guint n_changes = 0;
+    gboolean bulk, quiet;
 
     tree_it.stamp = model->stamp; /* set the stamp of GtkTreeIter */
 
@@ -1937,58 +2113,79 @@ void fm_folder_model_apply_filters(FmFolderModel* model)
              * after we finish hiding some currently visible items for
              * apparent performance reasons. */
             items_to_show = g_slist_prepend(items_to_show, item_it);
+            n_changes++;
         }
         item_it = g_sequence_iter_next(item_it);
     }
 
-    /* move currently visible items to hidden list if they should be hidden */
+    /* find currently visible items which should be hidden, the list is
+       made in reverse order so removing rows doesn't shift the rest */
     item_it = g_sequence_get_begin_iter(model->items);
     while(!g_sequence_iter_is_end(item_it)) /* iterate over currently visible items */
     {
-        GSequenceIter *next_item_it = g_sequence_iter_next(item_it); /* next item */
         item = (FmFolderItem*)g_sequence_get(item_it);
         if(!file_can_show(model, item->inf)) /* it should be hidden */
         {
-            gint delete_pos = g_sequence_iter_get_position(item_it); /* get row index */
-            tree_it.user_data = item_it; /* setup the tree iterator */
-            g_hash_table_remove(model->items_hash, item->inf);
-            /* move the item from visible list to hidden list */
-            g_sequence_move(item_it, g_sequence_get_begin_iter(model->hidden));
-
-            /* tell everybody that we removed the item */
-            tree_path = gtk_tree_path_new_from_indices(delete_pos, -1);
-            g_signal_emit(model, signals[ROW_DELETING], 0, tree_path, &tree_it, item->userdata);
-            gtk_tree_model_row_deleted(GTK_TREE_MODEL(model), tree_path);
-            gtk_tree_path_free(tree_path);
+            items_to_hide = g_slist_prepend(items_to_hide, item_it);
+            n_changes++;
         }
-        item_it = next_item_it;
+        item_it = g_sequence_iter_next(item_it);
+    }
+
+    /* if there are many changes then let views detach for a while */
+    bulk = _fm_folder_model_bulk_begin(model, n_changes, &quiet);
+
+    /* move items to hidden list */
+    for(l = items_to_hide; l; l = l->next)
+    {
+        gint delete_pos = 0;
+        item_it = (GSequenceIter*)l->data; /* this is a iterator from visible list */
+        item = (FmFolderItem*)g_sequence_get(item_it);
+        if(!quiet)
+            delete_pos = g_sequence_iter_get_position(item_it); /* get row index */
+        g_hash_table_remove(model->items_hash, item->inf);
+        /* move the item from visible list to hidden list */
+        g_sequence_move(item_it, g_sequence_get_begin_iter(model->hidden));
+        g_hash_table_insert(model->hidden_hash, item->inf, item_it);
+        if(quiet)
+            continue;
+
+        /* tell everybody that we removed the item */
+        tree_it.user_data = item_it; /* setup the tree iterator */
+        tree_path = gtk_tree_path_new_from_indices(delete_pos, -1);
+        g_signal_emit(model, signals[ROW_DELETING], 0, tree_path, &tree_it, item->userdata);
+        gtk_tree_model_row_deleted(GTK_TREE_MODEL(model), tree_path);
+        gtk_tree_path_free(tree_path);
     }
+    g_slist_free(items_to_hide);
 
     /* show items scheduled for showing */
-    if(items_to_show)
+    for(l = items_to_show; l; l = l->next)
     {
-        GSList* l;
-        for(l = items_to_show; l; l = l->next)
-        {
-            GSequenceIter *insert_item_it;
-            item_it = (GSequenceIter*)l->data; /* this is a iterator from hidden list */
-            item = (FmFolderItem*)g_sequence_get(item_it);
+        GSequenceIter *insert_item_it;
+        item_it = (GSequenceIter*)l->data; /* this is a iterator from hidden list */
+        item = (FmFolderItem*)g_sequence_get(item_it);
 
-            /* find a nice position in visible item list to insert the item */
-            insert_item_it = g_sequence_search(model->items, item,
-                                                          fm_folder_model_compare, model);
-            tree_it.user_data  = item_it; /* setup the tree iterator */
-            /* move the item from hidden items to visible items list */
-            g_sequence_move(item_it, insert_item_it);
-            g_hash_table_insert(model->items_hash, item->inf, item_it); /* add it to has for quick lookup */
-
-            /* tell the world that we insert it */
-            tree_path = gtk_tree_path_new_from_indices(g_sequence_iter_get_position(item_it), -1);
-            gtk_tree_model_row_inserted(GTK_TREE_MODEL(model), tree_path, &tree_it);
-            gtk_tree_path_free(tree_path);
-        }
-        g_slist_free(items_to_show);
+        /* find a nice position in visible item list to insert the item */
+        insert_item_it = g_sequence_search(model->items, item,
+                                           fm_folder_model_compare, model);
+        /* move the item from hidden items to visible items list */
+        g_hash_table_remove(model->hidden_hash, item->inf);
+        g_sequence_move(item_it, insert_item_it);
+        g_hash_table_insert(model->items_hash, item->inf, item_it); /* add it to has for quick lookup */
+        if(quiet)
+            continue;
+
+        /* tell the world that we insert it */
+        tree_it.user_data  = item_it; /* setup the tree iterator */
+        tree_path = gtk_tree_path_new_from_indices(g_sequence_iter_get_position(item_it), -1);
+        gtk_tree_model_row_inserted(GTK_TREE_MODEL(model), tree_path, &tree_it);
+        gtk_tree_path_free(tree_path);
     }
+    g_slist_free(items_to_show);
+
+    if(bulk)
+        _fm_folder_model_bulk_end(model);
     g_signal_emit(model, signals[FILTER_CHANGED], 0);
 }
 
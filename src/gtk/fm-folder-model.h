@@ -112,6 +112,8 @@ typedef struct _FmFolderModelClass FmFolderModelClass;
  * @parent: the parent class
  * @row_deleting: the class closure for the #FmFolderModel::row-deleting signal
  * @filter_changed: the class closure for the #FmFolderModel::filter-changed signal
+ * @rows_replacing: the class closure for the #FmFolderModel::rows-replacing signal
+ * @rows_replaced: the class closure for the #FmFolderModel::rows-replaced signal
  */
 struct _FmFolderModelClass
 {
@@ -119,9 +121,8 @@ struct _FmFolderModelClass
     void (*row_deleting)(FmFolderModel* model, GtkTreePath* tp,
                          GtkTreeIter* iter, gpointer data);
     void (*filter_changed)(FmFolderModel* model);
-    /*< private >*/
-    gpointer _reserved1;
-    gpointer _reserved2;
+    void (*rows_replacing)(FmFolderModel* model);
+    void (*rows_replaced)(FmFolderModel* model);
 };
 
 /**
@@ -161,6 +162,9 @@ void fm_folder_model_file_changed( FmFolderModel* model, FmFileInfo* file);
 
 gboolean fm_folder_model_find_iter_by_filename( FmFolderModel* model, GtkTreeIter* it, const char* name);
 
+void fm_folder_model_set_visible_range(FmFolderModel* model, GtkTreePath* start,
+                                       GtkTreePath* end);
+
 void fm_folder_model_set_icon_size(FmFolderModel* model, guint icon_size);
 guint fm_folder_model_get_icon_size(FmFolderModel* model);
 
@@ -81,6 +81,14 @@ struct _FmStandardView
     FmFileInfoList* cached_selected_files;
     FmPathList* cached_selected_file_paths;
 
+    /* selection saved while model is detached for bulk change */
+    FmFileInfoList* bulk_selected_files;
+    FmFileInfo* bulk_cursor_file; /* item with cursor */
+    FmFileInfo* bulk_top_file; /* first visible item */
+
+    /* to update visible range of model after scrolling */
+    guint visible_range_idle;
+
     /* callbacks to creator */
     FmFolderViewUpdatePopup update_popup;
     FmLaunchFolderFunc open_folders;
@@ -117,6 +125,7 @@ G_DEFINE_TYPE_WITH_CODE(FmStandardView, fm_standard_view, GTK_TYPE_SCROLLED_WIND
                         G_IMPLEMENT_INTERFACE(FM_TYPE_FOLDER_VIEW, fm_standard_view_view_init))
 
 static GList* fm_standard_view_get_selected_tree_paths(FmStandardView* fv);
+static inline FmFileInfoList* fm_standard_view_get_selected_files(FmStandardView* fv);
 
 static gboolean on_standard_view_focus_in(GtkWidget* widget, GdkEventFocus* evt);
 
@@ -205,10 +214,50 @@ static void on_tree_view_row_activated(GtkTreeView* tv, GtkTreePath* path, GtkTr
     fm_folder_view_item_clicked(FM_FOLDER_VIEW(fv), path, FM_FV_ACTIVATED);
 }
 
+static gboolean on_visible_range_idle(gpointer user_data)
+{
+    FmStandardView* fv = (FmStandardView*)user_data;
+    GtkTreePath *start = NULL, *end = NULL;
+    gboolean found;
+
+    /* check if fv is destroyed already */
+    if(g_source_is_destroyed(g_main_current_source()))
+        return FALSE;
+    fv->visible_range_idle = 0;
+    if(!fv->model || !fv->view)
+        return FALSE;
+    if(fv->mode == FM_FV_LIST_VIEW)
+        found = gtk_tree_view_get_visible_range(GTK_TREE_VIEW(fv->view), &start, &end);
+    else
+        found = exo_icon_view_get_visible_range(EXO_ICON_VIEW(fv->view), &start, &end);
+    if(found)
+    {
+        /* load thumbnails for visible items first */
+        fm_folder_model_set_visible_range(fv->model, start, end);
+        gtk_tree_path_free(start);
+        gtk_tree_path_free(end);
+    }
+    return FALSE;
+}
+
+static void on_adjustment_value_changed(GtkAdjustment* adj, FmStandardView* fv)
+{
+    /* do it after redraw so newly visible items have thumbnails requested */
+    if(!fv->visible_range_idle)
+        fv->visible_range_idle = gdk_threads_add_idle_full(G_PRIORITY_LOW,
+                                                           on_visible_range_idle,
+                                                           fv, NULL);
+}
+
 static void fm_standard_view_init(FmStandardView *self)
 {
     gtk_scrolled_window_set_hadjustment((GtkScrolledWindow*)self, NULL);
     gtk_scrolled_window_set_vadjustment((GtkScrolledWindow*)self, NULL);
+    /* compact view is scrolled horizontally */
+    g_signal_connect(gtk_scrolled_window_get_hadjustment((GtkScrolledWindow*)self),
+                     "value-changed", G_CALLBACK(on_adjustment_value_changed), self);
+    g_signal_connect(gtk_scrolled_window_get_vadjustment((GtkScrolledWindow*)self),
+                     "value-changed", G_CALLBACK(on_adjustment_value_changed), self);
     gtk_scrolled_window_set_policy((GtkScrolledWindow*)self, GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
 
     /* config change notifications */
@@ -304,6 +353,129 @@ static void on_row_inserted(GtkTreeModel *tree_model, GtkTreePath *path,
         _reset_columns_widths(GTK_TREE_VIEW(fv->view));
 }
 
+/* returns referenced file info or NULL, frees tp */
+static FmFileInfo* _bulk_get_file(FmStandardView* fv, GtkTreePath* tp)
+{
+    GtkTreeIter it;
+    FmFileInfo* fi = NULL;
+
+    if(tp == NULL)
+        return NULL;
+    if(gtk_tree_model_get_iter(GTK_TREE_MODEL(fv->model), &it, tp))
+        gtk_tree_model_get(GTK_TREE_MODEL(fv->model), &it, FM_FOLDER_MODEL_COL_INFO, &fi, -1);
+    gtk_tree_path_free(tp);
+    return fi ? fm_file_info_ref(fi) : NULL;
+}
+
+/* returns new path of file or NULL, unrefs fi */
+static GtkTreePath* _bulk_get_path(FmStandardView* fv, FmFileInfo* fi)
+{
+    GtkTreeIter it;
+    GtkTreePath* tp = NULL;
+
+    if(fi == NULL)
+        return NULL;
+    if(fm_folder_model_find_iter_by_filename(fv->model, &it, fm_file_info_get_name(fi)))
+        tp = gtk_tree_model_get_path(GTK_TREE_MODEL(fv->model), &it);
+    fm_file_info_unref(fi);
+    return tp;
+}
+
+static void on_rows_replacing(FmFolderModel* model, FmStandardView* fv)
+{
+    FmFileInfoList* files = fm_standard_view_get_selected_files(fv);
+    GtkTreePath *cursor = NULL, *top = NULL;
+
+    /* remember selection since paths will be invalid after change */
+    if(files)
+        fv->bulk_selected_files = fm_file_info_list_ref(files);
+    /* and also cursor and scrolled position */
+    if(fv->mode == FM_FV_LIST_VIEW)
+    {
+        gtk_tree_view_get_cursor(GTK_TREE_VIEW(fv->view), &cursor, NULL);
+        gtk_tree_view_get_visible_range(GTK_TREE_VIEW(fv->view), &top, NULL);
+    }
+    else
+    {
+        exo_icon_view_get_cursor(EXO_ICON_VIEW(fv->view), &cursor, NULL);
+        exo_icon_view_get_visible_range(EXO_ICON_VIEW(fv->view), &top, NULL);
+    }
+    fv->bulk_cursor_file = _bulk_get_file(fv, cursor);
+    fv->bulk_top_file = _bulk_get_file(fv, top);
+    /* detach the model so the widget will not handle each row change */
+    g_signal_handlers_block_by_func(model, on_row_inserted, fv);
+    g_signal_handlers_block_by_func(model, on_row_deleted, fv);
+    if(fv->mode == FM_FV_LIST_VIEW)
+        gtk_tree_view_set_model(GTK_TREE_VIEW(fv->view), NULL);
+    else
+        exo_icon_view_set_model(EXO_ICON_VIEW(fv->view), NULL);
+}
+
+static void on_rows_replaced(FmFolderModel* model, FmStandardView* fv)
+{
+    GtkTreeIter it;
+    GtkTreePath *cursor, *top;
+
+    if(fv->mode == FM_FV_LIST_VIEW)
+    {
+        gtk_tree_view_set_model(GTK_TREE_VIEW(fv->view), GTK_TREE_MODEL(model));
+        _reset_columns_widths(GTK_TREE_VIEW(fv->view));
+    }
+    else
+        exo_icon_view_set_model(EXO_ICON_VIEW(fv->view), GTK_TREE_MODEL(model));
+    g_signal_handlers_unblock_by_func(model, on_row_inserted, fv);
+    g_signal_handlers_unblock_by_func(model, on_row_deleted, fv);
+    /* setting cursor selects the item so do it before restoring selection */
+    cursor = _bulk_get_path(fv, fv->bulk_cursor_file);
+    top = _bulk_get_path(fv, fv->bulk_top_file);
+    fv->bulk_cursor_file = fv->bulk_top_file = NULL;
+    if(fv->mode == FM_FV_LIST_VIEW)
+    {
+        if(cursor)
+            gtk_tree_view_set_cursor(GTK_TREE_VIEW(fv->view), cursor, NULL, FALSE);
+        if(top)
+            gtk_tree_view_scroll_to_cell(GTK_TREE_VIEW(fv->view), top, NULL, TRUE, 0.0, 0.0);
+    }
+    else
+    {
+        if(cursor)
+            exo_icon_view_set_cursor(EXO_ICON_VIEW(fv->view), cursor, NULL, FALSE);
+        if(top)
+            exo_icon_view_scroll_to_path(EXO_ICON_VIEW(fv->view), top, TRUE, 0.0, 0.0);
+    }
+    if(cursor)
+    {
+        fv->unselect_all(fv->view);
+        gtk_tree_path_free(cursor);
+    }
+    if(top)
+        gtk_tree_path_free(top);
+    if(fv->bulk_selected_files)
+    {
+        /* restore selection in one pass over the model */
+        if(fv->select_path && gtk_tree_model_get_iter_first(GTK_TREE_MODEL(model), &it))
+        {
+            GHashTable* sels = g_hash_table_new(g_direct_hash, g_direct_equal);
+            GList* l;
+            for(l = fm_file_info_list_peek_head_link(fv->bulk_selected_files); l; l = l->next)
+                g_hash_table_insert(sels, l->data, l->data);
+            do
+            {
+                FmFileInfo* fi;
+                gtk_tree_model_get(GTK_TREE_MODEL(model), &it, FM_FOLDER_MODEL_COL_INFO, &fi, -1);
+                if(g_hash_table_lookup(sels, fi))
+                    fv->select_path(model, fv->view, &it);
+            }
+            while(gtk_tree_model_iter_next(GTK_TREE_MODEL(model), &it));
+            g_hash_table_destroy(sels);
+        }
+        fm_file_info_list_unref(fv->bulk_selected_files);
+        fv->bulk_selected_files = NULL;
+    }
+    /* reset tooltip - it may stick if mouse-over item was removed */
+    g_object_set(G_OBJECT(fv->view), "tooltip-text", NULL, NULL);
+}
+
 static void unset_model(FmStandardView* fv)
 {
     if(fv->model)
@@ -314,6 +486,8 @@ static void unset_model(FmStandardView* fv)
         g_signal_handlers_disconnect_by_func(model, on_row_inserted, fv);
         g_signal_handlers_disconnect_by_func(model, on_row_deleted, fv);
         g_signal_handlers_disconnect_by_func(model, on_row_changed, fv);
+        g_signal_handlers_disconnect_by_func(model, on_rows_replacing, fv);
+        g_signal_handlers_disconnect_by_func(model, on_rows_replaced, fv);
         fv->model = NULL;
     }
 }
@@ -356,6 +530,23 @@ static void fm_standard_view_dispose(GObject *object)
         self->cached_selected_file_paths = NULL;
     }
 
+    /* destroyed while model was detached for bulk change */
+    if(self->bulk_selected_files)
+    {
+        fm_file_info_list_unref(self->bulk_selected_files);
+        self->bulk_selected_files = NULL;
+    }
+    if(self->bulk_cursor_file)
+    {
+        fm_file_info_unref(self->bulk_cursor_file);
+        self->bulk_cursor_file = NULL;
+    }
+    if(self->bulk_top_file)
+    {
+        fm_file_info_unref(self->bulk_top_file);
+        self->bulk_top_file = NULL;
+    }
+
     if(self->dnd_src)
     {
         g_signal_handlers_disconnect_by_func(self->dnd_src, on_dnd_src_data_get, self);
@@ -378,6 +569,18 @@ static void fm_standard_view_dispose(GObject *object)
         self->sel_changed_idle = 0;
     }
 
+    if(self->visible_range_idle)
+    {
+        g_source_remove(self->visible_range_idle);
+        self->visible_range_idle = 0;
+    }
+    if(gtk_scrolled_window_get_hadjustment((GtkScrolledWindow*)self))
+        g_signal_handlers_disconnect_by_func(gtk_scrolled_window_get_hadjustment((GtkScrolledWindow*)self),
+                                             on_adjustment_value_changed, self);
+    if(gtk_scrolled_window_get_vadjustment((GtkScrolledWindow*)self))
+        g_signal_handlers_disconnect_by_func(gtk_scrolled_window_get_vadjustment((GtkScrolledWindow*)self),
+                                             on_adjustment_value_changed, self);
+
     if(self->icon_size_changed_handler)
     {
         g_signal_handler_disconnect(fm_config, self->icon_size_changed_handler);
@@ -1683,6 +1886,8 @@ static void fm_standard_view_set_model(FmFolderView* ffv, FmFolderModel* model)
         g_signal_connect(model, "row-inserted", G_CALLBACK(on_row_inserted), fv);
         g_signal_connect(model, "row-deleted", G_CALLBACK(on_row_deleted), fv);
         g_signal_connect(model, "row-changed", G_CALLBACK(on_row_changed), fv);
+        g_signal_connect(model, "rows-replacing", G_CALLBACK(on_rows_replacing), fv);
+        g_signal_connect(model, "rows-replaced", G_CALLBACK(on_rows_replaced), fv);
     }
     else
         fv->model = NULL;
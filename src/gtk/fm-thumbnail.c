@@ -147,6 +147,20 @@ static GObject* read_image_from_file(const char* filename) {
     return (GObject*)gdk_pixbuf_new_from_file(filename, NULL);
 }
 
+static GObject* read_image_from_file_at_size(const char* filename, int size,
+                                            int* width, int* height)
+{
+    if (!gdk_pixbuf_get_file_info(filename, width, height))
+        return NULL;
+    if (fm_config->thumbnail_max > 0 &&
+        *width * *height > (fm_config->thumbnail_max << 10))
+        return NULL; /* see read_image_from_file() */
+    if (*width <= size && *height <= size) /* don't scale up */
+        return (GObject*)gdk_pixbuf_new_from_file(filename, NULL);
+    /* let the loader decode it scaled, e.g. JPEG loader uses DCT scaling */
+    return (GObject*)gdk_pixbuf_new_from_file_at_size(filename, size, size, NULL);
+}
+
 static GObject* read_image_from_stream(GInputStream* stream, guint64 len, GCancellable* cancellable)
 {
     return (GObject*)gdk_pixbuf_new_from_stream(stream, cancellable, NULL);
@@ -230,6 +244,7 @@ void _fm_thumbnail_init()
 {
     if(!fm_thumbnail_loader_set_backend(&gtk_backend))
         g_error("failed to set backend for thumbnail loader");
+    fm_thumbnail_loader_set_read_at_size_func(read_image_from_file_at_size);
 }
 
 void _fm_thumbnail_finalize(void)
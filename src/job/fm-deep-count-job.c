@@ -35,16 +35,24 @@
  * files to move between volumes will be counted as well.
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include "fm-deep-count-job.h"
+#include "fm-stat-batch.h"
 #include <glib/gstdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
 
 static void fm_deep_count_job_dispose              (GObject *object);
 G_DEFINE_TYPE(FmDeepCountJob, fm_deep_count_job, FM_TYPE_JOB);
 
 static gboolean fm_deep_count_job_run(FmJob* job);
 
-static gboolean deep_count_posix(FmDeepCountJob* job, const char* path);
+static gboolean deep_count_posix(FmDeepCountJob* job, const char* path,
+                                 const struct stat *pst);
 static gboolean deep_count_gio(FmDeepCountJob* job, GFileInfo* inf, GFile* gf);
 
 static const char query_str[] =
@@ -122,7 +130,7 @@ static gboolean fm_deep_count_job_run(FmJob* job)
         if(fm_path_is_native(path)) /* if it's a native file, use posix APIs */
         {
             char *path_str = fm_path_to_str(path);
-            deep_count_posix( dc, path_str );
+            deep_count_posix( dc, path_str, NULL );
             g_free(path_str);
         }
         else
@@ -135,86 +143,159 @@ static gboolean fm_deep_count_job_run(FmJob* job)
     return TRUE;
 }
 
-static gboolean deep_count_posix(FmDeepCountJob* job, const char *path)
+#ifdef HAVE_FSTATAT
+#define DEEP_COUNT_BATCH_SIZE 64
+
+/* count directory content, stat() of entries is done in batches */
+static void deep_count_posix_dir(FmDeepCountJob* job, const char *path)
 {
     FmJob* fmjob = FM_JOB(job);
-    struct stat st;
-    int ret;
-
-_retry_stat:
-    if( G_UNLIKELY(job->flags & FM_DC_JOB_FOLLOW_LINKS) )
-        ret = stat(path, &st);
-    else
-        ret = lstat(path, &st);
-
-    if( ret == 0 )
+    /* it's recursive so keep the batch off the stack, trees may be deep */
+    FmStatBatchEntry *entries;
+    gboolean eof = FALSE;
+    struct dirent *de;
+    DIR *dir;
+    guint i, n;
+
+    dir = opendir(path);
+    if (!dir)
+        return;
+    entries = g_new(FmStatBatchEntry, DEEP_COUNT_BATCH_SIZE);
+    while (!eof && !fm_job_is_cancelled(fmjob))
     {
-        ++job->count;
-        /* SF bug #892: dir file size is not relevant in the summary */
-        if (!S_ISDIR(st.st_mode))
-            job->total_size += (goffset)st.st_size;
-        job->total_ondisk_size += (st.st_blocks * 512);
-
-        /* NOTE: if job->dest_dev is 0, that means our destination
-         * folder is not on native UNIX filesystem. Hence it's not
-         * on the same device. Our st.st_dev will always be non-zero
-         * since our file is on a native UNIX filesystem. */
-
-        /* only descends into files on the same filesystem */
-        if( job->flags & FM_DC_JOB_SAME_FS )
+        for (n = 0; n < DEEP_COUNT_BATCH_SIZE; )
         {
-            if( st.st_dev != job->dest_dev )
-                return TRUE;
+            const char *basename;
+
+            de = readdir(dir);
+            if (de == NULL)
+            {
+                eof = TRUE;
+                break;
+            }
+            basename = de->d_name;
+            if (basename[0] == '.' && (basename[1] == '\0' ||
+                                       (basename[1] == '.' && basename[2] == '\0')))
+                continue;
+            entries[n].name = g_strdup(basename);
+            n++;
         }
-        /* only descends into files on the different filesystem */
-        else if( job->flags & FM_DC_JOB_PREPARE_MOVE )
+        _fm_stat_batch(dirfd(dir), entries, n,
+                       (job->flags & FM_DC_JOB_FOLLOW_LINKS) != 0);
+        for (i = 0; i < n; i++)
         {
-            if( st.st_dev == job->dest_dev )
-                return TRUE;
+            char *sub = g_build_filename(path, entries[i].name, NULL);
+            if(!fm_job_is_cancelled(fmjob))
+            {
+                /* on error let deep_count_posix() retry and report it */
+                if(deep_count_posix(job, sub, entries[i].error ? NULL : &entries[i].st))
+                {
+                    /* for moving across different devices, an additional 'delete'
+                     * for source file is needed. so let's +1 for the delete.*/
+                    if(job->flags & FM_DC_JOB_PREPARE_MOVE)
+                    {
+                        ++job->total_size;
+                        ++job->total_ondisk_size;
+                        ++job->count;
+                    }
+                }
+            }
+            g_free(sub);
+            g_free((char*)entries[i].name);
         }
     }
-    else
-    {
-        GError* err = g_error_new(G_IO_ERROR, g_io_error_from_errno(errno), "%s", g_strerror(errno));
-        FmJobErrorAction act = fm_job_emit_error(fmjob, err, FM_JOB_ERROR_MILD);
-        g_error_free(err);
-        err = NULL;
-        if(act == FM_JOB_RETRY)
-            goto _retry_stat;
-        return FALSE;
-    }
-    if(fm_job_is_cancelled(fmjob))
-        return FALSE;
-
-    if( S_ISDIR(st.st_mode) ) /* if it's a dir */
+    g_free(entries);
+    closedir(dir);
+}
+#else
+static void deep_count_posix_dir(FmDeepCountJob* job, const char *path)
+{
+    FmJob* fmjob = FM_JOB(job);
+    GDir* dir_ent = g_dir_open(path, 0, NULL);
+    if(dir_ent)
     {
-        GDir* dir_ent = g_dir_open(path, 0, NULL);
-        if(dir_ent)
+        const char* basename;
+        while( !fm_job_is_cancelled(fmjob)
+            && (basename = g_dir_read_name(dir_ent)) )
         {
-            const char* basename;
-            while( !fm_job_is_cancelled(fmjob)
-                && (basename = g_dir_read_name(dir_ent)) )
+            char *sub = g_build_filename(path, basename, NULL);
+            if(!fm_job_is_cancelled(fmjob))
             {
-                char *sub = g_build_filename(path, basename, NULL);
-                if(!fm_job_is_cancelled(fmjob))
+                if(deep_count_posix(job, sub, NULL))
                 {
-                    if(deep_count_posix(job, sub))
+                    /* for moving across different devices, an additional 'delete'
+                     * for source file is needed. so let's +1 for the delete.*/
+                    if(job->flags & FM_DC_JOB_PREPARE_MOVE)
                     {
-                        /* for moving across different devices, an additional 'delete'
-                         * for source file is needed. so let's +1 for the delete.*/
-                        if(job->flags & FM_DC_JOB_PREPARE_MOVE)
-                        {
-                            ++job->total_size;
-                            ++job->total_ondisk_size;
-                            ++job->count;
-                        }
+                        ++job->total_size;
+                        ++job->total_ondisk_size;
+                        ++job->count;
                     }
                 }
-                g_free(sub);
             }
-            g_dir_close(dir_ent);
+            g_free(sub);
+        }
+        g_dir_close(dir_ent);
+    }
+}
+#endif /* HAVE_FSTATAT */
+
+static gboolean deep_count_posix(FmDeepCountJob* job, const char *path,
+                                 const struct stat *pst)
+{
+    FmJob* fmjob = FM_JOB(job);
+    struct stat st;
+    int ret;
+
+    if (pst)
+        st = *pst;
+    else
+    {
+_retry_stat:
+        if( G_UNLIKELY(job->flags & FM_DC_JOB_FOLLOW_LINKS) )
+            ret = stat(path, &st);
+        else
+            ret = lstat(path, &st);
+        if (ret < 0)
+        {
+            GError* err = g_error_new(G_IO_ERROR, g_io_error_from_errno(errno), "%s", g_strerror(errno));
+            FmJobErrorAction act = fm_job_emit_error(fmjob, err, FM_JOB_ERROR_MILD);
+            g_error_free(err);
+            err = NULL;
+            if(act == FM_JOB_RETRY)
+                goto _retry_stat;
+            return FALSE;
         }
     }
+
+    ++job->count;
+    /* SF bug #892: dir file size is not relevant in the summary */
+    if (!S_ISDIR(st.st_mode))
+        job->total_size += (goffset)st.st_size;
+    job->total_ondisk_size += (st.st_blocks * 512);
+
+    /* NOTE: if job->dest_dev is 0, that means our destination
+     * folder is not on native UNIX filesystem. Hence it's not
+     * on the same device. Our st.st_dev will always be non-zero
+     * since our file is on a native UNIX filesystem. */
+
+    /* only descends into files on the same filesystem */
+    if( job->flags & FM_DC_JOB_SAME_FS )
+    {
+        if( st.st_dev != job->dest_dev )
+            return TRUE;
+    }
+    /* only descends into files on the different filesystem */
+    else if( job->flags & FM_DC_JOB_PREPARE_MOVE )
+    {
+        if( st.st_dev == job->dest_dev )
+            return TRUE;
+    }
+    if(fm_job_is_cancelled(fmjob))
+        return FALSE;
+
+    if( S_ISDIR(st.st_mode) ) /* if it's a dir */
+        deep_count_posix_dir(job, path);
     return TRUE;
 }
 
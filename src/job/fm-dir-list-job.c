@@ -40,9 +40,14 @@
 #include <glib/gi18n-lib.h>
 #include <gio/gio.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <glib/gstdio.h>
 #include "fm-mime-type.h"
 #include "fm-file-info-job.h"
+#include "fm-file-info-private.h"
+#include "fm-stat-batch.h"
 #include "glib-compat.h"
 
 #include "fm-file-info.h"
@@ -219,42 +224,322 @@ static inline FmFileInfo *_new_info_for_native_file(FmDirListJob* job, FmPath* p
     return NULL;
 }
 
-static gboolean fm_dir_list_job_run_posix(FmDirListJob* job)
+/* called when retrieving info for the file failed, frees @err */
+static FmFileInfo *_new_info_for_damaged_file(FmDirListJob *job, FmPath *path,
+                                              const char *name,
+                                              const char *path_str, GError *err)
 {
-    FmJob* fmjob = FM_JOB(job);
-    FmFileInfo* fi;
-    GError *err = NULL;
-    char* path_str;
-    GDir* dir;
+    FmJob *fmjob = FM_JOB(job);
+    FmFileInfo *fi;
+    GFile *gf;
+    GFileInfo *inf;
+    gchar *disp_basename;
 
-    path_str = fm_path_to_str(job->dir_path);
+    do
+    {
+        FmJobErrorAction act = fm_job_emit_error(fmjob, err, FM_JOB_ERROR_MILD);
 
-    fi = _new_info_for_native_file(job, job->dir_path, path_str, NULL);
-    if(fi)
+        g_error_free(err);
+        err = NULL;
+        if(act != FM_JOB_RETRY)
+            break;
+        fi = _new_info_for_native_file(job, path, path_str, &err);
+        if (fi != NULL || fm_job_is_cancelled(fmjob))
+        {
+            if (err)
+                g_error_free(err);
+            return fi;
+        }
+    } while (err != NULL);
+    if (fm_job_is_cancelled(fmjob))
+        return NULL;
+    /* bug #3615271: Damaged mountpoint isn't shown
+       let make a simple file info then */
+    inf = g_file_info_new();
+    gf = fm_path_to_gfile(path);
+    g_file_info_set_file_type(inf, G_FILE_TYPE_UNKNOWN);
+    g_file_info_set_name(inf, name);
+    disp_basename = g_filename_display_basename(path_str);
+    g_file_info_set_display_name(inf, disp_basename);
+    g_free(disp_basename);
+    g_file_info_set_content_type(inf, "inode/x-corrupted");
+    fi = fm_file_info_new_from_g_file_data(gf, inf, path);
+    g_object_unref(inf);
+    g_object_unref(gf);
+    return fi;
+}
+
+#if defined(HAVE_FSTATAT) && defined(HAVE_FDOPENDIR)
+/* Parallel listing of native directory.
+ * The job thread reads entries from the directory and splits them into
+ * batches which are handled by a small pool of worker threads. Workers stat
+ * whole batch relative to the open directory descriptor (using io_uring if
+ * it is available) and create file info for each entry so many I/O
+ * requests may be in flight at once, that makes big difference on network
+ * file systems and rotating disks. Handled batches are returned back to
+ * the job thread in any order and are added to the listing from there so
+ * files-found emission is not changed. */
+
+#define DIR_LIST_BATCH_SIZE     64 /* entries per batch */
+#define DIR_LIST_MAX_WORKERS    8 /* more doesn't help even on NFS */
+#define DIR_LIST_BATCHES_QUEUED 4 /* per worker, limits memory usage */
+
+typedef struct
+{
+    FmDirListJob *job;
+    int dir_fd;
+    const char *dir_str; /* directory path, ends with '/' */
+    gsize dir_len;
+    GAsyncQueue *done; /* handled batches */
+} FmDirListContext;
+
+typedef struct
+{
+    guint n_names;
+    char *names[DIR_LIST_BATCH_SIZE];
+    GSList *found; /* FmFileInfo */
+    GSList *failed; /* FmDirListFailure */
+} FmDirListBatch;
+
+typedef struct
+{
+    FmPath *path;
+    GError *err;
+} FmDirListFailure;
+
+static guint _dir_list_n_workers(void)
+{
+#if GLIB_CHECK_VERSION(2, 36, 0)
+    return CLAMP(g_get_num_processors(), 2, DIR_LIST_MAX_WORKERS);
+#else
+    return 4;
+#endif
+}
+
+/* this is called from worker thread */
+static void _dir_list_worker(gpointer data, gpointer user_data)
+{
+    FmDirListBatch *batch = data;
+    FmDirListContext *ctx = user_data;
+    FmDirListJob *job = ctx->job;
+    GString *fpath;
+    gboolean get_fast = !(job->flags & FM_DIR_LIST_JOB_DETAILED);
+    FmStatBatchEntry entries[DIR_LIST_BATCH_SIZE];
+    struct stat st;
+    guint i;
+
+    if (fm_job_is_cancelled(FM_JOB(job)))
     {
-        if(! fm_file_info_is_dir(fi))
+        g_async_queue_push(ctx->done, batch);
+        return;
+    }
+    /* get all lstat() data at once, that may be done asynchronously */
+    for (i = 0; i < batch->n_names; i++)
+        entries[i].name = batch->names[i];
+    _fm_stat_batch(ctx->dir_fd, entries, batch->n_names, FALSE);
+    fpath = g_string_sized_new(ctx->dir_len + 256);
+    g_string_append_len(fpath, ctx->dir_str, ctx->dir_len);
+    for (i = 0; i < batch->n_names; i++)
+    {
+        const char *name = batch->names[i];
+        const struct stat *lst = &entries[i].st;
+        const struct stat *tst;
+        FmPath *path;
+        FmFileInfo *fi;
+
+        if (fm_job_is_cancelled(FM_JOB(job)))
+            break;
+        if (entries[i].error != 0)
         {
-            err = g_error_new(G_IO_ERROR, G_IO_ERROR_NOT_DIRECTORY,
-                              _("The specified directory '%s' is not valid"),
-                              path_str);
-            fm_file_info_unref(fi);
-            fm_job_emit_error(fmjob, err, FM_JOB_ERROR_CRITICAL);
-            g_error_free(err);
+            FmDirListFailure *failure;
+            int errsv = entries[i].error;
+
+            if (job->flags & FM_DIR_LIST_JOB_DIR_ONLY)
+                continue;
+            failure = g_slice_new(FmDirListFailure);
+            failure->path = fm_path_new_child(job->dir_path, name);
+            g_string_truncate(fpath, ctx->dir_len);
+            g_string_append(fpath, name);
+            failure->err = g_error_new(G_IO_ERROR, g_io_error_from_errno(errsv),
+                                       "%s: %s", fpath->str, g_strerror(errsv));
+            batch->failed = g_slist_prepend(batch->failed, failure);
+            continue;
+        }
+        if (!S_ISLNK(lst->st_mode))
+            tst = lst;
+        else if (fstatat(ctx->dir_fd, name, &st, 0) == 0)
+            tst = &st;
+        else
+            tst = NULL;
+        if ((job->flags & FM_DIR_LIST_JOB_DIR_ONLY) && (!tst || !S_ISDIR(tst->st_mode)))
+            continue;
+        g_string_truncate(fpath, ctx->dir_len);
+        g_string_append(fpath, name);
+        path = fm_path_new_child(job->dir_path, name);
+        fi = fm_file_info_new();
+        fm_file_info_set_path(fi, path);
+        _fm_file_info_set_from_native_stat(fi, fpath->str, lst, tst, get_fast);
+        batch->found = g_slist_prepend(batch->found, fi);
+        fm_path_unref(path);
+    }
+    g_string_free(fpath, TRUE);
+    g_async_queue_push(ctx->done, batch);
+}
+
+/* adds results from batch into the list and frees it */
+static void _dir_list_batch_finish(FmDirListContext *ctx, FmDirListBatch *batch)
+{
+    FmDirListJob *job = ctx->job;
+    FmJob *fmjob = FM_JOB(job);
+    GSList *l;
+    guint i;
+
+    batch->found = g_slist_reverse(batch->found);
+    for (l = batch->found; l; l = l->next)
+    {
+        fm_dir_list_job_add_found_file(job, l->data);
+        fm_file_info_unref(l->data);
+    }
+    g_slist_free(batch->found);
+    for (l = batch->failed; l; l = l->next)
+    {
+        FmDirListFailure *failure = l->data;
+        const char *name = fm_path_get_basename(failure->path);
+
+        if (!fm_job_is_cancelled(fmjob)) /* we got a damaged file */
+        {
+            char *path_str = g_strconcat(ctx->dir_str, name, NULL);
+            FmFileInfo *fi = _new_info_for_damaged_file(job, failure->path, name,
+                                                        path_str, failure->err);
+            if (fi)
+            {
+                fm_dir_list_job_add_found_file(job, fi);
+                fm_file_info_unref(fi);
+            }
             g_free(path_str);
-            return FALSE;
         }
-        job->dir_fi = fi;
+        else
+            g_error_free(failure->err);
+        fm_path_unref(failure->path);
+        g_slice_free(FmDirListFailure, failure);
+    }
+    g_slist_free(batch->failed);
+    for (i = 0; i < batch->n_names; i++)
+        g_free(batch->names[i]);
+    g_slice_free(FmDirListBatch, batch);
+}
+
+static void _list_native_dir(FmDirListJob* job, const char *path_str)
+{
+    FmJob* fmjob = FM_JOB(job);
+    FmDirListContext ctx;
+    FmDirListBatch *batch = NULL, *done;
+    GThreadPool *pool;
+    GError *err = NULL;
+    struct dirent *de;
+    DIR *dir;
+    guint n_workers, n_queued = 0;
+    int fd, read_errno = 0;
+
+    fd = open(path_str, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || (dir = fdopendir(fd)) == NULL)
+    {
+        int errsv = errno;
+
+        if (fd >= 0)
+            close(fd);
+        err = g_error_new(G_FILE_ERROR, g_file_error_from_errno(errsv),
+                          _("Error opening directory '%s': %s"),
+                          path_str, g_strerror(errsv));
+        fm_job_emit_error(fmjob, err, FM_JOB_ERROR_CRITICAL);
+        g_error_free(err);
+        return;
     }
+    n_workers = _dir_list_n_workers();
+    ctx.job = job;
+    ctx.dir_fd = fd;
+    ctx.dir_len = strlen(path_str);
+    if (ctx.dir_len > 0 && path_str[ctx.dir_len-1] == '/')
+        ctx.dir_str = g_strdup(path_str);
     else
     {
-        err = g_error_new(G_IO_ERROR, G_IO_ERROR_NOT_DIRECTORY,
-                          _("The specified directory '%s' is not valid"),
-                          path_str);
+        ctx.dir_str = g_strconcat(path_str, "/", NULL);
+        ctx.dir_len++;
+    }
+    ctx.done = g_async_queue_new();
+    pool = g_thread_pool_new(_dir_list_worker, &ctx, n_workers, FALSE, NULL);
+
+    while (!fm_job_is_cancelled(fmjob))
+    {
+        const char *name;
+
+        errno = 0;
+        if ((de = readdir(dir)) == NULL)
+        {
+            read_errno = errno; /* it's 0 at end of directory */
+            break;
+        }
+        name = de->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+#ifdef _DIRENT_HAVE_D_TYPE
+        /* skip obvious non-directories without stat() call */
+        if ((job->flags & FM_DIR_LIST_JOB_DIR_ONLY) && de->d_type != DT_UNKNOWN
+            && de->d_type != DT_DIR && de->d_type != DT_LNK)
+            continue;
+#endif
+        if (batch == NULL)
+            batch = g_slice_new0(FmDirListBatch);
+        batch->names[batch->n_names++] = g_strdup(name);
+        if (batch->n_names < DIR_LIST_BATCH_SIZE)
+            continue;
+        g_thread_pool_push(pool, batch, NULL);
+        batch = NULL;
+        /* don't let the reader run too far ahead of workers */
+        if (++n_queued >= n_workers * DIR_LIST_BATCHES_QUEUED)
+        {
+            _dir_list_batch_finish(&ctx, g_async_queue_pop(ctx.done));
+            n_queued--;
+        }
+        /* add results as soon as they arrive */
+        while (n_queued > 0 && (done = g_async_queue_try_pop(ctx.done)) != NULL)
+        {
+            _dir_list_batch_finish(&ctx, done);
+            n_queued--;
+        }
+    }
+    if (batch)
+    {
+        g_thread_pool_push(pool, batch, NULL);
+        n_queued++;
+    }
+    /* cancelled workers return batches early so this never stalls */
+    while (n_queued > 0)
+    {
+        _dir_list_batch_finish(&ctx, g_async_queue_pop(ctx.done));
+        n_queued--;
+    }
+    /* don't report a listing which was cut short as complete */
+    if (read_errno != 0 && !fm_job_is_cancelled(fmjob))
+    {
+        err = g_error_new(G_FILE_ERROR, g_file_error_from_errno(read_errno),
+                          _("Error reading directory '%s': %s"),
+                          path_str, g_strerror(read_errno));
         fm_job_emit_error(fmjob, err, FM_JOB_ERROR_CRITICAL);
         g_error_free(err);
-        g_free(path_str);
-        return FALSE;
     }
+    g_thread_pool_free(pool, FALSE, TRUE);
+    g_async_queue_unref(ctx.done);
+    g_free((char*)ctx.dir_str);
+    closedir(dir); /* closes fd too */
+}
+#else /* !(HAVE_FSTATAT && HAVE_FDOPENDIR) */
+static void _list_native_dir(FmDirListJob* job, const char *path_str)
+{
+    FmJob* fmjob = FM_JOB(job);
+    FmFileInfo* fi;
+    GError *err = NULL;
+    GDir* dir;
 
     dir = g_dir_open(path_str, 0, &err);
     if( dir )
@@ -284,35 +569,17 @@ static gboolean fm_dir_list_job_run_posix(FmDirListJob* job)
 
             new_path = fm_path_new_child(job->dir_path, name);
 
-        _retry:
             fi = _new_info_for_native_file(job, new_path, fpath->str, &err);
             if (fi == NULL && !fm_job_is_cancelled(fmjob)) /* we got a damaged file */
-            {
-                FmJobErrorAction act = fm_job_emit_error(fmjob, err, FM_JOB_ERROR_MILD);
-                GFile *gf;
-                GFileInfo *inf;
-                gchar *disp_basename;
-
+                fi = _new_info_for_damaged_file(job, new_path, name, fpath->str, err);
+            else if (err)
                 g_error_free(err);
-                err = NULL;
-                if(act == FM_JOB_RETRY)
-                    goto _retry;
-                /* bug #3615271: Damaged mountpoint isn't shown
-                   let make a simple file info then */
-                inf = g_file_info_new();
-                gf = fm_path_to_gfile(new_path);
-                g_file_info_set_file_type(inf, G_FILE_TYPE_UNKNOWN);
-                g_file_info_set_name(inf, name);
-                disp_basename = g_filename_display_basename(fpath->str);
-                g_file_info_set_display_name(inf, disp_basename);
-                g_free(disp_basename);
-                g_file_info_set_content_type(inf, "inode/x-corrupted");
-                fi = fm_file_info_new_from_g_file_data(gf, inf, new_path);
-                g_object_unref(inf);
-                g_object_unref(gf);
+            err = NULL;
+            if (fi)
+            {
+                fm_dir_list_job_add_found_file(job, fi);
+                fm_file_info_unref(fi);
             }
-            fm_dir_list_job_add_found_file(job, fi);
-            fm_file_info_unref(fi);
             fm_path_unref(new_path);
         }
         g_string_free(fpath, TRUE);
@@ -323,6 +590,46 @@ static gboolean fm_dir_list_job_run_posix(FmDirListJob* job)
         fm_job_emit_error(fmjob, err, FM_JOB_ERROR_CRITICAL);
         g_error_free(err);
     }
+}
+#endif /* HAVE_FSTATAT && HAVE_FDOPENDIR */
+
+static gboolean fm_dir_list_job_run_posix(FmDirListJob* job)
+{
+    FmJob* fmjob = FM_JOB(job);
+    FmFileInfo* fi;
+    GError *err = NULL;
+    char* path_str;
+
+    path_str = fm_path_to_str(job->dir_path);
+
+    fi = _new_info_for_native_file(job, job->dir_path, path_str, NULL);
+    if(fi)
+    {
+        if(! fm_file_info_is_dir(fi))
+        {
+            err = g_error_new(G_IO_ERROR, G_IO_ERROR_NOT_DIRECTORY,
+                              _("The specified directory '%s' is not valid"),
+                              path_str);
+            fm_file_info_unref(fi);
+            fm_job_emit_error(fmjob, err, FM_JOB_ERROR_CRITICAL);
+            g_error_free(err);
+            g_free(path_str);
+            return FALSE;
+        }
+        job->dir_fi = fi;
+    }
+    else
+    {
+        err = g_error_new(G_IO_ERROR, G_IO_ERROR_NOT_DIRECTORY,
+                          _("The specified directory '%s' is not valid"),
+                          path_str);
+        fm_job_emit_error(fmjob, err, FM_JOB_ERROR_CRITICAL);
+        g_error_free(err);
+        g_free(path_str);
+        return FALSE;
+    }
+
+    _list_native_dir(job, path_str);
     g_free(path_str);
     return TRUE;
 }
@@ -31,6 +31,18 @@
 #include "fm-file.h"
 #include <glib/gi18n-lib.h>
 
+#if defined(HAVE_FSTATAT) && defined(HAVE_FDOPENDIR)
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#define DELETE_NATIVE 1
+#endif
+
 static const char query[] =  G_FILE_ATTRIBUTE_STANDARD_TYPE","
                                G_FILE_ATTRIBUTE_STANDARD_NAME","
                                G_FILE_ATTRIBUTE_STANDARD_DISPLAY_NAME;
@@ -215,22 +227,284 @@ _failed:
     return FALSE;
 }
 
+/* switches parent folder whose updates are blocked while its files are
+   deleted, so the folder is updated once, not after each file */
+static void _fm_file_ops_job_switch_folder(FmPath *path, FmPath **parent,
+                                           FmFolder **parent_folder)
+{
+    if (fm_path_get_parent(path) != *parent && fm_path_get_parent(path) != NULL)
+    {
+        FmFolder *pf = fm_folder_find_by_path(fm_path_get_parent(path));
+        if (pf != *parent_folder)
+        {
+            if (*parent_folder)
+            {
+                fm_folder_unblock_updates(*parent_folder);
+                g_object_unref(*parent_folder);
+            }
+            if (pf)
+                fm_folder_block_updates(pf);
+            *parent_folder = pf;
+        }
+        else if (pf)
+            g_object_unref(pf);
+    }
+    *parent = fm_path_get_parent(path);
+}
+
+#ifdef DELETE_NATIVE
+/* Native delete.
+ * Directory trees on native file systems are removed with unlinkat() relative
+ * to an open directory instead of querying and deleting each file via GIO.
+ * Subdirectories are handed to a pool of workers so several directories are
+ * read and cleaned at once; each directory is removed by the worker which
+ * finished its last subdirectory. Everything below the root is opened and
+ * removed relative to the parent directory descriptor, so nothing in the
+ * tree is resolved by path and a directory replaced with a symlink while
+ * being deleted is never followed. Workers never ask anything: if something
+ * cannot be deleted then whatever is left of the tree is passed to the code
+ * above which reports the error and allows retry. Entries are counted while
+ * walking so there is no separate counting pass. */
+
+#define DELETE_MAX_WORKERS      8
+
+typedef struct _FmDeleteDir FmDeleteDir;
+struct _FmDeleteDir
+{
+    FmDeleteDir *parent;
+    char *name; /* relative to parent->fd, full path for root */
+    int fd; /* kept open until all subdirectories are finished */
+    volatile gint pending; /* own listing and unfinished subdirectories */
+    volatile gint failed; /* something inside was not deleted */
+};
+
+typedef struct
+{
+    FmJob *job;
+    GThreadPool *pool;
+    GQueue stack; /* FmDeleteDir to be listed, newest first */
+    GAsyncQueue *done; /* roots of finished trees */
+    volatile gint n_found; /* entries found in trees */
+    volatile gint n_deleted; /* entries deleted from trees */
+    gint n_found_reported;
+    gint n_deleted_reported;
+} FmDeleteContext;
+
+static guint _delete_n_workers(void)
+{
+#if GLIB_CHECK_VERSION(2, 36, 0)
+    return CLAMP(g_get_num_processors(), 2, DELETE_MAX_WORKERS);
+#else
+    return 4;
+#endif
+}
+
+static FmDeleteDir *_delete_dir_new(FmDeleteDir *parent, char *name)
+{
+    FmDeleteDir *dir = g_slice_new(FmDeleteDir);
+
+    dir->parent = parent;
+    dir->name = name;
+    dir->fd = -1;
+    dir->pending = 1;
+    dir->failed = 0;
+    return dir;
+}
+
+static void _delete_dir_free(FmDeleteDir *dir)
+{
+    if (dir->fd >= 0)
+        close(dir->fd);
+    g_free(dir->name);
+    g_slice_free(FmDeleteDir, dir);
+}
+
+G_LOCK_DEFINE_STATIC(delete_stack);
+
+/* Workers take the newest directory first, so the tree is walked depth-first
+   and only directories on the way down from the root are kept open; walking
+   wide trees breadth-first would keep open all directories of a level. */
+static void _delete_dir_push(FmDeleteContext *ctx, FmDeleteDir *dir)
+{
+    G_LOCK(delete_stack);
+    g_queue_push_head(&ctx->stack, dir);
+    G_UNLOCK(delete_stack);
+    /* each push to the pool runs one worker call which takes one directory */
+    g_thread_pool_push(ctx->pool, dir, NULL);
+}
+
+/* this is called from worker thread */
+static void _delete_dir_finish(FmDeleteContext *ctx, FmDeleteDir *dir)
+{
+    FmDeleteDir *parent;
+
+    while (g_atomic_int_dec_and_test(&dir->pending))
+    {
+        parent = dir->parent;
+        if (parent == NULL) /* root is removed by the job thread */
+        {
+            g_async_queue_push(ctx->done, dir);
+            break;
+        }
+        /* parent->fd is still open since parent waits for this one */
+        if (g_atomic_int_get(&dir->failed) ||
+            unlinkat(parent->fd, dir->name, AT_REMOVEDIR) < 0)
+            g_atomic_int_set(&parent->failed, 1);
+        else
+            g_atomic_int_inc(&ctx->n_deleted);
+        _delete_dir_free(dir);
+        dir = parent;
+    }
+}
+
+/* this is called from worker thread */
+static void _delete_worker(gpointer data, gpointer user_data)
+{
+    FmDeleteContext *ctx = user_data;
+    FmDeleteDir *dir;
+    struct dirent *de;
+    struct stat st;
+    DIR *dirp;
+    gboolean is_dir;
+    int fd, dir_fd;
+
+    /* data is not used, it might be not the newest one */
+    G_LOCK(delete_stack);
+    dir = g_queue_pop_head(&ctx->stack);
+    G_UNLOCK(delete_stack);
+    if (dir->parent)
+        fd = openat(dir->parent->fd, dir->name,
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    else
+        fd = open(dir->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    dir->fd = fd;
+    /* the listing gets its own descriptor since closedir() closes it */
+    dir_fd = (fd < 0) ? -1 : fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (dir_fd < 0 || (dirp = fdopendir(dir_fd)) == NULL)
+    {
+        if (dir_fd >= 0)
+            close(dir_fd);
+        g_atomic_int_set(&dir->failed, 1);
+        _delete_dir_finish(ctx, dir);
+        return;
+    }
+    while (!fm_job_is_cancelled(ctx->job) && (de = readdir(dirp)) != NULL)
+    {
+        const char *name = de->d_name;
+
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+        g_atomic_int_inc(&ctx->n_found);
+#ifdef _DIRENT_HAVE_D_TYPE
+        if (de->d_type != DT_UNKNOWN)
+            is_dir = (de->d_type == DT_DIR);
+        else
+#endif
+            is_dir = (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                      S_ISDIR(st.st_mode));
+        if (is_dir)
+        {
+            g_atomic_int_inc(&dir->pending);
+            _delete_dir_push(ctx, _delete_dir_new(dir, g_strdup(name)));
+        }
+        else if (unlinkat(fd, name, 0) == 0)
+            g_atomic_int_inc(&ctx->n_deleted);
+        else
+            g_atomic_int_set(&dir->failed, 1);
+    }
+    if (fm_job_is_cancelled(ctx->job))
+        g_atomic_int_set(&dir->failed, 1);
+    closedir(dirp); /* dir->fd stays open for subdirectories */
+    _delete_dir_finish(ctx, dir);
+}
+
+/* adds what workers did to job progress */
+static void _delete_update_progress(FmDeleteContext *ctx, FmFileOpsJob *job)
+{
+    gint n_found = g_atomic_int_get(&ctx->n_found);
+    gint n_deleted = g_atomic_int_get(&ctx->n_deleted);
+
+    job->total += n_found - ctx->n_found_reported;
+    job->finished += n_deleted - ctx->n_deleted_reported;
+    ctx->n_found_reported = n_found;
+    ctx->n_deleted_reported = n_deleted;
+    fm_file_ops_job_emit_percent(job);
+}
+
+/* returns TRUE if the directory was deleted with all its content */
+static gboolean _delete_native_tree(FmDeleteContext *ctx, FmFileOpsJob *job,
+                                    FmPath *path)
+{
+    FmDeleteDir *root;
+    char *disp;
+    gboolean ret;
+
+    disp = fm_path_display_basename(path);
+    fm_file_ops_job_emit_cur_file(job, disp);
+    g_free(disp);
+    _delete_dir_push(ctx, _delete_dir_new(NULL, fm_path_to_str(path)));
+    for (;;)
+    {
+#if GLIB_CHECK_VERSION(2, 32, 0)
+        root = g_async_queue_timeout_pop(ctx->done, 100000);
+#else
+        GTimeVal end;
+
+        g_get_current_time(&end);
+        g_time_val_add(&end, 100000);
+        root = g_async_queue_timed_pop(ctx->done, &end);
+#endif
+        _delete_update_progress(ctx, job);
+        if (root)
+            break;
+    }
+    ret = (!g_atomic_int_get(&root->failed) && rmdir(root->name) == 0);
+    _delete_dir_free(root);
+    if (ret)
+    {
+        ++job->finished;
+        fm_file_ops_job_emit_percent(job);
+    }
+    return ret;
+}
+#endif /* DELETE_NATIVE */
 
 gboolean _fm_file_ops_job_delete_run(FmFileOpsJob* job)
 {
     GList* l;
     gboolean ret = TRUE;
-    /* prepare the job, count total work needed with FmDeepCountJob */
-    FmDeepCountJob* dc = fm_deep_count_job_new(job->srcs, FM_DC_JOB_PREPARE_DELETE);
+    FmPathList* counted = fm_path_list_new();
     FmJob* fmjob = FM_JOB(job);
     FmPath *path, *parent = NULL;
     FmFolder *parent_folder = NULL;
+#ifdef DELETE_NATIVE
+    FmDeleteContext ctx;
+#endif
 
-    /* let the deep count job share the same cancellable */
-    fm_job_set_cancellable(FM_JOB(dc), fm_job_get_cancellable(fmjob));
-    fm_job_run_sync(FM_JOB(dc));
-    job->total = dc->count;
-    g_object_unref(dc);
+    /* native trees are counted while deleting, count others beforehand */
+    job->total = 0;
+    for(l = fm_path_list_peek_head_link(job->srcs); l; l = l->next)
+    {
+        path = FM_PATH(l->data);
+#ifdef DELETE_NATIVE
+        if(fm_path_is_native(path))
+            ++job->total;
+        else
+#endif
+            fm_path_list_push_tail(counted, path);
+    }
+    if(!fm_path_list_is_empty(counted))
+    {
+        /* count total work needed with FmDeepCountJob */
+        FmDeepCountJob* dc = fm_deep_count_job_new(counted, FM_DC_JOB_PREPARE_DELETE);
+
+        /* let the deep count job share the same cancellable */
+        fm_job_set_cancellable(FM_JOB(dc), fm_job_get_cancellable(fmjob));
+        fm_job_run_sync(FM_JOB(dc));
+        job->total += dc->count;
+        g_object_unref(dc);
+    }
+    fm_path_list_unref(counted);
 
     if(fm_job_is_cancelled(fmjob))
     {
@@ -240,6 +514,15 @@ gboolean _fm_file_ops_job_delete_run(FmFileOpsJob* job)
 
     g_debug("total number of files to delete: %llu", (long long unsigned int)job->total);
 
+#ifdef DELETE_NATIVE
+    ctx.job = fmjob;
+    ctx.done = g_async_queue_new();
+    g_queue_init(&ctx.stack);
+    ctx.n_found = ctx.n_deleted = 0;
+    ctx.n_found_reported = ctx.n_deleted_reported = 0;
+    ctx.pool = g_thread_pool_new(_delete_worker, &ctx, _delete_n_workers(), FALSE, NULL);
+#endif
+
     fm_file_ops_job_emit_prepared(job);
 
     l = fm_path_list_peek_head_link(job->srcs);
@@ -248,29 +531,41 @@ gboolean _fm_file_ops_job_delete_run(FmFileOpsJob* job)
         GFile* src;
 
         path = FM_PATH(l->data);
-        if (fm_path_get_parent(path) != parent && fm_path_get_parent(path) != NULL)
+        _fm_file_ops_job_switch_folder(path, &parent, &parent_folder);
+#ifdef DELETE_NATIVE
+        if(fm_path_is_native(path))
         {
-            FmFolder *pf = fm_folder_find_by_path(fm_path_get_parent(path));
-            if (pf != parent_folder)
+            char *path_str = fm_path_to_str(path);
+            struct stat st;
+            gboolean is_dir;
+
+            is_dir = (lstat(path_str, &st) == 0 && S_ISDIR(st.st_mode));
+            g_free(path_str);
+            if(is_dir && _delete_native_tree(&ctx, job, path))
             {
                 if (parent_folder)
-                {
-                    fm_folder_unblock_updates(parent_folder);
-                    g_object_unref(parent_folder);
-                }
-                if (pf)
-                    fm_folder_block_updates(pf);
-                parent_folder = pf;
+                    _fm_folder_event_file_deleted(parent_folder, path);
+                ret = TRUE;
+                continue;
             }
-            else if (pf)
-                g_object_unref(pf);
+            if(fm_job_is_cancelled(fmjob))
+            {
+                ret = FALSE;
+                break;
+            }
+            /* single files and whatever is left after failure are deleted
+               the usual way, so errors are reported to user */
         }
-        parent = fm_path_get_parent(path);
+#endif
         src = fm_path_to_gfile(path);
 
         ret = _fm_file_ops_job_delete_file(fmjob, src, NULL, parent_folder, FALSE);
         g_object_unref(src);
     }
+#ifdef DELETE_NATIVE
+    g_thread_pool_free(ctx.pool, FALSE, TRUE);
+    g_async_queue_unref(ctx.done);
+#endif
     if (parent_folder)
     {
         fm_folder_unblock_updates(parent_folder);
@@ -279,126 +574,538 @@ gboolean _fm_file_ops_job_delete_run(FmFileOpsJob* job)
     return ret;
 }
 
-gboolean _fm_file_ops_job_trash_run(FmFileOpsJob* job)
+/* trashes file via GIO, returns FALSE if user aborted the job */
+static gboolean _fm_file_ops_job_trash_file(FmFileOpsJob* job, FmPath *path,
+                                            FmFolder *parent_folder,
+                                            FmPathList* unsupported)
 {
-    gboolean ret = TRUE;
-    GList* l;
-    FmPathList* unsupported = fm_path_list_new();
-    GError* err = NULL;
     FmJob* fmjob = FM_JOB(job);
-    FmPath *path, *parent = NULL;
-    FmFolder *parent_folder = NULL;
-
-    g_debug("total number of files to delete: %u", fm_path_list_get_length(job->srcs));
-    job->total = fm_path_list_get_length(job->srcs);
+    GFile* gf = fm_path_to_gfile(path);
+    GFileInfo* inf;
+    GError* err = NULL;
+    gboolean ret;
 
-    fm_file_ops_job_emit_prepared(job);
+_retry_trash:
+    inf = g_file_query_info(gf, G_FILE_ATTRIBUTE_STANDARD_DISPLAY_NAME, 0,
+                            fm_job_get_cancellable(fmjob), &err);
+    if(inf)
+    {
+        /* currently processed file. */
+        fm_file_ops_job_emit_cur_file(job, g_file_info_get_display_name(inf));
+        g_object_unref(inf);
+    }
+    else
+    {
+        char* basename = g_file_get_basename(gf);
+        char* disp = basename ? g_filename_display_name(basename) : NULL;
+        g_free(basename);
+        ret = FALSE;
+                                                    /* FIXME: translate it */
+        fm_file_ops_job_emit_cur_file(job, disp ? disp : "(invalid file)");
+        g_free(disp);
+        goto _on_error;
+    }
+    ret = FALSE;
+    if(fm_config->no_usb_trash)
+    {
+        GMount *mnt = g_file_find_enclosing_mount(gf, NULL, &err);
 
-    /* FIXME: we shouldn't trash a file already in trash:/// */
+        if(mnt)
+        {
+            ret = g_mount_can_unmount(mnt); /* TRUE if it's removable media */
+            g_object_unref(mnt);
+            if(ret)
+                fm_path_list_push_tail(unsupported, path);
+        }
+        else
+        {
+            g_error_free(err);
+            err = NULL;
+        }
+    }
 
-    l = fm_path_list_peek_head_link(job->srcs);
-    for(; !fm_job_is_cancelled(fmjob) && l;l=l->next)
+    if(!ret)
     {
-        GFile* gf = fm_path_to_gfile(FM_PATH(l->data));
-        GFileInfo* inf;
-
-        path = FM_PATH(l->data);
-        if (fm_path_get_parent(path) != parent && fm_path_get_parent(path) != NULL)
+        ret = g_file_trash(gf, fm_job_get_cancellable(fmjob), &err);
+        if (ret && parent_folder)
+            _fm_folder_event_file_deleted(parent_folder, path);
+        /* FIXME: signal trash:/// that file added there */
+    }
+    if(!ret)
+    {
+_on_error:
+        /* if trashing is not supported by the file system */
+        if( err->domain == G_IO_ERROR && err->code == G_IO_ERROR_NOT_SUPPORTED)
+            fm_path_list_push_tail(unsupported, path);
+        else
         {
-            FmFolder *pf = fm_folder_find_by_path(fm_path_get_parent(path));
-            if (pf != parent_folder)
+            FmJobErrorAction act = fm_job_emit_error(fmjob, err, FM_JOB_ERROR_MODERATE);
+            g_error_free(err);
+            err = NULL;
+            if(act == FM_JOB_RETRY)
+                goto _retry_trash;
+            else if(act == FM_JOB_ABORT)
             {
-                if (parent_folder)
-                {
-                    fm_folder_unblock_updates(parent_folder);
-                    g_object_unref(parent_folder);
-                }
-                if (pf)
-                    fm_folder_block_updates(pf);
-                parent_folder = pf;
+                g_object_unref(gf);
+                return FALSE;
             }
-            else if (pf)
-                g_object_unref(pf);
         }
-        parent = fm_path_get_parent(path);
-_retry_trash:
-        inf = g_file_query_info(gf, G_FILE_ATTRIBUTE_STANDARD_DISPLAY_NAME, 0,
-                                fm_job_get_cancellable(fmjob), &err);
-        if(inf)
+        g_error_free(err);
+        err = NULL;
+    }
+    g_object_unref(gf);
+    ++job->finished;
+    fm_file_ops_job_emit_percent(job);
+    return TRUE;
+}
+
+#ifdef DELETE_NATIVE
+/* Native trash.
+ * Native files are trashed in batches as the Trash specification describes:
+ * info file is created exclusively in info/ and then the file is renamed
+ * into files/. Both steps are done by a pool of workers, for files of a
+ * batch at once. Trash directory of each device (home trash, $topdir/.Trash
+ * or $topdir/.Trash-$uid) is found and created once per job. Files which
+ * cannot be trashed this way are trashed via GIO then, so errors and
+ * unsupported file systems are handled as before. */
+
+#define TRASH_BATCH_SIZE        64
+#define TRASH_MAX_WORKERS       8
+
+typedef struct
+{
+    dev_t dev;
+    char *base; /* NULL if trash is not available */
+    char *files;
+    char *info;
+    char *topdir; /* NULL for home trash */
+    gboolean removable;
+} FmTrashDir;
+
+typedef struct
+{
+    FmPath *path;
+    char *path_str;
+    FmFolder *folder;
+    FmTrashDir *trash;
+    int error; /* errno or 0 */
+} FmTrashItem;
+
+typedef struct
+{
+    FmJob *job;
+    GThreadPool *pool;
+    GAsyncQueue *done; /* handled FmTrashItem */
+    GSList *trash_dirs; /* FmTrashDir */
+    char date[32]; /* DeletionDate for current batch */
+    guint n_items;
+    FmTrashItem items[TRASH_BATCH_SIZE];
+} FmTrashContext;
+
+static guint _trash_n_workers(void)
+{
+#if GLIB_CHECK_VERSION(2, 36, 0)
+    return CLAMP(g_get_num_processors(), 2, TRASH_MAX_WORKERS);
+#else
+    return 4;
+#endif
+}
+
+/* creates trash directory if needed and checks it is safe to use */
+static gboolean _trash_make_dir(const char *base, gboolean with_parents)
+{
+    const char *subdirs[] = { "", "files", "info" };
+    struct stat st;
+    char *dir;
+    gboolean ok = TRUE;
+    guint i;
+
+    for (i = 0; ok && i < G_N_ELEMENTS(subdirs); i++)
+    {
+        dir = g_build_filename(base, subdirs[i], NULL);
+        if (i == 0 && with_parents)
+            g_mkdir_with_parents(dir, 0700);
+        else
+            mkdir(dir, 0700);
+        ok = (lstat(dir, &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == getuid());
+        g_free(dir);
+    }
+    return ok;
+}
+
+/* finds trash directory for file on device dev, see Trash specification */
+static char *_trash_find_dir(dev_t dev, const char *path_str, char **topdir)
+{
+    struct stat st;
+    char *dir, *parent, *top, *name, *base;
+
+    *topdir = NULL;
+    /* home trash if file is on the same device */
+    if (stat(g_get_user_data_dir(), &st) == 0 && st.st_dev == dev)
+    {
+        base = g_build_filename(g_get_user_data_dir(), "Trash", NULL);
+        if (_trash_make_dir(base, TRUE))
+            return base;
+        g_free(base);
+        return NULL;
+    }
+    /* find mount point; with symlinks in path it may be not that simple
+       so leave such files to GIO */
+    dir = g_path_get_dirname(path_str);
+    parent = realpath(dir, NULL);
+    if (parent == NULL || strcmp(parent, dir) != 0)
+    {
+        free(parent);
+        g_free(dir);
+        return NULL;
+    }
+    free(parent);
+    while (strcmp(dir, "/") != 0)
+    {
+        parent = g_path_get_dirname(dir);
+        if (stat(parent, &st) < 0 || st.st_dev != dev)
         {
-            /* currently processed file. */
-            fm_file_ops_job_emit_cur_file(job, g_file_info_get_display_name(inf));
-            g_object_unref(inf);
+            g_free(parent);
+            break;
         }
-        else
+        g_free(dir);
+        dir = parent;
+    }
+    /* $topdir/.Trash/$uid if administrator created $topdir/.Trash */
+    top = g_build_filename(dir, ".Trash", NULL);
+    if (lstat(top, &st) == 0 && S_ISDIR(st.st_mode) && (st.st_mode & S_ISVTX))
+    {
+        name = g_strdup_printf("%lu", (gulong)getuid());
+        base = g_build_filename(top, name, NULL);
+        g_free(name);
+        if (!_trash_make_dir(base, FALSE))
         {
-            char* basename = g_file_get_basename(gf);
-            char* disp = basename ? g_filename_display_name(basename) : NULL;
-            g_free(basename);
-            ret = FALSE;
-                                                        /* FIXME: translate it */
-            fm_file_ops_job_emit_cur_file(job, disp ? disp : "(invalid file)");
-            g_free(disp);
-            goto _on_error;
+            g_free(base);
+            base = NULL;
         }
-        ret = FALSE;
-        if(fm_config->no_usb_trash)
+    }
+    else
+        base = NULL;
+    g_free(top);
+    /* else $topdir/.Trash-$uid */
+    if (base == NULL)
+    {
+        name = g_strdup_printf(".Trash-%lu", (gulong)getuid());
+        base = g_build_filename(dir, name, NULL);
+        g_free(name);
+        if (!_trash_make_dir(base, FALSE))
         {
-            GMount *mnt = g_file_find_enclosing_mount(gf, NULL, &err);
+            g_free(base);
+            base = NULL;
+        }
+    }
+    if (base)
+        *topdir = dir;
+    else
+        g_free(dir);
+    return base;
+}
 
-            if(mnt)
-            {
-                ret = g_mount_can_unmount(mnt); /* TRUE if it's removable media */
-                g_object_unref(mnt);
-                if(ret)
-                    fm_path_list_push_tail(unsupported, FM_PATH(l->data));
-            }
-            else
-            {
-                g_error_free(err);
-                err = NULL;
-            }
+static FmTrashDir *_trash_get_dir(FmTrashContext *ctx, FmPath *path,
+                                  const char *path_str, dev_t dev)
+{
+    FmTrashDir *trash;
+    GSList *l;
+
+    for (l = ctx->trash_dirs; l; l = l->next)
+        if (((FmTrashDir*)l->data)->dev == dev)
+            return l->data;
+    trash = g_slice_new0(FmTrashDir);
+    trash->dev = dev;
+    if (fm_config->no_usb_trash)
+    {
+        GFile *gf = fm_path_to_gfile(path);
+        GMount *mnt = g_file_find_enclosing_mount(gf, NULL, NULL);
+
+        if (mnt)
+        {
+            trash->removable = g_mount_can_unmount(mnt);
+            g_object_unref(mnt);
         }
+        g_object_unref(gf);
+    }
+    if (!trash->removable)
+        trash->base = _trash_find_dir(dev, path_str, &trash->topdir);
+    if (trash->base)
+    {
+        trash->files = g_build_filename(trash->base, "files", NULL);
+        trash->info = g_build_filename(trash->base, "info", NULL);
+    }
+    ctx->trash_dirs = g_slist_prepend(ctx->trash_dirs, trash);
+    return trash;
+}
 
-        if(!ret)
+static void _trash_dir_free(gpointer data)
+{
+    FmTrashDir *trash = data;
+
+    g_free(trash->base);
+    g_free(trash->files);
+    g_free(trash->info);
+    g_free(trash->topdir);
+    g_slice_free(FmTrashDir, trash);
+}
+
+/* this is called from worker thread */
+static void _trash_worker(gpointer data, gpointer user_data)
+{
+    FmTrashItem *item = data;
+    FmTrashContext *ctx = user_data;
+    FmTrashDir *trash = item->trash;
+    const char *basename = strrchr(item->path_str, G_DIR_SEPARATOR) + 1;
+    const char *orig_path = item->path_str;
+    char *escaped, *contents, *name, *info_path = NULL, *files_path = NULL;
+    const char *p;
+    struct stat st;
+    gsize len;
+    ssize_t n;
+    int fd = -1, i;
+
+    if (fm_job_is_cancelled(ctx->job))
+    {
+        item->error = ECANCELED;
+        g_async_queue_push(ctx->done, item);
+        return;
+    }
+    /* path is relative to topdir for trash on other devices */
+    if (trash->topdir)
+    {
+        orig_path += strlen(trash->topdir);
+        if (*orig_path == G_DIR_SEPARATOR)
+            orig_path++;
+    }
+    escaped = g_uri_escape_string(orig_path, "/", FALSE);
+    contents = g_strdup_printf("[Trash Info]\nPath=%s\nDeletionDate=%s\n",
+                               escaped, ctx->date);
+    g_free(escaped);
+    item->error = EEXIST;
+    for (i = 1; i < 1000; i++)
+    {
+        if (i == 1)
+            name = g_strdup(basename);
+        else
+            name = g_strdup_printf("%s.%d", basename, i);
+        info_path = g_strconcat(trash->info, "/", name, ".trashinfo", NULL);
+        files_path = g_build_filename(trash->files, name, NULL);
+        g_free(name);
+        fd = open(info_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd >= 0)
         {
-            ret = g_file_trash(gf, fm_job_get_cancellable(fmjob), &err);
-            if (ret && parent_folder)
-                _fm_folder_event_file_deleted(parent_folder, path);
-            /* FIXME: signal trash:/// that file added there */
+            /* rename() would replace a stray file without info */
+            if (lstat(files_path, &st) < 0)
+                break;
+            close(fd);
+            fd = -1;
+            unlink(info_path);
         }
-        if(!ret)
+        else if (errno != EEXIST)
         {
-_on_error:
-            /* if trashing is not supported by the file system */
-            if( err->domain == G_IO_ERROR && err->code == G_IO_ERROR_NOT_SUPPORTED)
-                fm_path_list_push_tail(unsupported, FM_PATH(l->data));
-            else
+            item->error = errno;
+            break;
+        }
+        g_free(info_path);
+        g_free(files_path);
+        info_path = files_path = NULL;
+    }
+    if (fd >= 0)
+    {
+        item->error = 0;
+        for (p = contents, len = strlen(contents); len > 0; p += n, len -= n)
+        {
+            n = write(fd, p, len);
+            if (n < 0 && errno == EINTR)
+                n = 0;
+            else if (n < 0)
             {
-                FmJobErrorAction act = fm_job_emit_error(fmjob, err, FM_JOB_ERROR_MODERATE);
-                g_error_free(err);
-                err = NULL;
-                if(act == FM_JOB_RETRY)
-                    goto _retry_trash;
-                else if(act == FM_JOB_ABORT)
-                {
-                    g_object_unref(gf);
-                    fm_path_list_unref(unsupported);
-                    return FALSE;
-                }
+                item->error = errno;
+                break;
             }
-            g_error_free(err);
-            err = NULL;
         }
-        g_object_unref(gf);
+        if (close(fd) < 0 && item->error == 0)
+            item->error = errno;
+        if (item->error == 0 && rename(item->path_str, files_path) < 0)
+            item->error = errno;
+        if (item->error != 0)
+            unlink(info_path);
+    }
+    g_free(info_path);
+    g_free(files_path);
+    g_free(contents);
+    g_async_queue_push(ctx->done, item);
+}
+
+/* trashes queued files, returns FALSE if the job should be stopped */
+static gboolean _trash_flush(FmTrashContext *ctx, FmFileOpsJob *job,
+                             FmPathList *unsupported)
+{
+    FmTrashItem *item;
+    struct tm tm;
+    time_t now;
+    char *disp;
+    gboolean ok = TRUE;
+    guint i;
+
+    if (ctx->n_items == 0)
+        return TRUE;
+    disp = fm_path_display_basename(ctx->items[0].path);
+    fm_file_ops_job_emit_cur_file(job, disp);
+    g_free(disp);
+    now = time(NULL);
+    localtime_r(&now, &tm);
+    strftime(ctx->date, sizeof(ctx->date), "%Y-%m-%dT%H:%M:%S", &tm);
+    for (i = 0; i < ctx->n_items; i++)
+        g_thread_pool_push(ctx->pool, &ctx->items[i], NULL);
+    for (i = 0; i < ctx->n_items; i++)
+        g_async_queue_pop(ctx->done);
+    /* handle results in original order */
+    for (i = 0; i < ctx->n_items; i++)
+    {
+        item = &ctx->items[i];
+        if (!ok || fm_job_is_cancelled(ctx->job))
+            ; /* just free the rest */
+        else if (item->error == 0)
+        {
+            if (item->folder)
+                _fm_folder_event_file_deleted(item->folder, item->path);
+            ++job->finished;
+            fm_file_ops_job_emit_percent(job);
+        }
+        else /* let GIO try it and report errors */
+            ok = _fm_file_ops_job_trash_file(job, item->path, item->folder,
+                                             unsupported);
+        fm_path_unref(item->path);
+        g_free(item->path_str);
+    }
+    ctx->n_items = 0;
+    return ok;
+}
+
+/* queues file for native trash, returns FALSE if it cannot be trashed so */
+static gboolean _trash_queue(FmTrashContext *ctx, FmFileOpsJob *job,
+                             FmPath *path, FmFolder *parent_folder,
+                             FmPathList *unsupported)
+{
+    FmTrashItem *item;
+    FmTrashDir *trash;
+    struct stat st;
+    char *path_str = fm_path_to_str(path);
+    gsize len;
+
+    if (lstat(path_str, &st) < 0)
+    {
+        g_free(path_str);
+        return FALSE;
+    }
+    trash = _trash_get_dir(ctx, path, path_str, st.st_dev);
+    if (trash->removable)
+    {
+        fm_path_list_push_tail(unsupported, path);
         ++job->finished;
         fm_file_ops_job_emit_percent(job);
+        g_free(path_str);
+        return TRUE;
+    }
+    /* don't put trash into itself; info has path relative to topdir */
+    len = trash->base ? strlen(trash->base) : 0;
+    if (trash->base == NULL || strrchr(path_str, G_DIR_SEPARATOR) == NULL ||
+        (strncmp(path_str, trash->base, len) == 0 &&
+         (path_str[len] == G_DIR_SEPARATOR || path_str[len] == '\0')) ||
+        (trash->topdir && (!g_str_has_prefix(path_str, trash->topdir) ||
+                           (path_str[strlen(trash->topdir)] != G_DIR_SEPARATOR &&
+                            strcmp(trash->topdir, "/") != 0))))
+    {
+        g_free(path_str);
+        return FALSE;
+    }
+    item = &ctx->items[ctx->n_items++];
+    item->path = fm_path_ref(path);
+    item->path_str = path_str;
+    item->folder = parent_folder;
+    item->trash = trash;
+    item->error = 0;
+    return TRUE;
+}
+#endif /* DELETE_NATIVE */
+
+gboolean _fm_file_ops_job_trash_run(FmFileOpsJob* job)
+{
+    GList* l;
+    FmPathList* unsupported = fm_path_list_new();
+    FmJob* fmjob = FM_JOB(job);
+    FmPath *path, *parent = NULL;
+    FmFolder *parent_folder = NULL;
+    gboolean ok = TRUE;
+#ifdef DELETE_NATIVE
+    FmTrashContext *ctx = g_slice_new(FmTrashContext);
+
+    ctx->job = fmjob;
+    ctx->done = g_async_queue_new();
+    ctx->trash_dirs = NULL;
+    ctx->n_items = 0;
+    ctx->pool = g_thread_pool_new(_trash_worker, ctx, _trash_n_workers(), FALSE, NULL);
+#endif
+
+    g_debug("total number of files to delete: %u", fm_path_list_get_length(job->srcs));
+    job->total = fm_path_list_get_length(job->srcs);
+
+    fm_file_ops_job_emit_prepared(job);
+
+    /* FIXME: we shouldn't trash a file already in trash:/// */
+
+    l = fm_path_list_peek_head_link(job->srcs);
+    for(; ok && !fm_job_is_cancelled(fmjob) && l;l=l->next)
+    {
+        path = FM_PATH(l->data);
+#ifdef DELETE_NATIVE
+        /* finish the batch before its folder is unblocked */
+        if (ctx->n_items == TRASH_BATCH_SIZE ||
+            (ctx->n_items > 0 && fm_path_get_parent(path) != parent))
+        {
+            ok = _trash_flush(ctx, job, unsupported);
+            if (!ok)
+                break;
+        }
+#endif
+        _fm_file_ops_job_switch_folder(path, &parent, &parent_folder);
+#ifdef DELETE_NATIVE
+        if (fm_path_is_native(path) &&
+            _trash_queue(ctx, job, path, parent_folder, unsupported))
+            continue;
+#endif
+        ok = _fm_file_ops_job_trash_file(job, path, parent_folder, unsupported);
     }
+#ifdef DELETE_NATIVE
+    if (ok)
+        ok = _trash_flush(ctx, job, unsupported);
+    else /* the job is aborted, just forget the rest */
+        while (ctx->n_items > 0)
+        {
+            FmTrashItem *item = &ctx->items[--ctx->n_items];
+
+            fm_path_unref(item->path);
+            g_free(item->path_str);
+        }
+    g_thread_pool_free(ctx->pool, FALSE, TRUE);
+    g_async_queue_unref(ctx->done);
+    g_slist_foreach(ctx->trash_dirs, (GFunc)_trash_dir_free, NULL);
+    g_slist_free(ctx->trash_dirs);
+    g_slice_free(FmTrashContext, ctx);
+#endif
     if (parent_folder)
     {
         fm_folder_unblock_updates(parent_folder);
         g_object_unref(parent_folder);
     }
+    if (!ok)
+    {
+        fm_path_list_unref(unsupported);
+        return FALSE;
+    }
 
     /* these files cannot be trashed due to lack of support from
      * underlying file systems. */
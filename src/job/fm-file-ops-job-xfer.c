@@ -29,6 +29,7 @@
 
 #include "fm-file-ops-job-xfer.h"
 #include "fm-file-ops-job-delete.h"
+#include "fm-native-copy.h"
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -44,10 +45,360 @@ static const char query[]=
     G_FILE_ATTRIBUTE_STANDARD_SIZE","
     G_FILE_ATTRIBUTE_UNIX_BLOCKS","
     G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE","
+    G_FILE_ATTRIBUTE_UNIX_MODE","
+    G_FILE_ATTRIBUTE_TIME_MODIFIED","
+    G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC","
     G_FILE_ATTRIBUTE_ID_FILESYSTEM;
 
 static void progress_cb(goffset cur, goffset total, gpointer job);
 
+/* Pipelined copy.
+ * Source trees are scanned in a separate thread while copying goes, so the
+ * first bytes are copied right away and total size is refined while scan
+ * progresses. The scanner walks trees depth-first, exactly in the order
+ * copying recurses into directories, and passes directory listings to it
+ * so each directory is enumerated once. Only XFER_SCAN_MAX_QUEUED entries
+ * are kept in queue; while copying is behind that much, listings are only
+ * counted and copying enumerates those directories itself. Copying may go
+ * in another order than scanning where it enumerated a directory itself, so
+ * listings are dropped only once copying has finished the directory they
+ * are in, and copying waits for a listing only while the scanner has not
+ * reached that directory yet. */
+
+#define XFER_SCAN_MAX_QUEUED    16384
+
+typedef struct
+{
+    GFile* dir;
+    GSList* children;       /* GFileInfo in enumeration order */
+    guint n_children;
+    gboolean kept;          /* FALSE if only counted */
+} XferScanListing;
+
+typedef struct
+{
+    FmJob* job;
+    FmPathList* srcs;
+    GQueue listings;        /* XferScanListing in depth-first order */
+    GHashTable* pending;    /* directories found but not listed yet */
+    GFile* current;         /* directory listed last */
+    GSList* copying;        /* directories copying is in, innermost first */
+    guint n_queued;         /* number of children kept in listings */
+    goffset total;          /* total size found so far */
+    gboolean roots_done;    /* top level files are counted */
+    gboolean done;          /* scan is finished */
+    gboolean stopped;       /* copying is finished, scan is not needed */
+#if GLIB_CHECK_VERSION(2, 32, 0)
+    GMutex lock_data;
+    GCond cond_data;
+#endif
+    GMutex* lock;
+    GCond* cond;
+    GThread* thread;
+} XferScan;
+
+static void xfer_scan_listing_free(XferScanListing* listing)
+{
+    g_object_unref(listing->dir);
+    g_slist_foreach(listing->children, (GFunc)g_object_unref, NULL);
+    g_slist_free(listing->children);
+    g_slice_free(XferScanListing, listing);
+}
+
+/* in scanner thread */
+static gboolean xfer_scan_dir(XferScan* scan, GFile* dir)
+{
+    GCancellable* cancellable = fm_job_get_cancellable(scan->job);
+    GFileEnumerator* enu;
+    GFileInfo* inf;
+    GSList *children = NULL, *subdirs = NULL, *l;
+    XferScanListing* listing;
+    GError* err = NULL;
+    goffset size = 0;
+    guint n = 0;
+    gboolean ret;
+
+    enu = g_file_enumerate_children(dir, query, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                    cancellable, &err);
+    if(enu)
+    {
+        while((inf = g_file_enumerator_next_file(enu, cancellable, &err)))
+        {
+            size += g_file_info_get_size(inf);
+            if(g_file_info_get_file_type(inf) == G_FILE_TYPE_DIRECTORY)
+                subdirs = g_slist_prepend(subdirs, g_file_get_child(dir, g_file_info_get_name(inf)));
+            children = g_slist_prepend(children, inf);
+            n++;
+        }
+        g_file_enumerator_close(enu, NULL, NULL);
+        g_object_unref(enu);
+        children = g_slist_reverse(children);
+        subdirs = g_slist_reverse(subdirs);
+    }
+
+    /* push a listing even on error to keep queue in sync with copying */
+    listing = g_slice_new(XferScanListing);
+    listing->dir = g_object_ref(dir);
+    /* partial listing is useless, copying will report the error */
+    listing->kept = (err == NULL);
+    g_clear_error(&err);
+    g_mutex_lock(scan->lock);
+    scan->total += size;
+    /* copying has finished the directory already, nobody will ask for it */
+    if(!g_hash_table_remove(scan->pending, dir))
+    {
+        ret = !scan->stopped;
+        g_mutex_unlock(scan->lock);
+        g_object_unref(listing->dir);
+        g_slice_free(XferScanListing, listing);
+        g_slist_foreach(children, (GFunc)g_object_unref, NULL);
+        g_slist_free(children);
+        goto _recurse;
+    }
+    for(l = subdirs; l; l = l->next)
+        g_hash_table_insert(scan->pending, g_object_ref(l->data), l->data);
+    if(scan->current)
+        g_object_unref(scan->current);
+    scan->current = g_object_ref(dir);
+    if(listing->kept && scan->n_queued + n > XFER_SCAN_MAX_QUEUED && scan->n_queued > 0)
+        listing->kept = FALSE;
+    if(listing->kept)
+    {
+        listing->children = children;
+        listing->n_children = n;
+        scan->n_queued += n;
+        children = NULL;
+    }
+    else
+    {
+        listing->children = NULL;
+        listing->n_children = 0;
+    }
+    g_queue_push_tail(&scan->listings, listing);
+    ret = !scan->stopped;
+    g_cond_broadcast(scan->cond);
+    g_mutex_unlock(scan->lock);
+    g_slist_foreach(children, (GFunc)g_object_unref, NULL);
+    g_slist_free(children);
+
+_recurse:
+    for(l = subdirs; l; l = l->next)
+    {
+        if(ret && !fm_job_is_cancelled(scan->job))
+            ret = xfer_scan_dir(scan, l->data);
+        g_object_unref(l->data);
+    }
+    g_slist_free(subdirs);
+    return ret && !fm_job_is_cancelled(scan->job);
+}
+
+/* in scanner thread */
+static gpointer xfer_scan_thread(gpointer user_data)
+{
+    XferScan* scan = (XferScan*)user_data;
+    GCancellable* cancellable = fm_job_get_cancellable(scan->job);
+    GSList *roots = NULL, *l;
+    GList* pl;
+    gboolean ok = TRUE;
+
+    /* count top level files first, they are copied in the same order */
+    for(pl = fm_path_list_peek_head_link(scan->srcs); pl; pl = pl->next)
+    {
+        GFile* src = fm_path_to_gfile(FM_PATH(pl->data));
+        GFileInfo* inf = g_file_query_info(src, query, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                           cancellable, NULL);
+        if(inf)
+        {
+            g_mutex_lock(scan->lock);
+            scan->total += g_file_info_get_size(inf);
+            g_mutex_unlock(scan->lock);
+            if(g_file_info_get_file_type(inf) == G_FILE_TYPE_DIRECTORY)
+                roots = g_slist_prepend(roots, g_object_ref(src));
+            g_object_unref(inf);
+        }
+        g_object_unref(src);
+    }
+    roots = g_slist_reverse(roots);
+    g_mutex_lock(scan->lock);
+    for(l = roots; l; l = l->next)
+        g_hash_table_insert(scan->pending, g_object_ref(l->data), l->data);
+    scan->roots_done = TRUE;
+    g_cond_broadcast(scan->cond);
+    g_mutex_unlock(scan->lock);
+
+    for(l = roots; l; l = l->next)
+    {
+        if(ok)
+            ok = xfer_scan_dir(scan, l->data);
+        g_object_unref(l->data);
+    }
+    g_slist_free(roots);
+
+    g_mutex_lock(scan->lock);
+    scan->done = TRUE;
+    g_cond_broadcast(scan->cond);
+    g_mutex_unlock(scan->lock);
+    return NULL;
+}
+
+static XferScan* xfer_scan_new(FmFileOpsJob* job)
+{
+    XferScan* scan = g_slice_new0(XferScan);
+
+    scan->job = FM_JOB(job);
+    scan->srcs = job->srcs;
+    g_queue_init(&scan->listings);
+    scan->pending = g_hash_table_new_full(g_file_hash, (GEqualFunc)g_file_equal,
+                                          g_object_unref, NULL);
+#if GLIB_CHECK_VERSION(2, 32, 0)
+    g_mutex_init(&scan->lock_data);
+    g_cond_init(&scan->cond_data);
+    scan->lock = &scan->lock_data;
+    scan->cond = &scan->cond_data;
+    scan->thread = g_thread_new("xfer-scan", xfer_scan_thread, scan);
+#else
+    scan->lock = g_mutex_new();
+    scan->cond = g_cond_new();
+    scan->thread = g_thread_create(xfer_scan_thread, scan, TRUE, NULL);
+#endif
+    return scan;
+}
+
+/* waits for scanner to finish and frees it, returns total size */
+static goffset xfer_scan_free(XferScan* scan)
+{
+    XferScanListing* listing;
+    goffset total;
+
+    g_mutex_lock(scan->lock);
+    scan->stopped = TRUE;
+    g_mutex_unlock(scan->lock);
+    g_thread_join(scan->thread);
+    while((listing = g_queue_pop_head(&scan->listings)))
+        xfer_scan_listing_free(listing);
+    g_hash_table_destroy(scan->pending);
+    if(scan->current)
+        g_object_unref(scan->current);
+    g_slist_foreach(scan->copying, (GFunc)g_object_unref, NULL);
+    g_slist_free(scan->copying);
+    total = scan->total;
+#if GLIB_CHECK_VERSION(2, 32, 0)
+    g_mutex_clear(&scan->lock_data);
+    g_cond_clear(&scan->cond_data);
+#else
+    g_mutex_free(scan->lock);
+    g_cond_free(scan->cond);
+#endif
+    g_slice_free(XferScan, scan);
+    return total;
+}
+
+/* waits until top level files are counted and updates job total */
+static void xfer_scan_wait_roots(XferScan* scan, FmFileOpsJob* job)
+{
+    g_mutex_lock(scan->lock);
+    while(!scan->roots_done)
+        g_cond_wait(scan->cond, scan->lock);
+    job->total = scan->total;
+    g_mutex_unlock(scan->lock);
+}
+
+static gboolean xfer_scan_is_inside(gpointer key, gpointer value, gpointer dir)
+{
+    return g_file_equal(key, dir) || g_file_has_prefix(key, dir);
+}
+
+/* copying has left the directory, drop everything left from it */
+static void xfer_scan_leave_dir(XferScan* scan, GFile* dir)
+{
+    XferScanListing* listing;
+
+    /* listings of a tree are contiguous in the queue, and everything before
+       it belongs to directories copying is still in, so they are at head */
+    while((listing = g_queue_peek_head(&scan->listings)) &&
+          xfer_scan_is_inside(listing->dir, NULL, dir))
+    {
+        g_queue_pop_head(&scan->listings);
+        scan->n_queued -= listing->n_children;
+        xfer_scan_listing_free(listing);
+    }
+    /* and don't let scanner queue anything from it anymore */
+    if(!g_hash_table_remove(scan->pending, dir) && scan->current &&
+       xfer_scan_is_inside(scan->current, NULL, dir))
+        g_hash_table_foreach_remove(scan->pending, xfer_scan_is_inside, dir);
+}
+
+/* retrieves children of dir if scanner kept them; updates job total */
+static gboolean xfer_scan_get_children(XferScan* scan, FmFileOpsJob* job,
+                                       GFile* dir, GSList** children)
+{
+    XferScanListing* listing;
+    GList* l = NULL;
+    gboolean found = FALSE;
+
+    g_mutex_lock(scan->lock);
+    /* copying goes depth-first, so it has finished every directory it was
+       in which does not contain this one */
+    while(scan->copying && !g_file_has_prefix(dir, scan->copying->data))
+    {
+        xfer_scan_leave_dir(scan, scan->copying->data);
+        g_object_unref(scan->copying->data);
+        scan->copying = g_slist_delete_link(scan->copying, scan->copying);
+    }
+    scan->copying = g_slist_prepend(scan->copying, g_object_ref(dir));
+    while(!fm_job_is_cancelled(scan->job))
+    {
+        /* only this thread removes listings, so l is still valid */
+        l = l ? l->next : g_queue_peek_head_link(&scan->listings);
+        if(l == NULL)
+        {
+            /* it was not scanned, e.g. created just now, or scanner is
+               past it already */
+            if(scan->done || !g_hash_table_lookup(scan->pending, dir))
+                break;
+            l = g_queue_peek_tail_link(&scan->listings);
+            g_cond_wait(scan->cond, scan->lock);
+            continue;
+        }
+        listing = l->data;
+        if(g_file_equal(listing->dir, dir))
+        {
+            g_queue_delete_link(&scan->listings, l);
+            scan->n_queued -= listing->n_children;
+            found = listing->kept;
+            *children = listing->children;
+            listing->children = NULL;
+            xfer_scan_listing_free(listing);
+            break;
+        }
+    }
+    job->total = scan->total;
+    g_mutex_unlock(scan->lock);
+    return found;
+}
+
+/* updates job total from what is counted so far and emits progress, so the
+   percentage doesn't run ahead while the scanner is still counting */
+static void xfer_scan_emit_percent(XferScan* scan, FmFileOpsJob* job)
+{
+    if(scan)
+    {
+        g_mutex_lock(scan->lock);
+        job->total = scan->total;
+        g_mutex_unlock(scan->lock);
+    }
+    fm_file_ops_job_emit_percent(job);
+}
+
+static void xfer_scan_progress_cb(goffset cur, goffset total, gpointer data)
+{
+    XferScan* scan = (XferScan*)data;
+    FmFileOpsJob* job = FM_FILE_OPS_JOB(scan->job);
+
+    job->current_file_finished = cur;
+    xfer_scan_emit_percent(scan, job);
+}
+
 static gboolean _fm_file_ops_job_check_paths(FmFileOpsJob* job, GFile* src, GFileInfo* src_inf, GFile* dest)
 {
     GError* err = NULL;
@@ -86,10 +437,278 @@ static gboolean _fm_file_ops_job_check_paths(FmFileOpsJob* job, GFile* src, GFil
     return (err == NULL);
 }
 
+/* copies file, for native files the kernel is asked to do it */
+static gboolean xfer_copy_file(GFile* src, GFile* dest, GFileCopyFlags flags,
+                               GCancellable* cancellable,
+                               GFileProgressCallback progress_callback,
+                               gpointer progress_callback_data, GError** error)
+{
+    char *src_path, *dest_path;
+    GError* err = NULL;
+    gboolean ret = FALSE, use_gio = TRUE;
+
+    src_path = g_file_get_path(src);
+    dest_path = src_path ? g_file_get_path(dest) : NULL;
+    if(dest_path)
+    {
+        ret = _fm_native_copy(src_path, dest_path,
+                              (flags & G_FILE_COPY_OVERWRITE) != 0, cancellable,
+                              progress_callback, progress_callback_data, &err);
+        /* if it is not a regular file then let GIO handle it */
+        if(ret || !g_error_matches(err, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+            use_gio = FALSE;
+        if(err && use_gio)
+            g_error_free(err);
+        else if(err)
+            g_propagate_error(error, err);
+    }
+    g_free(src_path);
+    g_free(dest_path);
+    if(use_gio)
+        ret = g_file_copy(src, dest, flags, cancellable, progress_callback,
+                          progress_callback_data, error);
+    return ret;
+}
+
+/* Parallel copy of small files.
+ * Copying many small files is dominated by per-file latency so regular files
+ * up to XFER_POOL_MAX_SIZE are copied by a pool of workers while the job
+ * thread continues the walk. Directories are still created by the job thread
+ * before their content is queued. Workers do only the plain copy: if it
+ * fails for any reason the file is copied again by the job thread the usual
+ * way, so conflict prompts and error dialogs are shown one by one as before.
+ * Mode and modification time of a created directory are set once the walk
+ * has left it and every file queued from inside it is finished, since adding
+ * files would change the time again. */
+
+#define XFER_POOL_MAX_SIZE      (1024 * 1024)
+#define XFER_POOL_MAX_WORKERS   8
+#define XFER_POOL_TASKS_QUEUED  64 /* per worker, limits memory usage */
+
+typedef struct _XferDir XferDir;
+struct _XferDir
+{
+    XferDir* parent;
+    GFile* dest;            /* NULL if metadata should not be set */
+    guint32 mode;
+    guint64 mtime;
+    guint32 mtime_usec;
+    guint n_ref;            /* the walk, queued files and subdirectories */
+};
+
+typedef struct
+{
+    FmFileOpsJob* job;
+    XferScan* scan;
+    XferDir* dir;           /* directory the walk is in */
+    GThreadPool* pool;
+    GAsyncQueue* done;      /* handled XferTask */
+    guint n_workers;
+    guint n_queued;
+    gboolean ret;
+} XferPool;
+
+typedef struct
+{
+    GFile* src;
+    GFile* dest;
+    FmFolder* dest_folder;
+    XferDir* dir;
+    guint64 size;
+    gboolean copied;
+} XferTask;
+
+static gboolean _fm_file_ops_job_copy_file(FmFileOpsJob* job, GFile* src,
+                                           GFileInfo* inf, GFile* dest,
+                                           FmFolder *src_folder, /* if move */
+                                           FmFolder *dest_folder,
+                                           XferScan *scan, XferPool *pool);
+
+static guint xfer_pool_n_workers(void)
+{
+#if GLIB_CHECK_VERSION(2, 36, 0)
+    return CLAMP(g_get_num_processors(), 2, XFER_POOL_MAX_WORKERS);
+#else
+    return 4;
+#endif
+}
+
+/* sets mode and modification time of a copied directory */
+static void xfer_dir_set_metadata(FmFileOpsJob* job, GFile* dest, guint32 mode,
+                                  guint64 mtime, guint32 mtime_usec)
+{
+    FmJob* fmjob = FM_JOB(job);
+    GError* err = NULL;
+
+    if(mode)
+    {
+_retry_chmod_for_dir:
+        mode |= (S_IRUSR|S_IWUSR); /* ensure we have rw permission to this file. */
+        if( !g_file_set_attribute_uint32(dest, G_FILE_ATTRIBUTE_UNIX_MODE,
+                                         mode, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                         fm_job_get_cancellable(fmjob), &err) )
+        {
+            FmJobErrorAction act = fm_job_emit_error(fmjob, err, FM_JOB_ERROR_MODERATE);
+            g_error_free(err);
+            err = NULL;
+            if(act == FM_JOB_RETRY)
+                goto _retry_chmod_for_dir;
+            /* FIXME: some filesystems may not support this. */
+        }
+    }
+    /* time is not essential, don't bother user if it cannot be set */
+    if(mtime && !fm_job_is_cancelled(fmjob) &&
+       g_file_set_attribute_uint64(dest, G_FILE_ATTRIBUTE_TIME_MODIFIED, mtime,
+                                   G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                   fm_job_get_cancellable(fmjob), NULL))
+        g_file_set_attribute_uint32(dest, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC,
+                                    mtime_usec, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                    fm_job_get_cancellable(fmjob), NULL);
+}
+
+/* called from the job thread; when the last reference is gone the
+   directory is finished, so its metadata is set, then its parent's
+   reference is dropped */
+static void xfer_dir_unref(FmFileOpsJob* job, XferDir* dir)
+{
+    XferDir* parent;
+
+    while(dir && --dir->n_ref == 0)
+    {
+        if(dir->dest)
+        {
+            if(!fm_job_is_cancelled(FM_JOB(job)))
+                xfer_dir_set_metadata(job, dir->dest, dir->mode, dir->mtime,
+                                      dir->mtime_usec);
+            g_object_unref(dir->dest);
+        }
+        parent = dir->parent;
+        g_slice_free(XferDir, dir);
+        dir = parent;
+    }
+}
+
+/* this is called from worker thread */
+static void xfer_pool_worker(gpointer data, gpointer user_data)
+{
+    XferTask* task = data;
+    XferPool* pool = user_data;
+    FmJob* fmjob = FM_JOB(pool->job);
+    GError* err = NULL;
+
+    /* existing file is a conflict, leave it to the job thread to ask */
+    if(!fm_job_is_cancelled(fmjob) &&
+       g_file_query_file_type(task->dest, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                              NULL) == G_FILE_TYPE_UNKNOWN)
+    {
+        task->copied = xfer_copy_file(task->src, task->dest,
+                                      G_FILE_COPY_ALL_METADATA|G_FILE_COPY_NOFOLLOW_SYMLINKS,
+                                      fm_job_get_cancellable(fmjob), NULL, NULL, &err);
+        if(!task->copied)
+        {
+            /* _fm_native_copy() removes its incomplete copy itself but
+               g_file_copy() doesn't; the file didn't exist before the copy
+               so if it's there now and not because someone else created it
+               meanwhile then it was created by this worker */
+            if(!(err->domain == G_IO_ERROR && err->code == G_IO_ERROR_EXISTS) &&
+               g_file_query_file_type(task->dest, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                      NULL) != G_FILE_TYPE_UNKNOWN)
+                g_file_delete(task->dest, NULL, NULL);
+            g_error_free(err);
+        }
+    }
+    g_async_queue_push(pool->done, task);
+}
+
+static void xfer_task_finish(XferPool* pool, XferTask* task)
+{
+    FmFileOpsJob* job = pool->job;
+    FmPath* fm_dest;
+
+    pool->n_queued--;
+    if(fm_job_is_cancelled(FM_JOB(job)))
+        pool->ret = FALSE;
+    else if(task->copied)
+    {
+        job->finished += task->size;
+        if(task->dest_folder)
+        {
+            fm_dest = fm_path_new_for_gfile(task->dest);
+            if(!_fm_folder_event_file_added(task->dest_folder, fm_dest))
+                fm_path_unref(fm_dest);
+        }
+        xfer_scan_emit_percent(pool->scan, job);
+    }
+    /* retry in the job thread, it will ask user what to do */
+    else if(!_fm_file_ops_job_copy_file(job, task->src, NULL, task->dest,
+                                        NULL, task->dest_folder, NULL, NULL))
+        pool->ret = FALSE;
+    xfer_dir_unref(job, task->dir);
+    g_object_unref(task->src);
+    g_object_unref(task->dest);
+    if(task->dest_folder)
+        g_object_unref(task->dest_folder);
+    g_slice_free(XferTask, task);
+}
+
+static XferPool* xfer_pool_new(FmFileOpsJob* job, XferScan* scan)
+{
+    XferPool* pool = g_slice_new(XferPool);
+
+    pool->job = job;
+    pool->scan = scan;
+    pool->dir = NULL;
+    pool->done = g_async_queue_new();
+    pool->n_workers = xfer_pool_n_workers();
+    pool->n_queued = 0;
+    pool->ret = TRUE;
+    pool->pool = g_thread_pool_new(xfer_pool_worker, pool, pool->n_workers,
+                                   FALSE, NULL);
+    return pool;
+}
+
+static void xfer_pool_push(XferPool* pool, GFile* src, GFile* dest,
+                           guint64 size, FmFolder* dest_folder)
+{
+    XferTask* task = g_slice_new(XferTask);
+
+    task->src = g_object_ref(src);
+    task->dest = g_object_ref(dest);
+    task->dest_folder = dest_folder ? g_object_ref(dest_folder) : NULL;
+    task->dir = pool->dir;
+    if(task->dir)
+        task->dir->n_ref++;
+    task->size = size;
+    task->copied = FALSE;
+    g_thread_pool_push(pool->pool, task, NULL);
+    /* don't let the walk run too far ahead of workers */
+    if(++pool->n_queued >= pool->n_workers * XFER_POOL_TASKS_QUEUED)
+        xfer_task_finish(pool, g_async_queue_pop(pool->done));
+    /* update progress as soon as files are copied */
+    while(pool->n_queued > 0 && (task = g_async_queue_try_pop(pool->done)) != NULL)
+        xfer_task_finish(pool, task);
+}
+
+/* waits for all queued files and frees pool, returns FALSE on any failure */
+static gboolean xfer_pool_free(XferPool* pool)
+{
+    gboolean ret;
+
+    /* cancelled workers return tasks early so this never stalls */
+    while(pool->n_queued > 0)
+        xfer_task_finish(pool, g_async_queue_pop(pool->done));
+    g_thread_pool_free(pool->pool, FALSE, TRUE);
+    g_async_queue_unref(pool->done);
+    ret = pool->ret;
+    g_slice_free(XferPool, pool);
+    return ret;
+}
+
 static gboolean _fm_file_ops_job_copy_file(FmFileOpsJob* job, GFile* src,
                                            GFileInfo* inf, GFile* dest,
                                            FmFolder *src_folder, /* if move */
-                                           FmFolder *dest_folder)
+                                           FmFolder *dest_folder,
+                                           XferScan *scan, XferPool *pool)
 {
     gboolean ret = FALSE;
     gboolean delete_src = FALSE;
@@ -101,6 +720,8 @@ static gboolean _fm_file_ops_job_copy_file(FmFileOpsJob* job, GFile* src,
     FmJob* fmjob = FM_JOB(job);
     FmPath *fm_dest;
     guint32 mode;
+    guint64 mtime;
+    guint32 mtime_usec;
     gboolean skip_dir_content = FALSE;
 
     job->supported_options = FM_FILE_OP_RENAME | FM_FILE_OP_SKIP | FM_FILE_OP_OVERWRITE;
@@ -138,6 +759,8 @@ _retry_query_src_info:
 
     size = g_file_info_get_size(inf);
     mode = g_file_info_get_attribute_uint32(inf, G_FILE_ATTRIBUTE_UNIX_MODE);
+    mtime = g_file_info_get_attribute_uint64(inf, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+    mtime_usec = g_file_info_get_attribute_uint32(inf, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
 
     g_object_unref(inf);
     inf = NULL;
@@ -146,8 +769,11 @@ _retry_query_src_info:
     {
     case G_FILE_TYPE_DIRECTORY:
         {
-            GFileEnumerator* enu;
+            GFileEnumerator* enu = NULL;
+            GSList* children = NULL;
+            gboolean scanned = FALSE;
             gboolean dir_created = FALSE;
+            gboolean set_metadata = FALSE;
 _retry_mkdir:
             if( !fm_job_is_cancelled(fmjob) && !job->skip_dir_content &&
                 !g_file_make_directory(dest, fm_job_get_cancellable(fmjob), &err) )
@@ -177,7 +803,7 @@ _retry_mkdir:
                     case FM_FILE_OP_SKIP:
                         /* when a dir is skipped, we need to know its total size to calculate correct progress */
                         job->finished += size;
-                        fm_file_ops_job_emit_percent(job);
+                        xfer_scan_emit_percent(scan, job);
                         job->skip_dir_content = skip_dir_content = TRUE;
                         dir_created = TRUE; /* pretend that dir creation succeeded */
                         break;
@@ -199,33 +825,18 @@ _retry_mkdir:
                         goto _retry_mkdir;
                 }
                 job->finished += size;
-                fm_file_ops_job_emit_percent(job);
+                xfer_scan_emit_percent(scan, job);
             }
             else
             {
-                /* chmod the newly created dir properly */
+                /* chmod the newly created dir properly, after its content */
                 if(!fm_job_is_cancelled(fmjob) && !job->skip_dir_content)
                 {
-                    if(mode)
-                    {
-_retry_chmod_for_dir:
-                        mode |= (S_IRUSR|S_IWUSR); /* ensure we have rw permission to this file. */
-                        if( !g_file_set_attribute_uint32(dest, G_FILE_ATTRIBUTE_UNIX_MODE,
-                                                         mode, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                                         fm_job_get_cancellable(fmjob), &err) )
-                        {
-                            FmJobErrorAction act = fm_job_emit_error(fmjob, err, FM_JOB_ERROR_MODERATE);
-                            g_error_free(err);
-                            err = NULL;
-                            if(act == FM_JOB_RETRY)
-                                goto _retry_chmod_for_dir;
-                            /* FIXME: some filesystems may not support this. */
-                        }
-                    }
+                    set_metadata = TRUE;
                     dir_created = TRUE;
                 }
                 job->finished += size;
-                fm_file_ops_job_emit_percent(job);
+                xfer_scan_emit_percent(scan, job);
             }
 
             if(!dir_created) /* if target dir is not created, don't copy dir content */
@@ -240,7 +851,22 @@ _retry_chmod_for_dir:
             {
                 FmFolder *sub_folder;
                 FmFolder *sub_src = NULL;
+                XferDir *xdir = NULL;
 
+                /* files queued from inside hold the directory unfinished */
+                if(pool)
+                {
+                    xdir = g_slice_new(XferDir);
+                    xdir->parent = pool->dir;
+                    if(xdir->parent)
+                        xdir->parent->n_ref++;
+                    xdir->dest = set_metadata ? g_object_ref(dest) : NULL;
+                    xdir->mode = mode;
+                    xdir->mtime = mtime;
+                    xdir->mtime_usec = mtime_usec;
+                    xdir->n_ref = 1;
+                    pool->dir = xdir;
+                }
                 if (delete_src)
                 {
                     FmPath *src_path = fm_path_new_for_gfile(src);
@@ -252,17 +878,29 @@ _retry_chmod_for_dir:
                 /* inform folder we created directory */
                 if (!dest_folder || !_fm_folder_event_file_added(dest_folder, fm_dest))
                     fm_path_unref(fm_dest);
+                /* take listing from scanner if it has one */
+                if(scan)
+                    scanned = xfer_scan_get_children(scan, job, src, &children);
+                if(!scanned)
+                {
 _retry_enum_children:
-                enu = g_file_enumerate_children(src, query, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                            fm_job_get_cancellable(fmjob), &err);
-                if(enu)
+                    enu = g_file_enumerate_children(src, query, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                                    fm_job_get_cancellable(fmjob), &err);
+                }
+                if(scanned || enu)
                 {
                     int n_children = 0;
                     int n_copied = 0;
                     ret = TRUE;
                     while( !fm_job_is_cancelled(fmjob) )
                     {
-                        inf = g_file_enumerator_next_file(enu, fm_job_get_cancellable(fmjob), &err);
+                        if(scanned)
+                        {
+                            inf = children ? children->data : NULL;
+                            children = g_slist_delete_link(children, children);
+                        }
+                        else
+                            inf = g_file_enumerator_next_file(enu, fm_job_get_cancellable(fmjob), &err);
                         if( inf )
                         {
                             ++n_children;
@@ -271,7 +909,7 @@ _retry_enum_children:
                             {
                                 /* FIXME: this is incorrect as we don't do the calculation recursively. */
                                 job->finished += g_file_info_get_size(inf);
-                                fm_file_ops_job_emit_percent(job);
+                                xfer_scan_emit_percent(scan, job);
                             }
                             else
                             {
@@ -295,7 +933,7 @@ _retry_enum_children:
                                         tmp_basename ? tmp_basename : g_file_info_get_name(inf));
                                 g_free(tmp_basename);
 
-                                ret2 = _fm_file_ops_job_copy_file(job, sub, inf, sub_dest, sub_src, sub_folder);
+                                ret2 = _fm_file_ops_job_copy_file(job, sub, inf, sub_dest, sub_src, sub_folder, scan, pool);
                                 g_object_unref(sub);
                                 g_object_unref(sub_dest);
 
@@ -339,8 +977,14 @@ _retry_enum_children:
                             }
                         }
                     }
-                    g_file_enumerator_close(enu, NULL, &err);
-                    g_object_unref(enu);
+                    if(enu)
+                    {
+                        g_file_enumerator_close(enu, NULL, &err);
+                        g_object_unref(enu);
+                    }
+                    /* left after cancellation */
+                    g_slist_foreach(children, (GFunc)g_object_unref, NULL);
+                    g_slist_free(children);
                 }
                 else
                 {
@@ -354,6 +998,13 @@ _retry_enum_children:
                     g_object_unref(sub_src);
                 if (sub_folder)
                     g_object_unref(sub_folder);
+                if(xdir)
+                {
+                    pool->dir = xdir->parent;
+                    xfer_dir_unref(job, xdir);
+                }
+                else if(set_metadata && !fm_job_is_cancelled(fmjob))
+                    xfer_dir_set_metadata(job, dest, mode, mtime, mtime_usec);
             }
             if(job->skip_dir_content)
                 delete_src = FALSE;
@@ -396,10 +1047,18 @@ _retry_enum_children:
         goto _file_copied;
 
     default:
+        /* small files are copied in parallel, see XferPool above */
+        if(pool && !delete_src && size <= XFER_POOL_MAX_SIZE)
+        {
+            xfer_pool_push(pool, src, dest, size, dest_folder);
+            ret = TRUE;
+            break;
+        }
         flags = G_FILE_COPY_ALL_METADATA|G_FILE_COPY_NOFOLLOW_SYMLINKS;
 _retry_copy:
-        if( !g_file_copy(src, dest, flags, fm_job_get_cancellable(fmjob),
-                         progress_cb, fmjob, &err) )
+        if( !xfer_copy_file(src, dest, flags, fm_job_get_cancellable(fmjob),
+                            scan ? xfer_scan_progress_cb : progress_cb,
+                            scan ? (gpointer)scan : (gpointer)fmjob, &err) )
         {
             flags &= ~G_FILE_COPY_OVERWRITE;
 
@@ -474,7 +1133,7 @@ _file_copied:
         }
 
         /* update progress */
-        fm_file_ops_job_emit_percent(job);
+        xfer_scan_emit_percent(scan, job);
         break;
     }
     /* if this is a cross-device move operation, delete source files. */
@@ -665,7 +1324,7 @@ _retry_move:
     {
         /* use copy & delete */
         /* source file will be deleted in _fm_file_ops_job_copy_file() */
-        ret = _fm_file_ops_job_copy_file(job, src, inf, dest, src_folder, dest_folder);
+        ret = _fm_file_ops_job_copy_file(job, src, inf, dest, src_folder, dest_folder, NULL, NULL);
     }
 
     if(new_dest)
@@ -689,21 +1348,18 @@ gboolean _fm_file_ops_job_copy_run(FmFileOpsJob* job)
     GFile *dest_dir;
     GList* l;
     FmJob* fmjob = FM_JOB(job);
-    /* prepare the job, count total work needed with FmDeepCountJob */
-    FmDeepCountJob* dc = fm_deep_count_job_new(job->srcs, FM_DC_JOB_DEFAULT);
+    /* count total work needed while copying, see XferScan above */
+    XferScan* scan = xfer_scan_new(job);
+    XferPool* pool;
     FmFolder *df;
 
-    /* let the deep count job share the same cancellable object. */
-    fm_job_set_cancellable(FM_JOB(dc), fm_job_get_cancellable(fmjob));
-    fm_job_run_sync(FM_JOB(dc));
-    job->total = dc->total_size;
+    /* don't start with 100% done */
+    xfer_scan_wait_roots(scan, job);
     if(fm_job_is_cancelled(fmjob))
     {
-        g_object_unref(dc);
+        xfer_scan_free(scan);
         return FALSE;
     }
-    g_object_unref(dc);
-    g_debug("total size to copy: %llu", (long long unsigned int)job->total);
 
     dest_dir = fm_path_to_gfile(job->dest);
     /* suspend updates for destination */
@@ -713,6 +1369,7 @@ gboolean _fm_file_ops_job_copy_run(FmFileOpsJob* job)
 
     fm_file_ops_job_emit_prepared(job);
 
+    pool = xfer_pool_new(job, scan);
     for(l = fm_path_list_peek_head_link(job->srcs); !fm_job_is_cancelled(fmjob) && l; l=l->next)
     {
         FmPath* path = FM_PATH(l->data);
@@ -752,13 +1409,17 @@ gboolean _fm_file_ops_job_copy_run(FmFileOpsJob* job)
         dest = g_file_get_child(dest_dir,
                         tmp_basename ? tmp_basename : fm_path_get_basename(path));
         g_free(tmp_basename);
-        if(!_fm_file_ops_job_copy_file(job, src, NULL, dest, NULL, df))
+        if(!_fm_file_ops_job_copy_file(job, src, NULL, dest, NULL, df, scan, pool))
             ret = FALSE;
         g_object_unref(src);
         if(dest != NULL)
             g_object_unref(dest);
     }
+    if(!xfer_pool_free(pool))
+        ret = FALSE;
 
+    job->total = xfer_scan_free(scan);
+    g_debug("total size copied: %llu", (long long unsigned int)job->total);
     /* g_debug("finished: %llu, total: %llu", job->finished, job->total); */
     fm_file_ops_job_emit_percent(job);
 
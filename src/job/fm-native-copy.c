@@ -0,0 +1,414 @@
+/*
+ *      fm-native-copy.c
+ *
+ *      This file is a part of the Libfm library.
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Copy of regular files between native file systems.
+ * Data are copied by the fastest method the kernel and file systems allow:
+ * reflink (FICLONE) shares extents on btrfs, XFS and others so even huge
+ * files are copied instantly, then copy_file_range() which lets the file
+ * system or NFS server copy data itself, then sendfile(), and at last plain
+ * read() and write(). Only the last two pass data through page cache of
+ * this process. Metadata are copied the same way G_FILE_COPY_ALL_METADATA
+ * does it, and errors on that are ignored as GIO does. */
+
+#define _GNU_SOURCE /* for copy_file_range() */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "fm-native-copy.h"
+
+#include <glib/gi18n-lib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+#if defined(HAVE_SYS_SENDFILE_H) && defined(__linux__)
+#include <sys/sendfile.h>
+#define NATIVE_COPY_SENDFILE 1
+#endif
+#ifdef HAVE_SYS_XATTR_H
+#include <sys/xattr.h>
+#endif
+
+#define COPY_CHUNK_SIZE     (8 * 1024 * 1024) /* data between progress reports */
+#define COPY_BUFFER_SIZE    (256 * 1024)
+
+typedef struct
+{
+    int src_fd;
+    int dest_fd;
+    goffset size;
+    goffset copied;
+    GCancellable *cancellable;
+    GFileProgressCallback progress_callback;
+    gpointer progress_callback_data;
+} NativeCopy;
+
+static void _copy_progress(NativeCopy *copy)
+{
+    if (copy->progress_callback)
+        copy->progress_callback(copy->copied, copy->size,
+                                copy->progress_callback_data);
+}
+
+/* Each method returns 1 if all data are copied, 0 if the method is not
+   supported for these files (and nothing was copied), or -1 on error or
+   cancellation, with errno set in case of error. */
+
+static int _copy_clone(NativeCopy *copy)
+{
+#ifdef FICLONE
+    if (ioctl(copy->dest_fd, FICLONE, copy->src_fd) == 0)
+    {
+        copy->copied = copy->size;
+        _copy_progress(copy);
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+#ifdef HAVE_COPY_FILE_RANGE
+static int _copy_range(NativeCopy *copy)
+{
+    ssize_t n;
+
+    while (!g_cancellable_is_cancelled(copy->cancellable))
+    {
+        n = copy_file_range(copy->src_fd, NULL, copy->dest_fd, NULL,
+                            COPY_CHUNK_SIZE, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            /* not supported by kernel or between these file systems */
+            if (copy->copied == 0 && (errno == ENOSYS || errno == EXDEV ||
+                                      errno == EINVAL || errno == EOPNOTSUPP))
+                return 0;
+            return -1;
+        }
+        if (n == 0)
+        {
+            /* some pseudo file systems report no data this way */
+            if (copy->copied == 0 && copy->size > 0)
+                return 0;
+            return 1;
+        }
+        copy->copied += n;
+        _copy_progress(copy);
+    }
+    return -1;
+}
+#endif
+
+#ifdef NATIVE_COPY_SENDFILE
+static int _copy_sendfile(NativeCopy *copy)
+{
+    ssize_t n;
+
+    while (!g_cancellable_is_cancelled(copy->cancellable))
+    {
+        n = sendfile(copy->dest_fd, copy->src_fd, NULL, COPY_CHUNK_SIZE);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (copy->copied == 0 && (errno == ENOSYS || errno == EINVAL))
+                return 0;
+            return -1;
+        }
+        if (n == 0)
+        {
+            if (copy->copied == 0 && copy->size > 0)
+                return 0;
+            return 1;
+        }
+        copy->copied += n;
+        _copy_progress(copy);
+    }
+    return -1;
+}
+#endif
+
+static gboolean _write_all(int fd, const char *buf, gsize len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = write(fd, buf, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return FALSE;
+        }
+        buf += n;
+        len -= n;
+    }
+    return TRUE;
+}
+
+static int _copy_read_write(NativeCopy *copy)
+{
+    char *buf = g_malloc(COPY_BUFFER_SIZE);
+    goffset reported = copy->copied;
+    ssize_t n;
+    int ret = -1, errsv = 0;
+
+    while (!g_cancellable_is_cancelled(copy->cancellable))
+    {
+        n = read(copy->src_fd, buf, COPY_BUFFER_SIZE);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            errsv = errno;
+            break;
+        }
+        if (n == 0)
+        {
+            ret = 1;
+            _copy_progress(copy);
+            break;
+        }
+        if (!_write_all(copy->dest_fd, buf, n))
+        {
+            errsv = errno;
+            break;
+        }
+        copy->copied += n;
+        if (copy->copied - reported >= COPY_CHUNK_SIZE)
+        {
+            reported = copy->copied;
+            _copy_progress(copy);
+        }
+    }
+    g_free(buf);
+    errno = errsv;
+    return ret;
+}
+
+#ifdef HAVE_SYS_XATTR_H
+/* copies extended attributes in user namespace, as GIO does */
+static void _copy_xattrs(int src_fd, int dest_fd)
+{
+    char *names, *name, *value = NULL;
+    ssize_t len, n;
+    gsize value_size = 0;
+
+    len = flistxattr(src_fd, NULL, 0);
+    if (len <= 0)
+        return;
+    names = g_malloc(len);
+    len = flistxattr(src_fd, names, len);
+    for (name = names; len > 0 && name < names + len; name += strlen(name) + 1)
+    {
+        if (strncmp(name, "user.", 5) != 0)
+            continue;
+        n = fgetxattr(src_fd, name, NULL, 0);
+        if (n < 0)
+            continue;
+        if ((gsize)n > value_size)
+        {
+            value_size = n;
+            value = g_realloc(value, value_size);
+        }
+        n = fgetxattr(src_fd, name, value, n);
+        if (n >= 0)
+            fsetxattr(dest_fd, name, value, n, 0);
+    }
+    g_free(value);
+    g_free(names);
+}
+#endif
+
+static void _copy_metadata(NativeCopy *copy, const struct stat *st)
+{
+#ifdef HAVE_FUTIMENS
+    struct timespec times[2];
+#endif
+
+#ifdef HAVE_SYS_XATTR_H
+    _copy_xattrs(copy->src_fd, copy->dest_fd);
+#endif
+    /* owner first since chown() may clear setuid bits */
+    if (fchown(copy->dest_fd, st->st_uid, st->st_gid) < 0)
+    {
+        /* only root may give files away, that is fine */
+    }
+    fchmod(copy->dest_fd, st->st_mode & 07777);
+#ifdef HAVE_FUTIMENS
+    times[0] = st->st_atim;
+    times[1] = st->st_mtim;
+    futimens(copy->dest_fd, times);
+#endif
+}
+
+static void _set_error(GError **error, int errsv, const char *path)
+{
+    char *disp = g_filename_display_name(path);
+
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+                _("Error copying file '%s': %s"), disp, g_strerror(errsv));
+    g_free(disp);
+}
+
+static void _set_not_supported(GError **error)
+{
+    g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                        "Not a regular file");
+}
+
+/**
+ * _fm_native_copy:
+ * @src_path: source file path in file system encoding
+ * @dest_path: destination file path in file system encoding
+ * @overwrite: %TRUE to replace existing destination file
+ * @cancellable: (allow-none): optional cancellable object
+ * @progress_callback: (allow-none): function to report progress
+ * @progress_callback_data: data to pass to @progress_callback
+ * @error: (out) (allow-none): location to store error
+ *
+ * Copies regular file with its metadata, like g_file_copy() does with flags
+ * %G_FILE_COPY_NOFOLLOW_SYMLINKS and %G_FILE_COPY_ALL_METADATA. If the
+ * source is not a regular file or the destination is an existing directory
+ * then fails with %G_IO_ERROR_NOT_SUPPORTED before doing anything, so
+ * caller can use g_file_copy() instead. Replaced file is kept intact until
+ * the copy is complete. Incomplete copy is removed on error.
+ *
+ * Returns: %TRUE if file was copied.
+ */
+gboolean _fm_native_copy(const char *src_path, const char *dest_path,
+                         gboolean overwrite, GCancellable *cancellable,
+                         GFileProgressCallback progress_callback,
+                         gpointer progress_callback_data, GError **error)
+{
+    NativeCopy copy;
+    struct stat st;
+    char *tmp_path = NULL;
+    int r, errsv;
+
+    /* O_NONBLOCK so it doesn't hang if source was replaced with a FIFO */
+    copy.src_fd = open(src_path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (copy.src_fd < 0)
+    {
+        errsv = errno;
+        if (errsv == ELOOP) /* it's a symlink */
+            _set_not_supported(error);
+        else
+            _set_error(error, errsv, src_path);
+        return FALSE;
+    }
+    if (fstat(copy.src_fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        close(copy.src_fd);
+        _set_not_supported(error);
+        return FALSE;
+    }
+    /* it's a regular file, reads should block as usual */
+    if ((r = fcntl(copy.src_fd, F_GETFL)) < 0 ||
+        fcntl(copy.src_fd, F_SETFL, r & ~O_NONBLOCK) < 0)
+    {
+        _set_error(error, errno, src_path);
+        close(copy.src_fd);
+        return FALSE;
+    }
+
+    if (overwrite)
+    {
+        struct stat dest_st;
+        char *dir;
+
+        if (lstat(dest_path, &dest_st) == 0 && S_ISDIR(dest_st.st_mode))
+        {
+            /* let GIO report that */
+            close(copy.src_fd);
+            _set_not_supported(error);
+            return FALSE;
+        }
+        /* write a temporary file and replace destination when done */
+        dir = g_path_get_dirname(dest_path);
+        tmp_path = g_build_filename(dir, ".fm-copy-XXXXXX", NULL);
+        g_free(dir);
+        copy.dest_fd = g_mkstemp_full(tmp_path, O_WRONLY | O_CLOEXEC,
+                                      S_IRUSR | S_IWUSR);
+    }
+    else
+        copy.dest_fd = open(dest_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                            S_IRUSR | S_IWUSR);
+    if (copy.dest_fd < 0)
+    {
+        _set_error(error, errno, dest_path);
+        close(copy.src_fd);
+        g_free(tmp_path);
+        return FALSE;
+    }
+
+    copy.size = st.st_size;
+    copy.copied = 0;
+    copy.cancellable = cancellable;
+    copy.progress_callback = progress_callback;
+    copy.progress_callback_data = progress_callback_data;
+
+    /* files in pseudo file systems have zero size, read them as is */
+    r = (copy.size > 0) ? _copy_clone(&copy) : 0;
+#ifdef HAVE_COPY_FILE_RANGE
+    if (r == 0 && copy.size > 0)
+        r = _copy_range(&copy);
+#endif
+#ifdef NATIVE_COPY_SENDFILE
+    if (r == 0 && copy.size > 0)
+        r = _copy_sendfile(&copy);
+#endif
+    if (r == 0)
+        r = _copy_read_write(&copy);
+    errsv = errno;
+    if (r > 0)
+        _copy_metadata(&copy, &st);
+    /* delayed write errors are reported on close, on NFS for example */
+    if (close(copy.dest_fd) < 0 && r > 0)
+    {
+        r = -1;
+        errsv = errno;
+    }
+    close(copy.src_fd);
+    if (r > 0 && tmp_path && rename(tmp_path, dest_path) < 0)
+    {
+        r = -1;
+        errsv = errno;
+    }
+    if (r < 0)
+    {
+        unlink(tmp_path ? tmp_path : dest_path);
+        if (!g_cancellable_set_error_if_cancelled(cancellable, error))
+            _set_error(error, errsv, src_path);
+    }
+    g_free(tmp_path);
+    return (r > 0);
+}
@@ -0,0 +1,255 @@
+/*
+ *      fm-stat-batch.c
+ *
+ *      This file is a part of the Libfm library.
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Batched stat() for directory entries.
+ * If libfm is built with liburing and running kernel supports it then
+ * IORING_OP_STATX requests for whole batch are submitted at once, so on
+ * network file systems and cold cache we wait for a few round trips instead
+ * of one round trip per file. Otherwise it does fstatat() for each entry.
+ * Each thread uses its own ring since rings cannot be shared. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "fm-stat-batch.h"
+
+#ifdef HAVE_FSTATAT
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(USE_IO_URING) && GLIB_CHECK_VERSION(2, 32, 0)
+#include <liburing.h>
+#include <sys/sysmacros.h>
+#define STAT_BATCH_URING 1
+
+#define STAT_BATCH_RING_SIZE 64
+
+/* -1 if not supported, 0 if not tested yet, 1 if works */
+static volatile gint uring_state = 0;
+
+static void _ring_free(gpointer data)
+{
+    struct io_uring *ring = data;
+
+    io_uring_queue_exit(ring);
+    g_slice_free(struct io_uring, ring);
+}
+
+static GPrivate thread_ring = G_PRIVATE_INIT(_ring_free);
+
+static gboolean _statx_is_supported(struct io_uring *ring)
+{
+    struct io_uring_probe *probe = io_uring_get_probe_ring(ring);
+    gboolean ret;
+
+    /* kernels before 5.6 have no probe but have no STATX either */
+    if (probe == NULL)
+        return FALSE;
+    ret = io_uring_opcode_supported(probe, IORING_OP_STATX);
+    io_uring_free_probe(probe);
+    return ret;
+}
+
+static struct io_uring *_get_thread_ring(void)
+{
+    struct io_uring *ring;
+
+    if (g_atomic_int_get(&uring_state) < 0)
+        return NULL;
+    ring = g_private_get(&thread_ring);
+    if (ring)
+        return ring;
+    ring = g_slice_new(struct io_uring);
+    /* it may fail due to missing kernel support, seccomp or RLIMIT_MEMLOCK */
+    if (io_uring_queue_init(STAT_BATCH_RING_SIZE, ring, 0) < 0)
+    {
+        g_slice_free(struct io_uring, ring);
+        g_atomic_int_set(&uring_state, -1);
+        return NULL;
+    }
+    if (g_atomic_int_get(&uring_state) == 0)
+    {
+        if (!_statx_is_supported(ring))
+        {
+            _ring_free(ring);
+            g_atomic_int_set(&uring_state, -1);
+            return NULL;
+        }
+        g_atomic_int_set(&uring_state, 1);
+    }
+    g_private_set(&thread_ring, ring);
+    return ring;
+}
+
+static void _statx_to_stat(const struct statx *stx, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    st->st_size = stx->stx_size;
+    st->st_blksize = stx->stx_blksize;
+    st->st_blocks = stx->stx_blocks;
+    st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/* waits for a completion and stores its result, returns FALSE on failure */
+static gboolean _stat_batch_reap(struct io_uring *ring, FmStatBatchEntry *entries,
+                                 struct statx *stx)
+{
+    struct io_uring_cqe *cqe;
+    guint idx;
+    int ret;
+
+    do
+        ret = io_uring_wait_cqe(ring, &cqe);
+    while (ret == -EINTR || ret == -EAGAIN);
+    if (ret < 0)
+        return FALSE;
+    idx = GPOINTER_TO_UINT(io_uring_cqe_get_data(cqe));
+    if (cqe->res < 0)
+        entries[idx].error = -cqe->res;
+    else
+    {
+        entries[idx].error = 0;
+        _statx_to_stat(&stx[idx], &entries[idx].st);
+    }
+    io_uring_cqe_seen(ring, cqe);
+    return TRUE;
+}
+
+/* returns number of entries handled, less than @n_entries on failure */
+static guint _stat_batch_uring(struct io_uring *ring, int dir_fd,
+                               FmStatBatchEntry *entries, guint n_entries,
+                               gboolean follow_links)
+{
+    /* kernel writes into it until request is complete, so it's not on stack
+       and can be abandoned if completions cannot be reaped for some reason */
+    struct statx *stx = g_new(struct statx, STAT_BATCH_RING_SIZE);
+    int flags = follow_links ? 0 : AT_SYMLINK_NOFOLLOW;
+    guint done = 0;
+
+    while (done < n_entries)
+    {
+        guint n = MIN(n_entries - done, STAT_BATCH_RING_SIZE);
+        guint i, submitted = 0, reaped = 0;
+        int ret = 0;
+
+        for (i = 0; i < n; i++)
+        {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+
+            if (sqe == NULL) /* ring is empty after each batch, but anyway */
+                break;
+            io_uring_prep_statx(sqe, dir_fd, entries[done + i].name, flags,
+                                STATX_BASIC_STATS, &stx[i]);
+            io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(i));
+        }
+        n = i;
+        while (submitted < n)
+        {
+            ret = io_uring_submit(ring);
+            if (ret > 0)
+                submitted += ret;
+            else if (ret == -EINTR)
+                continue;
+            /* out of resources, wait for something to complete */
+            else if ((ret == -EAGAIN || ret == -EBUSY) && reaped < submitted)
+            {
+                if (!_stat_batch_reap(ring, entries + done, stx))
+                    goto _broken;
+                reaped++;
+            }
+            else
+                break;
+        }
+        /* every submitted request must complete before stx is reused */
+        for (; reaped < submitted; reaped++)
+            if (!_stat_batch_reap(ring, entries + done, stx))
+                goto _broken;
+        done += submitted;
+        if (submitted < n)
+        {
+            /* unsubmitted requests are still queued in the ring so it can
+               not be used anymore; nothing is in flight so it's safe to
+               drop it, the next batch will create a new one */
+            g_private_replace(&thread_ring, NULL);
+            if (ret == -ENOSYS || ret == -EOPNOTSUPP || ret == -EINVAL || ret == -EPERM)
+                g_atomic_int_set(&uring_state, -1);
+            break;
+        }
+    }
+    g_free(stx);
+    return done;
+
+_broken:
+    /* should never happen; requests may be still in flight so leave both
+       the ring and stx alone, and never use io_uring again */
+    g_atomic_int_set(&uring_state, -1);
+    g_private_set(&thread_ring, NULL);
+    return done;
+}
+#endif /* USE_IO_URING */
+
+/*
+ * _fm_stat_batch
+ * @dir_fd: descriptor of open directory
+ * @entries: (inout): entries to test
+ * @n_entries: number of @entries
+ * @follow_links: %TRUE to return data of symlink targets
+ *
+ * Retrieves stat data for each name in @entries relative to @dir_fd.
+ * Results are stored in @entries. This call may be used from any thread.
+ */
+void _fm_stat_batch(int dir_fd, FmStatBatchEntry *entries, guint n_entries,
+                    gboolean follow_links)
+{
+    guint i = 0;
+
+#ifdef STAT_BATCH_URING
+    struct io_uring *ring;
+
+    /* a single file is not worth a submission */
+    if (n_entries > 1 && (ring = _get_thread_ring()) != NULL)
+        i = _stat_batch_uring(ring, dir_fd, entries, n_entries, follow_links);
+#endif
+    for (; i < n_entries; i++)
+    {
+        if (fstatat(dir_fd, entries[i].name, &entries[i].st,
+                    follow_links ? 0 : AT_SYMLINK_NOFOLLOW) == 0)
+            entries[i].error = 0;
+        else
+            entries[i].error = errno;
+    }
+}
+#endif /* HAVE_FSTATAT */
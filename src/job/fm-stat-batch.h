@@ -0,0 +1,52 @@
+/*
+ *      fm-stat-batch.h
+ *
+ *      This file is a part of the Libfm library.
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __FM_STAT_BATCH_H__
+#define __FM_STAT_BATCH_H__
+
+#include <glib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+G_BEGIN_DECLS
+
+/* this is internal API for native jobs, not exported from the library */
+
+typedef struct _FmStatBatchEntry FmStatBatchEntry;
+
+/*
+ * FmStatBatchEntry:
+ * @name: name of file relative to the directory
+ * @st: stat data, valid if @error is 0
+ * @error: errno value of failed call or 0
+ */
+struct _FmStatBatchEntry
+{
+    const char *name;
+    struct stat st;
+    int error;
+};
+
+void _fm_stat_batch(int dir_fd, FmStatBatchEntry *entries, guint n_entries,
+                    gboolean follow_links);
+
+G_END_DECLS
+
+#endif /* __FM_STAT_BATCH_H__ */
@@ -442,6 +442,127 @@ static void test_predefined_paths()
 */
 }
 
+#define N_INTERN_THREADS 8
+#define N_INTERN_LOOPS 10000
+
+static gpointer intern_thread(gpointer data)
+{
+    FmPath* parent = data;
+    FmPath* first = fm_path_new_child(parent, "shared");
+    int i;
+
+    /* while first is held every lookup should return it */
+    for(i = 0; i < N_INTERN_LOOPS; i++)
+    {
+        FmPath* path = fm_path_new_child(parent, "shared");
+        g_assert(path == first);
+        fm_path_unref(path);
+    }
+    return first;
+}
+
+static gpointer churn_thread(gpointer data)
+{
+    FmPath* parent = data;
+    int i;
+
+    /* the last reference is dropped all the time so lookups race with
+       destruction of the path */
+    for(i = 0; i < N_INTERN_LOOPS; i++)
+    {
+        FmPath* path = fm_path_new_child(parent, "churn");
+        g_assert(fm_path_get_parent(path) == parent);
+        g_assert_cmpstr(fm_path_get_basename(path), ==, "churn");
+        fm_path_unref(path);
+    }
+    return NULL;
+}
+
+static GThread* start_thread(GThreadFunc func, gpointer data)
+{
+#if GLIB_CHECK_VERSION(2, 32, 0)
+    return g_thread_new("test", func, data);
+#else
+    return g_thread_create(func, data, TRUE, NULL);
+#endif
+}
+
+static void test_path_intern_threads()
+{
+    FmPath* parent = fm_path_new_for_path("/test-fm-path");
+    GThread* threads[N_INTERN_THREADS];
+    FmPath* paths[N_INTERN_THREADS];
+    int i;
+
+    for(i = 0; i < N_INTERN_THREADS; i++)
+        threads[i] = start_thread(intern_thread, parent);
+    for(i = 0; i < N_INTERN_THREADS; i++)
+        paths[i] = g_thread_join(threads[i]);
+    /* all threads should get the same path */
+    for(i = 1; i < N_INTERN_THREADS; i++)
+        g_assert(paths[i] == paths[0]);
+    for(i = 0; i < N_INTERN_THREADS; i++)
+        fm_path_unref(paths[i]);
+    fm_path_unref(parent);
+}
+
+static void test_path_recreate()
+{
+    FmPath* parent = fm_path_new_for_path("/test-fm-path");
+    GThread* threads[N_INTERN_THREADS];
+    FmPath* path, *path2;
+    int i;
+
+    /* the path is freed here and a new one should be made */
+    path = fm_path_new_child(parent, "dropped");
+    fm_path_unref(path);
+    path = fm_path_new_child(parent, "dropped");
+    g_assert(fm_path_get_parent(path) == parent);
+    g_assert_cmpstr(fm_path_get_basename(path), ==, "dropped");
+    /* and the new one should be reused while it's alive */
+    path2 = fm_path_new_child(parent, "dropped");
+    g_assert(path2 == path);
+    fm_path_unref(path2);
+    fm_path_unref(path);
+
+    for(i = 0; i < N_INTERN_THREADS; i++)
+        threads[i] = start_thread(churn_thread, parent);
+    for(i = 0; i < N_INTERN_THREADS; i++)
+        g_thread_join(threads[i]);
+    fm_path_unref(parent);
+}
+
+static void test_path_hash()
+{
+    FmPath* parent = fm_path_new_for_path("/test-fm-path");
+    char* name = g_strnfill(4000, 'a');
+    char* str = g_strconcat("/test-fm-path/", name, "/", name, NULL);
+    FmPath *child, *path, *path2, *other;
+
+    /* the same path made in different ways */
+    child = fm_path_new_child(parent, name);
+    path = fm_path_new_child(child, name);
+    path2 = fm_path_new_for_str(str);
+    g_assert(path == path2);
+    g_assert(fm_path_equal(path, path2));
+    g_assert_cmpuint(fm_path_hash(path), ==, fm_path_hash(path2));
+    g_assert(!fm_path_equal(path, child));
+
+    /* differs only in last character */
+    name[3999] = 'b';
+    other = fm_path_new_child(child, name);
+    g_assert(other != path);
+    g_assert(!fm_path_equal(path, other));
+
+    fm_path_unref(other);
+    fm_path_unref(path2);
+    fm_path_unref(path);
+    fm_path_unref(child);
+    fm_path_unref(parent);
+    g_free(str);
+    g_free(name);
+}
+
 int main (int   argc, char *argv[])
 {
 #if !GLIB_CHECK_VERSION(2, 36, 0)
@@ -454,6 +575,9 @@ int main (int   argc, char *argv[])
     g_test_add_func("/FmPath/path_parsing", test_path_parsing);
     g_test_add_func("/FmPath/uri_parsing", test_uri_parsing);
     g_test_add_func("/FmPath/predefined_paths", test_predefined_paths);
+    g_test_add_func("/FmPath/intern_threads", test_path_intern_threads);
+    g_test_add_func("/FmPath/recreate", test_path_recreate);
+    g_test_add_func("/FmPath/hash", test_path_hash);
 
     return g_test_run();
 }
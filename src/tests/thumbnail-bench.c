@@ -0,0 +1,407 @@
+/*
+ *      thumbnail-bench.c
+ *
+ *      This file is a part of the Libfm library.
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/* Benchmark of FmThumbnailLoader.
+ * It creates a corpus of JPEG, PNG and SVG files in a temporary directory,
+ * points thumbnail cache into the same directory and requests thumbnails
+ * for all files three times: with empty disk cache (generation), with
+ * disk cache only, and with thumbnails kept in memory. Images are handled
+ * by a backend based on GdkPixbuf which doesn't need any display. */
+
+#include <fm.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* this function prototype is missing in header files of some GdkPixbuf versions */
+gboolean gdk_pixbuf_set_option(GdkPixbuf *pixbuf, const gchar *key, const gchar *value);
+
+static int n_files = 100;
+static int image_width = 1600;
+static int image_height = 1200;
+static int thumb_size = 128;
+static gboolean use_pack = FALSE;
+static gboolean keep_files = FALSE;
+
+static GOptionEntry option_entries[] =
+{
+    { "count", 'n', 0, G_OPTION_ARG_INT, &n_files, "Number of files of each type", "N" },
+    { "width", 0, 0, G_OPTION_ARG_INT, &image_width, "Width of images", "PIXELS" },
+    { "height", 0, 0, G_OPTION_ARG_INT, &image_height, "Height of images", "PIXELS" },
+    { "size", 's', 0, G_OPTION_ARG_INT, &thumb_size, "Requested thumbnail size", "PIXELS" },
+    { "pack", 'p', 0, G_OPTION_ARG_NONE, &use_pack, "Use per-folder thumbnail packs", NULL },
+    { "keep", 'k', 0, G_OPTION_ARG_NONE, &keep_files, "Don't remove corpus and cache", NULL },
+    { NULL }
+};
+
+/* ---- headless backend ---- */
+
+static GObject* read_image_from_file(const char* filename)
+{
+    return (GObject*)gdk_pixbuf_new_from_file(filename, NULL);
+}
+
+static GObject* read_image_from_file_at_size(const char* filename, int size,
+                                             int* width, int* height)
+{
+    if (!gdk_pixbuf_get_file_info(filename, width, height))
+        return NULL;
+    if (*width <= size && *height <= size)
+        return (GObject*)gdk_pixbuf_new_from_file(filename, NULL);
+    return (GObject*)gdk_pixbuf_new_from_file_at_size(filename, size, size, NULL);
+}
+
+static GObject* read_image_from_stream(GInputStream* stream, guint64 len, GCancellable* cancellable)
+{
+    return (GObject*)gdk_pixbuf_new_from_stream(stream, cancellable, NULL);
+}
+
+static gboolean write_image(GObject* image, const char* filename)
+{
+    GdkPixbuf *pix = GDK_PIXBUF(image);
+    return gdk_pixbuf_save(pix, filename, "png", NULL,
+                           "tEXt::Thumb::URI", gdk_pixbuf_get_option(pix, "tEXt::Thumb::URI"),
+                           "tEXt::Thumb::MTime", gdk_pixbuf_get_option(pix, "tEXt::Thumb::MTime"),
+                           NULL);
+}
+
+static gboolean set_image_text(GObject* image, const char* key, const char* val)
+{
+    return gdk_pixbuf_set_option(GDK_PIXBUF(image), key, val);
+}
+
+static GObject* scale_image(GObject* ori_pix, int new_width, int new_height)
+{
+    return (GObject*)gdk_pixbuf_scale_simple(GDK_PIXBUF(ori_pix), new_width, new_height, GDK_INTERP_BILINEAR);
+}
+
+static int get_image_width(GObject* image)
+{
+    return gdk_pixbuf_get_width(GDK_PIXBUF(image));
+}
+
+static int get_image_height(GObject* image)
+{
+    return gdk_pixbuf_get_height(GDK_PIXBUF(image));
+}
+
+static char* get_image_text(GObject* image, const char* key)
+{
+    return g_strdup(gdk_pixbuf_get_option(GDK_PIXBUF(image), key));
+}
+
+static GObject* rotate_image(GObject* image, int degree)
+{
+    return (GObject*)gdk_pixbuf_rotate_simple(GDK_PIXBUF(image), (GdkPixbufRotation)degree);
+}
+
+static FmThumbnailLoaderBackend headless_backend = {
+    read_image_from_file,
+    read_image_from_stream,
+    write_image,
+    scale_image,
+    rotate_image,
+    get_image_width,
+    get_image_height,
+    get_image_text,
+    set_image_text
+};
+
+/* ---- corpus ---- */
+
+static GdkPixbuf* make_pixbuf(int n)
+{
+    GdkPixbuf* pix = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, image_width, image_height);
+    int rowstride = gdk_pixbuf_get_rowstride(pix);
+    guchar* pixels = gdk_pixbuf_get_pixels(pix);
+    int x, y;
+
+    /* some texture so compression doesn't make it trivial */
+    for (y = 0; y < image_height; y++)
+    {
+        guchar* p = pixels + y * rowstride;
+        for (x = 0; x < image_width; x++, p += 3)
+        {
+            p[0] = (x * 255 / image_width + n * 17) & 0xff;
+            p[1] = (y * 255 / image_height) & 0xff;
+            p[2] = ((x ^ y) + n) & 0xff;
+        }
+    }
+    return pix;
+}
+
+static gboolean make_corpus(const char* dir)
+{
+    int i;
+
+    g_mkdir_with_parents(dir, 0700);
+    for (i = 0; i < n_files; i++)
+    {
+        GdkPixbuf* pix = make_pixbuf(i);
+        char* name;
+        char* svg;
+        GError* err = NULL;
+
+        name = g_strdup_printf("%s/image-%04d.jpg", dir, i);
+        if (!gdk_pixbuf_save(pix, name, "jpeg", &err, "quality", "90", NULL))
+            goto _failed;
+        g_free(name);
+        name = g_strdup_printf("%s/image-%04d.png", dir, i);
+        if (!gdk_pixbuf_save(pix, name, "png", &err, NULL))
+            goto _failed;
+        g_free(name);
+        g_object_unref(pix);
+
+        name = g_strdup_printf("%s/image-%04d.svg", dir, i);
+        svg = g_strdup_printf("<?xml version=\"1.0\"?>\n"
+                              "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\">\n"
+                              "<rect width=\"100%%\" height=\"100%%\" fill=\"#%06x\"/>\n"
+                              "<circle cx=\"50%%\" cy=\"50%%\" r=\"40%%\" fill=\"#%06x\"/>\n"
+                              "<text x=\"10%%\" y=\"20%%\" font-size=\"%d\">%d</text>\n"
+                              "</svg>\n", image_width, image_height,
+                              (i * 0x10305) & 0xffffff, (i * 0x30501) & 0xffffff,
+                              image_height / 10, i);
+        if (!g_file_set_contents(name, svg, -1, &err))
+        {
+            g_free(svg);
+            pix = NULL;
+            goto _failed;
+        }
+        g_free(svg);
+        g_free(name);
+        continue;
+
+_failed:
+        g_printerr("cannot create %s: %s\n", name, err->message);
+        g_error_free(err);
+        g_free(name);
+        if (pix)
+            g_object_unref(pix);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static GPtrArray* list_corpus(const char* dir)
+{
+    GPtrArray* files = g_ptr_array_new();
+    GDir* gdir = g_dir_open(dir, 0, NULL);
+    const char* name;
+
+    while ((name = g_dir_read_name(gdir)))
+    {
+        char* path_str = g_build_filename(dir, name, NULL);
+        FmPath* path = fm_path_new_for_path(path_str);
+        FmFileInfo* fi = fm_file_info_new_from_native_file(path, path_str, NULL);
+        if (fi)
+            g_ptr_array_add(files, fi);
+        fm_path_unref(path);
+        g_free(path_str);
+    }
+    g_dir_close(gdir);
+    return files;
+}
+
+static void remove_tree(const char* path)
+{
+    GDir* dir = g_dir_open(path, 0, NULL);
+    if (dir)
+    {
+        const char* name;
+        while ((name = g_dir_read_name(dir)))
+        {
+            char* child = g_build_filename(path, name, NULL);
+            remove_tree(child);
+            g_free(child);
+        }
+        g_dir_close(dir);
+        g_rmdir(path);
+    }
+    else
+        g_unlink(path);
+}
+
+/* ---- measurement ---- */
+
+static GMainLoop* main_loop;
+static gint64* start_times;
+static gint64* latencies;
+static guint n_pending;
+static guint n_ready;
+
+static inline gint64 now_usec(void)
+{
+#if GLIB_CHECK_VERSION(2, 28, 0)
+    return g_get_monotonic_time();
+#else
+    GTimeVal tv;
+    g_get_current_time(&tv);
+    return (gint64)tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+#endif
+}
+
+static void on_thumbnail_ready(FmThumbnailLoader* req, gpointer user_data)
+{
+    guint i = GPOINTER_TO_UINT(user_data);
+
+    latencies[i] = now_usec() - start_times[i];
+    if (fm_thumbnail_loader_get_data(req))
+        n_ready++;
+    if (--n_pending == 0)
+        g_main_loop_quit(main_loop);
+}
+
+static int compare_latency(gconstpointer a, gconstpointer b)
+{
+    gint64 la = *(const gint64*)a, lb = *(const gint64*)b;
+    return la < lb ? -1 : la > lb;
+}
+
+static void run_phase(const char* title, GPtrArray* files, gboolean quiet)
+{
+    FmThumbnailLoaderStats stats;
+    gint64 start, elapsed, sum = 0;
+    guint i, n = files->len;
+
+    fm_thumbnail_loader_reset_stats();
+    n_pending = n;
+    n_ready = 0;
+    start = now_usec();
+    for (i = 0; i < n; i++)
+    {
+        start_times[i] = now_usec();
+        fm_thumbnail_loader_load(files->pdata[i], thumb_size,
+                                 on_thumbnail_ready, GUINT_TO_POINTER(i));
+    }
+    fm_thumbnail_loader_get_stats(&stats);
+    g_main_loop_run(main_loop);
+    elapsed = now_usec() - start;
+    if (quiet)
+        return;
+
+    for (i = 0; i < n; i++)
+        sum += latencies[i];
+    qsort(latencies, n, sizeof(gint64), compare_latency);
+    g_print("%s:\n", title);
+    g_print("  %u files, %u thumbnails in %.1f ms, %.1f files/s\n", n, n_ready,
+            elapsed / 1000.0, n * (double)G_USEC_PER_SEC / MAX(elapsed, 1));
+    g_print("  latency: mean %.2f ms, median %.2f ms, p95 %.2f ms, max %.2f ms\n",
+            sum / 1000.0 / n, latencies[n / 2] / 1000.0,
+            latencies[n * 95 / 100] / 1000.0, latencies[n - 1] / 1000.0);
+    g_print("  queue depth after requests: loader %u, generator %u\n",
+            stats.loader_queue, stats.generator_queue);
+    fm_thumbnail_loader_get_stats(&stats);
+    g_print("  memory hits %" G_GUINT64_FORMAT ", disk hits %" G_GUINT64_FORMAT
+            ", misses %" G_GUINT64_FORMAT "\n",
+            stats.memory_hits, stats.disk_hits, stats.misses);
+    g_print("  generated %" G_GUINT64_FORMAT " in %.1f ms, thumbnailers %"
+            G_GUINT64_FORMAT " in %.1f ms\n",
+            stats.generated, stats.generation_time / 1000.0,
+            stats.thumbnailer_runs, stats.thumbnailer_time / 1000.0);
+}
+
+int main(int argc, char** argv)
+{
+    GOptionContext* context;
+    GError* err = NULL;
+    FmConfig* config;
+    GPtrArray* files;
+    char* base_dir;
+    char* cache_dir;
+    char* corpus_dir;
+    int default_cache_size;
+    gint64 start;
+
+    context = g_option_context_new("- benchmark of thumbnail loader");
+    g_option_context_add_main_entries(context, option_entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &err))
+    {
+        g_printerr("%s\n", err->message);
+        return 1;
+    }
+    g_option_context_free(context);
+    if (n_files <= 0 || image_width <= 0 || image_height <= 0 || thumb_size <= 0)
+    {
+        g_printerr("all numbers should be positive\n");
+        return 1;
+    }
+
+    base_dir = g_build_filename(g_get_tmp_dir(), "fm-thumbnail-bench-XXXXXX", NULL);
+    if (!mkdtemp(base_dir))
+    {
+        g_printerr("cannot create temporary directory\n");
+        return 1;
+    }
+    /* thumbnail loader takes cache location once so set it before init */
+    cache_dir = g_build_filename(base_dir, "cache", NULL);
+    g_setenv("XDG_CACHE_HOME", cache_dir, TRUE);
+    corpus_dir = g_build_filename(base_dir, "corpus", NULL);
+
+    /* don't use user's settings */
+    config = fm_config_new();
+    fm_init(config);
+    g_object_unref(config);
+    if (!fm_thumbnail_loader_set_backend(&headless_backend))
+        g_error("failed to set backend for thumbnail loader");
+    fm_thumbnail_loader_set_read_at_size_func(read_image_from_file_at_size);
+    fm_config->thumbnail_max = 0; /* no size limit */
+    fm_config->thumbnail_pack = use_pack;
+    default_cache_size = fm_config->thumbnail_cache_size;
+
+    g_print("creating %d JPEG, PNG and SVG files of %dx%d in %s\n",
+            n_files, image_width, image_height, corpus_dir);
+    start = now_usec();
+    if (!make_corpus(corpus_dir))
+        return 1;
+    g_print("  done in %.1f ms\n", (now_usec() - start) / 1000.0);
+    files = list_corpus(corpus_dir);
+    start_times = g_new(gint64, files->len);
+    latencies = g_new(gint64, files->len);
+    main_loop = g_main_loop_new(NULL, FALSE);
+
+    /* disk cache only: keep nothing in memory */
+    fm_config->thumbnail_cache_size = 0;
+    run_phase("cold cache (generation)", files, FALSE);
+    run_phase("warm disk cache", files, FALSE);
+    if (use_pack) /* previous run filled packs */
+        run_phase("warm disk cache with packs", files, FALSE);
+
+    fm_config->thumbnail_cache_size = default_cache_size;
+    run_phase(NULL, files, TRUE); /* fill memory cache */
+    run_phase("in-memory cache", files, FALSE);
+
+    g_main_loop_unref(main_loop);
+    g_ptr_array_foreach(files, (GFunc)fm_file_info_unref, NULL);
+    g_ptr_array_free(files, TRUE);
+    g_free(start_times);
+    g_free(latencies);
+    fm_finalize();
+
+    if (keep_files)
+        g_print("corpus and cache are kept in %s\n", base_dir);
+    else
+        remove_tree(base_dir);
+    g_free(corpus_dir);
+    g_free(cache_dir);
+    g_free(base_dir);
+    return 0;
+}